@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+// Microbenchmarks run by 'p2pbench --bench <name>' instead of the mesh. Each one runs on the
+// calling thread, times 'count' operations or items (its own default if 0) and writes one JSON
+// object to 'out'. 'vnet' is a scale run rather than a microbenchmark, its 'count' is the number of
+// simulated hosts.
+
+void benchTimers(FILE* out, size_t count);
+void benchClock(FILE* out, size_t count);
+void benchPoolIterate(FILE* out, size_t count);
+void benchPoolAlloc(FILE* out, size_t count);
+void benchPoolSoA(FILE* out, size_t count);
+void benchLog(FILE* out, size_t count);
+void benchVirtualNetwork(FILE* out, size_t count);
@@ -0,0 +1,55 @@
+#include "benches.h"
+#include "tools.h"
+
+#include <chrono>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+
+// Cost of one time query for every source the host can read: the per-thread cached time the
+// protocol code uses, the tick refreshing it, the TSC behind 'preciseNs' (steady_clock if the
+// CPU has no invariant TSC), the raw instruction, and steady_clock itself. Readings are summed,
+// so none of the calls can be dropped.
+
+namespace {
+	const size_t DEFAULT_COUNT = 10000000;
+
+	volatile uint64_t g_sink;
+
+	template <typename Query>
+	double nsPerQuery(size_t count, Query query)
+	{
+		uint64_t sum = 0;
+		uint64_t start = Clock::preciseNs();
+		for (size_t i = 0; i < count; ++i) {
+			sum += query();
+		}
+		uint64_t elapsed = Clock::preciseNs() - start;
+		g_sink = sum;
+		return (double)elapsed / count;
+	}
+}
+
+void benchClock(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_COUNT;
+	bool tsc = Clock::calibrateTsc();
+
+	Clock::tick();
+	double cached = nsPerQuery(count, []() { return Clock::nowUs(); });
+	double tick = nsPerQuery(count, []() { Clock::tick(); return (uint64_t)0; });
+	double precise = nsPerQuery(count, []() { return Clock::preciseNs(); });
+	double rdtsc = nsPerQuery(count, []() { return (uint64_t)__rdtsc(); });
+	double chrono = nsPerQuery(count, []() { return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count(); });
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"clock\",\n");
+	fprintf(out, "  \"config\": {\"queries\": %u, \"invariant_tsc\": %s},\n", (uint32_t)count, tsc ? "true" : "false");
+	fprintf(out, "  \"ns_per_query\": {\"now_us\": %.2f, \"tick\": %.2f, \"precise_ns\": %.2f, \"rdtsc\": %.2f, \"steady_clock\": %.2f}\n",
+		cached, tick, precise, rdtsc, chrono);
+	fprintf(out, "}\n");
+}
@@ -0,0 +1,64 @@
+#include "benches.h"
+#include "log.h"
+#include "socket.h"
+#include "tools.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+
+// Cost of a LOG call on the calling thread: compiled out, filtered out at runtime (with an argument
+// which would allocate if it were evaluated), and enabled with plain and string arguments. Enabled
+// calls go in batches smaller than the thread's ring, which is flushed between them untimed, so no
+// call hits a full ring. The writer thread formats them into a temporary file.
+
+namespace {
+	const size_t DEFAULT_COUNT = 10000000;
+	const size_t ENABLED_SHARE = 100;    // enabled calls are 'count' / ENABLED_SHARE, each one writes a line
+	const size_t BATCH = 256;
+	const int LEVEL = 1;
+	char const* const LOG_PATH = "p2pbench_log.tmp";
+
+	template <typename Call>
+	double nsPerCall(size_t count, size_t batch, Call call)
+	{
+		uint64_t elapsed = 0;
+		for (size_t done = 0; done < count; ) {
+			size_t end = std::min(count, done + batch);
+			uint64_t start = Clock::preciseNs();
+			for (; done < end; ++done) {
+				call(done);
+			}
+			elapsed += Clock::preciseNs() - start;
+			log_flush();
+		}
+		return (double)elapsed / count;
+	}
+}
+
+void benchLog(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_COUNT;
+	size_t enabledCount = std::max<size_t>(count / ENABLED_SHARE, 1);
+	NetAddress address = NetAddress::ipv4(10, 0, 0, 1, 5000);
+
+	log_configure(-1, -1, -1, nullptr);
+	double compiledOut = nsPerCall(count, count, [](size_t i) { LOG(LOG_MAX_LEVEL + 1, "bench: compiled out %u", (uint32_t)i); });
+	double disabled = nsPerCall(count, count, [](size_t i) { LOG(LEVEL, "bench: disabled %u", (uint32_t)i); });
+	double disabledString = nsPerCall(count, count, [&address](size_t) { LOG(LEVEL, "bench: disabled '%s'", toString(address).c_str()); });
+
+	remove(LOG_PATH);
+	log_configure(-1, 0, LEVEL, LOG_PATH);
+	double enabled = nsPerCall(enabledCount, BATCH, [](size_t i) { LOG(LEVEL, "bench: enabled %u/%u", (uint32_t)i, (uint32_t)(i * 7)); });
+	double enabledString = nsPerCall(enabledCount, BATCH, [&address](size_t) { LOG(LEVEL, "bench: enabled '%s'", toString(address).c_str()); });
+	log_configure(-1, -1, -1, nullptr);
+	remove(LOG_PATH);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"log\",\n");
+	fprintf(out, "  \"config\": {\"disabled_calls\": %u, \"enabled_calls\": %u, \"batch\": %u, \"max_level\": %d},\n",
+		(uint32_t)count, (uint32_t)enabledCount, (uint32_t)BATCH, LOG_MAX_LEVEL);
+	fprintf(out, "  \"ns_per_call\": {\"compiled_out\": %.2f, \"disabled\": %.2f, \"disabled_string_arg\": %.2f, \"enabled\": %.2f, \"enabled_string_arg\": %.2f}\n",
+		compiledOut, disabled, disabledString, enabled, enabledString);
+	fprintf(out, "}\n");
+}
@@ -0,0 +1,483 @@
+#include "benches.h"
+#include "host.h"
+#include "latency.h"
+#include "log.h"
+#include "net_thread.h"
+#include "packet.h"
+#include "socket.h"
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Loopback data-plane benchmark: N hosts in one process form a mesh through host 0 (the master),
+// then every host sends messages of 'size' bytes to its peers round-robin at 'rate' messages per
+// second. All hosts are driven by one thread, so results don't depend on the scheduler and the
+// latency includes the time a datagram waits for its host to be updated.
+// The loop polls, so CPU per message is only meaningful at saturation ('--rate 0').
+// With '--consumer-delay' the last host runs in threaded mode (NetThread) behind an application
+// thread spending that long on every message, and all other hosts send to it only: the run shows
+// what the event ring drops and that connection events still get through. Rates then count all
+// measured messages the consumer got by the end of the run.
+// With '--bench' one of the microbenchmarks (see benches.h) runs instead of the mesh.
+// Results are printed as one JSON object, diagnostics go to stderr.
+
+namespace {
+	struct Options {
+		size_t peers = 4;
+		size_t size = 256;            // message payload, the bench header included
+		size_t rate = 10000;          // messages per second per host, 0 - one per loop iteration
+		size_t duration = 5;          // seconds of measurement
+		size_t warmup = 1;            // seconds of traffic before the measurement
+		uint16_t basePort = 49000;
+		int logLevel = -1;
+		std::string output;           // JSON file, stdout if empty
+		size_t consumerDelay = 0;     // microseconds the threaded consumer spends per message, 0 - no consumer
+		std::string bench = "mesh";
+		size_t count = 0;             // operations or items of a microbenchmark, 0 - its default
+	};
+
+	struct Bench {
+		char const* name;
+		void (*run)(FILE* out, size_t count);
+	};
+
+	const Bench BENCHES[] = {
+		{ "timers", benchTimers },
+		{ "clock", benchClock },
+		{ "pool_iterate", benchPoolIterate },
+		{ "pool_alloc", benchPoolAlloc },
+		{ "pool_soa", benchPoolSoA },
+		{ "log", benchLog },
+		{ "vnet", benchVirtualNetwork },
+	};
+
+	struct BenchHeader {
+		uint64_t sentNs;
+		uint32_t sequence;
+		uint32_t measured;            // sent during the measurement
+	};
+
+	const int BENCH_MSG_ID = 1;
+	const size_t MESH_TIMEOUT_MS = 20000;
+	const size_t DRAIN_MS = 500;
+	const size_t MAX_BURST = 64;      // messages one host sends per loop iteration at most
+
+	struct Stats {
+		uint64_t sent = 0;
+		uint64_t sendFailed = 0;
+		uint64_t received = 0;
+		uint64_t bytes = 0;
+		LatencyHistogram latency;
+	};
+
+	class BenchClient : public INetClient {
+	public:
+		explicit BenchClient(Stats& stats, uint64_t delayNs = 0) : m_stats(stats), m_delayNs(delayNs), m_connections(0) {}
+
+		uint64_t connections() const { return m_connections; }
+
+		virtual void onPeerConnected(PeerId) override { m_connections += 1; }
+		virtual void onPeerDisconnected(PeerId) override {}
+		virtual void onMessageReceived(PeerId, int, CBytes) override {}
+		virtual void onMessageReceived(PeerId, int id, Packet msg) override
+		{
+			if (id != BENCH_MSG_ID || msg.size() < sizeof(BenchHeader)) {
+				return;
+			}
+			BenchHeader const* header = (BenchHeader const*)msg.data();
+			if (header->measured != 0) {
+				m_stats.received += 1;
+				m_stats.bytes += msg.size();
+				m_stats.latency.record(Clock::preciseNs() - header->sentNs);
+			}
+
+			// a slow application, busy rather than sleeping so the delay doesn't depend on the scheduler
+			uint64_t until = Clock::preciseNs() + m_delayNs;
+			while (m_delayNs != 0 && Clock::preciseNs() < until) {
+			}
+		}
+
+	private:
+		Stats& m_stats;
+		uint64_t m_delayNs;
+		uint64_t m_connections;
+	};
+
+	struct BenchHost {
+		Socket socket;
+		std::unique_ptr<BenchClient> client;
+		std::unique_ptr<NetHost> ownHost;
+		std::unique_ptr<NetThread> thread;   // the consumer, its I/O thread drives the host once started
+		NetHost* host = nullptr;
+		bool threaded = false;               // the I/O thread is started
+		std::vector<PeerId> peers;    // connected ones, filled once the mesh is formed
+		size_t nextPeer = 0;
+		uint64_t nextSendNs = 0;
+		uint32_t sequence = 0;
+	};
+
+	void print_help()
+	{
+		printf("<command>        <argtype>   <info>\n");
+		printf("--bench          [string]    'mesh' or a microbenchmark:");
+		for (Bench const& bench : BENCHES) {
+			printf(" '%s'", bench.name);
+		}
+		printf(" ('mesh' by default)\n");
+		printf("--count          [int]       Operations or items of a microbenchmark (its own default if '0')\n");
+		printf("--peers          [int]       Hosts in the mesh, master included ('4' by default)\n");
+		printf("--size           [int]       Message size in bytes ('256' by default)\n");
+		printf("--rate           [int]       Messages per second sent by every host, '0' - saturate ('10000' by default)\n");
+		printf("--duration       [int]       Seconds of measurement ('5' by default)\n");
+		printf("--warmup         [int]       Seconds of traffic before measurement ('1' by default)\n");
+		printf("--port           [int]       First loopback port, hosts take consecutive ones ('49000' by default)\n");
+		printf("--verbose        [int]       Log level printed to stderr (disabled by default)\n");
+		printf("--output         [string]    Write JSON to file instead of stdout\n");
+		printf("--consumer-delay [int]       Microseconds a threaded consumer spends per message, all traffic goes to it (disabled by default)\n");
+	}
+
+	bool read_options(int argc, char const* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help") || i + 1 == argc) {
+				print_help();
+				return false;
+			}
+
+			char const* value = argv[++i];
+			if (!strcmp(argv[i - 1], "--peers")) {
+				options.peers = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--size")) {
+				options.size = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--rate")) {
+				options.rate = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--duration")) {
+				options.duration = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--warmup")) {
+				options.warmup = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--port")) {
+				options.basePort = (uint16_t)strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--verbose")) {
+				options.logLevel = strtol(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--output")) {
+				options.output = value;
+			} else if (!strcmp(argv[i - 1], "--consumer-delay")) {
+				options.consumerDelay = strtoul(value, NULL, 10);
+			} else if (!strcmp(argv[i - 1], "--bench")) {
+				options.bench = value;
+			} else if (!strcmp(argv[i - 1], "--count")) {
+				options.count = strtoul(value, NULL, 10);
+			} else {
+				fprintf(stderr, "Unknown option '%s'.\n", argv[i - 1]);
+				return false;
+			}
+		}
+
+		if (options.bench != "mesh") {
+			for (Bench const& bench : BENCHES) {
+				if (options.bench == bench.name) {
+					return true;
+				}
+			}
+			fprintf(stderr, "Unknown benchmark '%s'.\n", options.bench.c_str());
+			return false;
+		}
+		if (options.peers < 2 || options.size < sizeof(BenchHeader) || options.size > Packet::MAX_PAYLOAD || options.duration == 0) {
+			fprintf(stderr, "Invalid options: at least 2 peers, message size from %u to %u bytes, non-zero duration.\n",
+				(uint32_t)sizeof(BenchHeader), (uint32_t)Packet::MAX_PAYLOAD);
+			return false;
+		}
+		return true;
+	}
+
+	// User and kernel time of the whole process.
+	uint64_t cpuTimeNs()
+	{
+		FILETIME creation, exitTime, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user)) {
+			return 0;
+		}
+		uint64_t kernel100ns = (uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+		uint64_t user100ns = (uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+		return (kernel100ns + user100ns) * 100;
+	}
+
+	// Returns nullptr if the file can't be opened.
+	FILE* openOutput(Options const& options)
+	{
+		FILE* out = stdout;
+		if (!options.output.empty() && fopen_s(&out, options.output.c_str(), "wb") != 0) {
+			fprintf(stderr, "Unable to open '%s'.\n", options.output.c_str());
+			return nullptr;
+		}
+		return out;
+	}
+
+	int runBench(Options const& options)
+	{
+		FILE* out = openOutput(options);
+		if (out == nullptr) {
+			return 1;
+		}
+		for (Bench const& bench : BENCHES) {
+			if (options.bench == bench.name) {
+				bench.run(out, options.count);
+			}
+		}
+		if (out != stdout) {
+			fclose(out);
+		}
+		return 0;
+	}
+
+	size_t connectedPeers(BenchHost& bench, bool collect)
+	{
+		size_t count = 0;
+		bench.host->queryPeerInfos([&](PeerId peer, NetHost::PeerInfo const& info) {
+			if (info.status == NetHost::PeerInfo::Connected) {
+				count += 1;
+				if (collect) {
+					bench.peers.push_back(peer);
+				}
+			}
+		});
+		return count;
+	}
+
+	// Hosts driven by the benchmark thread, the consumer only until its I/O thread starts.
+	bool driven(BenchHost const& bench)
+	{
+		return !bench.threaded;
+	}
+
+	void updateAll(std::vector<std::unique_ptr<BenchHost>>& hosts)
+	{
+		for (auto& bench : hosts) {
+			if (driven(*bench)) {
+				bench->host->update();
+			}
+		}
+	}
+
+	// Returns false if the host doesn't get all peers connected in time.
+	bool waitMesh(std::vector<std::unique_ptr<BenchHost>>& hosts, size_t index)
+	{
+		uint64_t deadline = Clock::preciseUs() / 1000 + MESH_TIMEOUT_MS;
+		while (Clock::preciseUs() / 1000 < deadline) {
+			updateAll(hosts);
+			bool done = true;
+			for (size_t i = 0; i <= index && done; ++i) {
+				done = connectedPeers(*hosts[i], false) == index;
+			}
+			if (done) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// NetHost receives one datagram per update, so without a rate limit every host sends one message
+	// per loop iteration; faster senders would only measure socket buffer overflows.
+	void sendDue(BenchHost& bench, Options const& options, uint64_t now, bool measured, Stats& stats)
+	{
+		const uint64_t intervalNs = options.rate != 0 ? 1000000000ull / options.rate : 0;
+		const size_t maxBurst = options.rate != 0 ? MAX_BURST : 1;
+		if (bench.nextSendNs == 0 || bench.nextSendNs + 1000000000ull < now) {
+			// first call or a long stall, don't try to catch up
+			bench.nextSendNs = now;
+		}
+
+		for (size_t burst = 0; burst < maxBurst && bench.nextSendNs <= now; ++burst) {
+			Packet msg = Packet::alloc(options.size);
+			memset(msg.data(), 0, msg.size());
+			BenchHeader* header = (BenchHeader*)msg.data();
+			header->sequence = bench.sequence++;
+			header->measured = measured ? 1 : 0;
+			header->sentNs = Clock::preciseNs();
+
+			PeerId peer = bench.peers[bench.nextPeer];
+			bench.nextPeer = (bench.nextPeer + 1) % bench.peers.size();
+			bool sent = bench.host->send(peer, BENCH_MSG_ID, std::move(msg));
+			if (measured) {
+				stats.sent += sent ? 1 : 0;
+				stats.sendFailed += sent ? 0 : 1;
+			}
+			bench.nextSendNs += intervalNs;
+		}
+	}
+
+	void runTraffic(std::vector<std::unique_ptr<BenchHost>>& hosts, Options const& options, uint64_t durationNs, bool measured, Stats& stats)
+	{
+		uint64_t start = Clock::preciseNs();
+		uint64_t now = start;
+		while (now - start < durationNs) {
+			for (auto& bench : hosts) {
+				if (driven(*bench)) {
+					sendDue(*bench, options, now, measured, stats);
+					bench->host->update();
+				}
+			}
+			now = Clock::preciseNs();
+		}
+	}
+
+	struct ConsumerStats {
+		NetThread::Stats thread;
+		uint64_t connections;     // connection events the application got
+	};
+
+	// Rates count messages received during the measurement, late ones only make them not lost.
+	void writeJson(FILE* out, Options const& options, Stats const& stats, uint64_t inTime, uint64_t bytesInTime, double seconds, uint64_t cpuNs,
+		ConsumerStats const* consumer)
+	{
+		LatencyHistogram::Summary latency = stats.latency.summary();
+		uint64_t lost = stats.sent > stats.received ? stats.sent - stats.received : 0;
+		double perSecond = inTime / seconds;
+
+		fprintf(out, "{\n");
+		fprintf(out, "  \"config\": {\"peers\": %u, \"size\": %u, \"rate\": %u, \"duration_s\": %u, \"warmup_s\": %u},\n",
+			(uint32_t)options.peers, (uint32_t)options.size, (uint32_t)options.rate, (uint32_t)options.duration, (uint32_t)options.warmup);
+		fprintf(out, "  \"sent\": %llu,\n", (unsigned long long)stats.sent);
+		fprintf(out, "  \"send_failed\": %llu,\n", (unsigned long long)stats.sendFailed);
+		fprintf(out, "  \"received\": %llu,\n", (unsigned long long)stats.received);
+		fprintf(out, "  \"lost\": %llu,\n", (unsigned long long)lost);
+		fprintf(out, "  \"elapsed_s\": %.3f,\n", seconds);
+		fprintf(out, "  \"packets_per_s\": %.1f,\n", perSecond);
+		fprintf(out, "  \"throughput_mbit_s\": %.3f,\n", bytesInTime * 8.0 / seconds / 1e6);
+		fprintf(out, "  \"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f},\n",
+			latency.p50 / 1000.0, latency.p99 / 1000.0, latency.p999 / 1000.0, latency.max / 1000.0);
+		fprintf(out, "  \"cpu_ns_per_msg\": %.1f%s\n", inTime != 0 ? (double)cpuNs / inTime : 0.0, consumer != nullptr ? "," : "");
+		if (consumer != nullptr) {
+			fprintf(out, "  \"consumer\": {\"delay_us\": %u, \"queued\": %llu, \"dropped\": %llu, \"parked\": %llu, \"connection_events\": %llu, \"peers\": %u}\n",
+				(uint32_t)options.consumerDelay, (unsigned long long)consumer->thread.received, (unsigned long long)consumer->thread.dropped,
+				(unsigned long long)consumer->thread.parked, (unsigned long long)consumer->connections, (uint32_t)(options.peers - 1));
+		}
+		fprintf(out, "}\n");
+	}
+}
+
+
+int main(int argc, char const* argv[])
+{
+	Options options;
+	if (!read_options(argc, argv, options)) {
+		return 2;
+	}
+
+	WinSock winSock;
+	if (!winSock.started) {
+		fprintf(stderr, "Unable to start WinSock [code 0x%08X].\n", WinSock::getLastError());
+		return 1;
+	}
+	log_configure(options.logLevel, -1, -1, nullptr);
+	Clock::calibrateTsc();
+	if (options.bench != "mesh") {
+		return runBench(options);
+	}
+
+	std::unique_ptr<Stats> stats(new Stats());
+	std::vector<std::unique_ptr<BenchHost>> hosts;
+	for (size_t i = 0; i < options.peers; ++i) {
+		std::unique_ptr<BenchHost> bench(new BenchHost());
+		if (!bench->socket.valid() || !bench->socket.bind(NetAddress::ipv4(127, 0, 0, 1, (uint16_t)(options.basePort + i)))) {
+			fprintf(stderr, "Unable to bind port %u [code 0x%08X].\n", (uint32_t)(options.basePort + i), WinSock::getLastError());
+			return 1;
+		}
+		if (options.consumerDelay != 0 && i + 1 == options.peers) {
+			// the application thread is the only one recording received messages, senders get none
+			bench->client.reset(new BenchClient(*stats, options.consumerDelay * 1000));
+			bench->thread.reset(new NetThread(false, bench->socket));
+			bench->host = &bench->thread->host();
+		} else {
+			bench->client.reset(new BenchClient(*stats));
+			bench->ownHost.reset(new NetHost(i == 0, bench->socket, { bench->client.get() }));
+			bench->host = bench->ownHost.get();
+		}
+		sprintf_s(bench->host->nickname, sizeof(bench->host->nickname), "bench%u", (uint32_t)i);
+		hosts.push_back(std::move(bench));
+	}
+
+	// hosts join one by one, every newcomer punches all the previous ones
+	NetAddress master = NetAddress::ipv4(127, 0, 0, 1, options.basePort);
+	for (size_t i = 1; i < hosts.size(); ++i) {
+		hosts[i]->host->connect(Array<NetAddress const>(&master, &master + 1), [i](int code) {
+			fprintf(stderr, "Host %u failed to connect, error code %d.\n", (uint32_t)i, code);
+		});
+		if (!waitMesh(hosts, i)) {
+			fprintf(stderr, "Mesh is not formed: host %u didn't connect all peers in %u ms.\n", (uint32_t)i, (uint32_t)MESH_TIMEOUT_MS);
+			return 1;
+		}
+	}
+	for (auto& bench : hosts) {
+		connectedPeers(*bench, true);
+	}
+	fprintf(stderr, "Mesh of %u hosts is formed.\n", (uint32_t)hosts.size());
+
+	BenchHost* consumer = options.consumerDelay != 0 ? hosts.back().get() : nullptr;
+	std::atomic<bool> consumerStop(false);
+	std::thread consumerThread;
+	if (consumer != nullptr) {
+		for (auto& bench : hosts) {
+			if (bench.get() == consumer) continue;
+			bench->peers.clear();
+			bench->host->queryPeerInfos([&](PeerId peer, NetHost::PeerInfo const& info) {
+				if (!strcmp(info.nickname, consumer->host->nickname)) {
+					bench->peers.push_back(peer);
+				}
+			});
+		}
+
+		consumer->thread->start();
+		consumer->threaded = true;
+		consumerThread = std::thread([consumer, &consumerStop]() {
+			while (!consumerStop.load(std::memory_order_acquire)) {
+				if (consumer->thread->poll(*consumer->client, 1) == 0) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	runTraffic(hosts, options, options.warmup * 1000000000ull, false, *stats);
+
+	uint64_t startNs = Clock::preciseNs();
+	uint64_t startCpuNs = cpuTimeNs();
+	runTraffic(hosts, options, options.duration * 1000000000ull, true, *stats);
+	double seconds = (Clock::preciseNs() - startNs) / 1e9;
+	uint64_t cpuNs = cpuTimeNs() - startCpuNs;
+
+	// messages still in flight are received, but not counted into the rates; the consumer's are counted once it's stopped
+	uint64_t receivedInTime = (consumer == nullptr) ? stats->received : 0;
+	uint64_t bytesInTime = (consumer == nullptr) ? stats->bytes : 0;
+	uint64_t drainEnd = Clock::preciseUs() / 1000 + DRAIN_MS;
+	while (Clock::preciseUs() / 1000 < drainEnd) {
+		updateAll(hosts);
+	}
+
+	ConsumerStats consumerStats;
+	if (consumer != nullptr) {
+		consumerStop.store(true, std::memory_order_release);
+		consumerThread.join();
+		consumer->thread->stop();
+		consumerStats.thread = consumer->thread->stats();
+		consumerStats.connections = consumer->client->connections();
+		receivedInTime = stats->received;
+		bytesInTime = stats->bytes;
+	}
+
+	FILE* out = openOutput(options);
+	if (out == nullptr) {
+		return 1;
+	}
+	writeJson(out, options, *stats, receivedInTime, bytesInTime, seconds, cpuNs, consumer != nullptr ? &consumerStats : nullptr);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
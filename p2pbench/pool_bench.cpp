@@ -0,0 +1,299 @@
+#include "benches.h"
+#include "latency.h"
+#include "socket.h"
+#include "tools.h"
+
+#include <memory>
+#include <vector>
+
+
+// Pool building blocks on peer-sized items.
+//
+// pool_iterate: 'count' slots of which 1, 10, 50 or 100 percent stay live, spread at random.
+// Pool iteration (occupancy bitmap) is compared with the full scan pools did before: every cell
+// of a flat array visited and its nonce checked.
+//
+// pool_alloc: 'count' allocations into an empty pool, each one timed on its own, with chunked
+// storage (the default) and with PoolVector, whose growth moves every live element.
+//
+// pool_soa: 'count' live peers laid out like NetHost's table, once as PoolSoA columns and once as
+// whole rows in a Pool. The scans are the hot loops of the host: status, address lookup of an
+// unknown sender and last-seen expiry, each reading one field of every peer.
+
+namespace {
+	const size_t DEFAULT_SLOTS = 1000000;
+	const uint32_t OCCUPANCY_PCT[] = { 1, 10, 50, 100 };
+	const uint64_t MIN_ITERATE_NS = 200000000;   // passes repeat until this much time is spent
+	const uint64_t SPIKE_NS = 10000;             // allocations slower than this are counted
+
+	// About the size of a peer entry.
+	struct Item {
+		uint64_t key;
+		uint8_t payload[56];
+	};
+
+	// Cell layout of the former vector-backed pool.
+	struct FlatCell {
+		uint32_t nonce;
+		uint32_t next;
+		Item value;
+	};
+
+	// NetHost's peer fields, the cold part is never touched by the scans.
+	enum class Status { Connecting, Connected, Disconnecting };
+	struct PeerDetails {
+		char nickname[32];
+		NetAddress grayAddress;
+		NetAddress whiteAddress;
+		uint32_t nat;
+	};
+	struct PeerField {
+		enum { Status, Address, LastSeen, Details };
+	};
+	using PeerColumns = PoolSoA<Status, NetAddress, uint64_t, PeerDetails>;
+
+	struct PeerRow {
+		Status status;
+		NetAddress address;
+		uint64_t lastSeen;
+		PeerDetails details;
+	};
+
+	volatile uint64_t g_sink;
+
+	uint64_t nextRandom(uint64_t& seed)
+	{
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		return seed >> 33;
+	}
+
+	// Average time of one pass of 'pass', ns.
+	template <typename Pass>
+	double timePasses(Pass pass, size_t& passes)
+	{
+		uint64_t sum = 0;
+		uint64_t start = Clock::preciseNs();
+		uint64_t elapsed = 0;
+		for (passes = 0; passes == 0 || elapsed < MIN_ITERATE_NS; ++passes) {
+			sum += pass();
+			elapsed = Clock::preciseNs() - start;
+		}
+		g_sink = sum;
+		return (double)elapsed / passes;
+	}
+
+	struct AllocStats {
+		LatencyHistogram latency;
+		size_t spikes = 0;
+		size_t slowest = 0;          // index of the slowest allocation
+		uint64_t totalNs = 0;
+	};
+
+	// The clock reads are included, the 'clock' bench shows their cost.
+	template <template <class> class StorageTy>
+	void timeAllocs(size_t count, AllocStats& stats)
+	{
+		std::unique_ptr<Pool<Item, StorageTy>> pool(new Pool<Item, StorageTy>());
+		uint64_t slowestNs = 0;
+		uint64_t start = Clock::preciseNs();
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t before = Clock::preciseNs();
+			pool->alloc();
+			uint64_t ns = Clock::preciseNs() - before;
+
+			stats.latency.record(ns);
+			stats.spikes += ns > SPIKE_NS ? 1 : 0;
+			if (ns > slowestNs) {
+				slowestNs = ns;
+				stats.slowest = i;
+			}
+		}
+		stats.totalNs = Clock::preciseNs() - start;
+	}
+
+	void printAllocs(FILE* out, char const* name, AllocStats const& stats, size_t count, bool last)
+	{
+		LatencyHistogram::Summary latency = stats.latency.summary();
+		fprintf(out, "  \"%s\": {\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, \"slowest_alloc\": %u, \"spikes\": %u, \"mean_ns\": %.1f}%s\n",
+			name, (unsigned long long)latency.p50, (unsigned long long)latency.p99, (unsigned long long)latency.p999, (unsigned long long)latency.max,
+			(uint32_t)stats.slowest, (uint32_t)stats.spikes, (double)stats.totalNs / count, last ? "" : ",");
+	}
+}
+
+void benchPoolIterate(FILE* out, size_t count)
+{
+	size_t slots = count != 0 ? count : DEFAULT_SLOTS;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"pool_iterate\",\n");
+	fprintf(out, "  \"config\": {\"slots\": %u, \"item_bytes\": %u},\n", (uint32_t)slots, (uint32_t)sizeof(Item));
+	fprintf(out, "  \"results\": [\n");
+	for (size_t i = 0; i < sizeof(OCCUPANCY_PCT) / sizeof(OCCUPANCY_PCT[0]); ++i) {
+		uint32_t occupancy = OCCUPANCY_PCT[i];
+
+		// both containers get the same live slots
+		std::unique_ptr<Pool<Item>> pool(new Pool<Item>());
+		std::vector<FlatCell> flat(slots);
+		std::vector<PoolHandle> handles(slots);
+		for (size_t slot = 0; slot < slots; ++slot) {
+			handles[slot] = pool->alloc();
+			pool->at(handles[slot]).key = slot;
+		}
+		uint64_t seed = occupancy;
+		for (size_t slot = 0; slot < slots; ++slot) {
+			if (nextRandom(seed) % 100 < occupancy) {
+				flat[slot].nonce = handles[slot].nonce;
+				flat[slot].value.key = slot;
+			} else {
+				flat[slot].nonce = 0;
+				pool->dealloc(handles[slot]);
+			}
+		}
+
+		size_t poolPasses = 0;
+		double poolNs = timePasses([&pool]() {
+			uint64_t sum = 0;
+			for (auto item : *pool) {
+				sum += item->key;
+			}
+			return sum;
+		}, poolPasses);
+
+		size_t flatPasses = 0;
+		double flatNs = timePasses([&flat]() {
+			uint64_t sum = 0;
+			for (FlatCell const& cell : flat) {
+				if (cell.nonce != 0) {
+					sum += cell.value.key;
+				}
+			}
+			return sum;
+		}, flatPasses);
+
+		size_t live = pool->count();
+		fprintf(out, "    {\"occupancy_pct\": %u, \"live\": %u, \"pool_us\": %.1f, \"full_scan_us\": %.1f, \"pool_ns_per_live\": %.2f, \"full_scan_ns_per_live\": %.2f, \"speedup\": %.2f, \"passes\": [%u, %u]}%s\n",
+			occupancy, (uint32_t)live, poolNs / 1000, flatNs / 1000, live != 0 ? poolNs / live : 0.0, live != 0 ? flatNs / live : 0.0,
+			poolNs != 0 ? flatNs / poolNs : 0.0, (uint32_t)poolPasses, (uint32_t)flatPasses,
+			i + 1 < sizeof(OCCUPANCY_PCT) / sizeof(OCCUPANCY_PCT[0]) ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+}
+
+void benchPoolAlloc(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_SLOTS;
+
+	std::unique_ptr<AllocStats> chunks(new AllocStats());
+	std::unique_ptr<AllocStats> vector(new AllocStats());
+	timeAllocs<PoolChunks>(count, *chunks);
+	timeAllocs<PoolVector>(count, *vector);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"pool_alloc\",\n");
+	fprintf(out, "  \"config\": {\"allocs\": %u, \"item_bytes\": %u, \"spike_ns\": %u},\n",
+		(uint32_t)count, (uint32_t)sizeof(Item), (uint32_t)SPIKE_NS);
+	printAllocs(out, "chunks", *chunks, count, false);
+	printAllocs(out, "vector", *vector, count, true);
+	fprintf(out, "}\n");
+}
+
+void benchPoolSoA(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_SLOTS;
+
+	std::unique_ptr<PeerColumns> columns(new PeerColumns());
+	std::unique_ptr<Pool<PeerRow>> rows(new Pool<PeerRow>());
+	uint64_t seed = 1;
+	for (size_t i = 0; i < count; ++i) {
+		Status status = nextRandom(seed) % 8 == 0 ? Status::Connecting : Status::Connected;
+		NetAddress address = NetAddress::ipv4(0x0A000000 + (uint32_t)i, 5000);
+		uint64_t lastSeen = nextRandom(seed) % 60000;
+
+		PoolHandle handle = columns->alloc();
+		columns->at<PeerField::Status>(handle) = status;
+		columns->at<PeerField::Address>(handle) = address;
+		columns->at<PeerField::LastSeen>(handle) = lastSeen;
+
+		PeerRow& row = rows->at(rows->alloc());
+		row.status = status;
+		row.address = address;
+		row.lastSeen = lastSeen;
+	}
+
+	// nobody has this address, lookups go through the whole table as for a stranger's datagram
+	NetAddress const stranger = NetAddress::ipv4(0x0B000000, 5000);
+	const uint64_t expiry = 30000;
+
+	struct Scan {
+		char const* name;
+		double soaNs;
+		double aosNs;
+	};
+	size_t passes = 0;
+	Scan scans[] = {
+		{ "status",
+			timePasses([&columns]() {
+				uint64_t connected = 0;
+				Array<Status> statuses = columns->column<PeerField::Status>();
+				for (PoolHandle peer : *columns) {
+					connected += statuses[peer.index] == Status::Connected ? 1 : 0;
+				}
+				return connected;
+			}, passes),
+			timePasses([&rows]() {
+				uint64_t connected = 0;
+				for (auto peer : *rows) {
+					connected += peer->status == Status::Connected ? 1 : 0;
+				}
+				return connected;
+			}, passes) },
+		{ "address",
+			timePasses([&columns, &stranger]() {
+				Array<NetAddress> addresses = columns->column<PeerField::Address>();
+				for (PoolHandle peer : *columns) {
+					if (addresses[peer.index] == stranger) {
+						return (uint64_t)peer.index;
+					}
+				}
+				return (uint64_t)0;
+			}, passes),
+			timePasses([&rows, &stranger]() {
+				for (auto peer : *rows) {
+					if (peer->address == stranger) {
+						return (uint64_t)peer.handle.index;
+					}
+				}
+				return (uint64_t)0;
+			}, passes) },
+		{ "last_seen",
+			timePasses([&columns, expiry]() {
+				uint64_t expired = 0;
+				Array<uint64_t> lastSeen = columns->column<PeerField::LastSeen>();
+				for (PoolHandle peer : *columns) {
+					expired += lastSeen[peer.index] < expiry ? 1 : 0;
+				}
+				return expired;
+			}, passes),
+			timePasses([&rows, expiry]() {
+				uint64_t expired = 0;
+				for (auto peer : *rows) {
+					expired += peer->lastSeen < expiry ? 1 : 0;
+				}
+				return expired;
+			}, passes) },
+	};
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"pool_soa\",\n");
+	fprintf(out, "  \"config\": {\"peers\": %u, \"row_bytes\": %u},\n", (uint32_t)count, (uint32_t)sizeof(PeerRow));
+	fprintf(out, "  \"scans\": [\n");
+	for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); ++i) {
+		Scan const& scan = scans[i];
+		fprintf(out, "    {\"field\": \"%s\", \"soa_us\": %.1f, \"aos_us\": %.1f, \"soa_ns_per_peer\": %.2f, \"aos_ns_per_peer\": %.2f, \"speedup\": %.2f}%s\n",
+			scan.name, scan.soaNs / 1000, scan.aosNs / 1000, scan.soaNs / count, scan.aosNs / count, scan.soaNs != 0 ? scan.aosNs / scan.soaNs : 0.0,
+			i + 1 < sizeof(scans) / sizeof(scans[0]) ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+}
@@ -0,0 +1,88 @@
+#include "benches.h"
+#include "tools.h"
+
+#include <memory>
+#include <vector>
+
+
+// TimerWheel: 'count' timers with delays spread over the protocol range are scheduled, every other
+// one is cancelled, then time moves 1 ms per advance until the rest have fired. The first round
+// grows the node pool, the second one is the steady state and the one reported per operation.
+
+namespace {
+	const size_t DEFAULT_COUNT = 1000000;
+	const uint32_t MAX_DELAY_MS = 60000;    // keepalives and connect timeouts, levels 0 to 2
+	const int ROUNDS = 2;
+
+	struct Round {
+		uint64_t scheduleNs = 0;
+		uint64_t cancelNs = 0;
+		uint64_t advanceNs = 0;
+		size_t advances = 0;
+		size_t fired = 0;
+	};
+
+	Round runRound(TimerWheel& timers, std::vector<uint32_t> const& delays, std::vector<TimerWheel::Handle>& handles)
+	{
+		Round round;
+		uint64_t start = Clock::preciseNs();
+		for (size_t i = 0; i < delays.size(); ++i) {
+			handles[i] = timers.schedule(delays[i], [&round]() { round.fired += 1; });
+		}
+		round.scheduleNs = Clock::preciseNs() - start;
+
+		start = Clock::preciseNs();
+		for (size_t i = 0; i < handles.size(); i += 2) {
+			timers.cancel(handles[i]);
+		}
+		round.cancelNs = Clock::preciseNs() - start;
+
+		start = Clock::preciseNs();
+		for (uint64_t now = timers.now() + 1; timers.count() != 0; ++now) {
+			timers.advance(now);
+			round.advances += 1;
+		}
+		round.advanceNs = Clock::preciseNs() - start;
+		return round;
+	}
+
+	double perOp(uint64_t ns, size_t ops)
+	{
+		return ops != 0 ? (double)ns / ops : 0.0;
+	}
+}
+
+void benchTimers(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_COUNT;
+
+	// the same delays every run, drawn before anything is timed
+	std::vector<uint32_t> delays(count);
+	uint64_t seed = 1;
+	for (uint32_t& delay : delays) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		delay = 1 + (uint32_t)((seed >> 33) % MAX_DELAY_MS);
+	}
+
+	std::unique_ptr<TimerWheel> timers(new TimerWheel(0));
+	std::vector<TimerWheel::Handle> handles(count);
+	Round rounds[ROUNDS];
+	for (Round& round : rounds) {
+		round = runRound(*timers, delays, handles);
+	}
+
+	Round const& first = rounds[0];
+	Round const& steady = rounds[ROUNDS - 1];
+	size_t cancelled = (count + 1) / 2;
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"timers\",\n");
+	fprintf(out, "  \"config\": {\"timers\": %u, \"max_delay_ms\": %u, \"cancelled\": %u},\n",
+		(uint32_t)count, MAX_DELAY_MS, (uint32_t)cancelled);
+	fprintf(out, "  \"schedule_ns\": %.1f,\n", perOp(steady.scheduleNs, count));
+	fprintf(out, "  \"schedule_growing_ns\": %.1f,\n", perOp(first.scheduleNs, count));
+	fprintf(out, "  \"cancel_ns\": %.1f,\n", perOp(steady.cancelNs, cancelled));
+	fprintf(out, "  \"advance\": {\"calls\": %u, \"fired\": %u, \"total_ms\": %.2f, \"ns_per_call\": %.1f, \"ns_per_fired\": %.1f}\n",
+		(uint32_t)steady.advances, (uint32_t)steady.fired, steady.advanceNs / 1e6,
+		perOp(steady.advanceNs, steady.advances), perOp(steady.advanceNs, steady.fired));
+	fprintf(out, "}\n");
+}
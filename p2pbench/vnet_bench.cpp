@@ -0,0 +1,226 @@
+#include "benches.h"
+#include "host.h"
+#include "vnet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+
+// Scale of the membership protocol on the VirtualNetwork: 'count' NetHosts in rooms of ROOM_SIZE, a
+// public master and members behind NAT boxes of every type, run for SIM_SECONDS of simulated time.
+// Hosts are only updated when they get datagrams or their next deadline comes, so the wall time is
+// what the protocol itself costs. Reports how many of the wanted connections got established.
+
+namespace {
+	const size_t DEFAULT_COUNT = 10000;
+	const size_t ROOM_SIZE = 8;               // master included
+	const uint64_t SIM_SECONDS = 30;
+	const uint64_t JOIN_PERIOD_US = 500000;   // members of a room join one after another
+	const uint64_t SEED = 1;
+
+	const uint32_t STUN_IP = 0x0D000001;
+	const uint32_t STUN_ALT_IP = 0x0D000002;
+	const uint32_t MASTER_IP = 0x0B000000;
+	const uint32_t HOST_IP = 0x0A000000;
+	const uint32_t NAT_IP = 0x0C000000;
+	const uint16_t MASTER_PORT = 7000;
+
+	const NatType NAT_TYPES[] = { NatType::Open, NatType::FullCone, NatType::AddressRestricted, NatType::PortRestricted, NatType::Symmetric };
+	const size_t NAT_NAMES = (size_t)NatType::Blocked + 1;
+	char const* const NAMES[NAT_NAMES] = { "unknown", "open", "full_cone", "address_restricted", "port_restricted", "symmetric", "blocked" };
+
+	struct Member : INetClient {
+		std::unique_ptr<Socket> socket;
+		std::unique_ptr<NetHost> host;
+		NatType natType;            // Unknown - public master
+		NetAddress master;
+		size_t roomSize;
+		uint64_t joinAt = 0;
+		bool joined = false;
+		uint64_t scheduled = UINT64_MAX;
+
+		void onPeerConnected(PeerId) override {}
+		void onPeerDisconnected(PeerId) override {}
+		void onMessageReceived(PeerId, int, CBytes) override {}
+	};
+
+	struct Counters {
+		uint64_t updates = 0;
+		uint64_t steps = 0;
+	};
+
+	// Wakes every host when it gets datagrams or its next deadline comes, until 'endUs'.
+	void run(VirtualNetwork& network, std::vector<std::unique_ptr<Member>>& members, uint64_t endUs, Counters& counters)
+	{
+		typedef std::pair<uint64_t, uint32_t> Due;
+		std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+		for (uint32_t i = 0; i < members.size(); ++i) {
+			members[i]->scheduled = members[i]->joinAt;
+			due.push(Due(members[i]->scheduled, i));
+		}
+
+		std::vector<uint32_t> ready;
+		std::vector<uint32_t> work;
+		std::vector<bool> queued(members.size());
+		while (network.now() < endUs) {
+			uint64_t next = std::min(network.nextEvent(), due.empty() ? UINT64_MAX : due.top().first);
+			uint64_t now = std::min(std::max(next, network.now()), endUs);
+			network.advance(now);
+			Clock::tick();
+			counters.steps += 1;
+
+			network.takeReady(ready);
+			work.clear();
+			for (uint32_t id : ready) {
+				if (!queued[id]) {
+					queued[id] = true;
+					work.push_back(id);
+				}
+			}
+			while (!due.empty() && due.top().first <= now) {
+				Due entry = due.top();
+				due.pop();
+				if (members[entry.second]->scheduled == entry.first && !queued[entry.second]) {
+					queued[entry.second] = true;
+					work.push_back(entry.second);
+				}
+			}
+
+			for (uint32_t id : work) {
+				queued[id] = false;
+				Member& member = *members[id];
+				if (member.natType != NatType::Unknown && !member.joined && now >= member.joinAt) {
+					member.joined = true;
+					member.host->connect(Array<NetAddress const>(&member.master, &member.master + 1), [](int) {});
+				}
+				do {
+					member.host->update();
+					counters.updates += 1;
+				} while (member.socket->wait(0));
+
+				// deadlines are in ms, waking up earlier than the next one would only spin
+				uint64_t wake = member.joined || member.natType == NatType::Unknown ? member.host->nextDeadline() * 1000 : member.joinAt;
+				wake = std::max(wake, (now / 1000 + 1) * 1000);
+				if (wake != member.scheduled) {
+					member.scheduled = wake;
+					due.push(Due(wake, id));
+				}
+			}
+		}
+	}
+}
+
+void benchVirtualNetwork(FILE* out, size_t count)
+{
+	count = count != 0 ? count : DEFAULT_COUNT;
+
+	// punching timers and ports take rand(), seeded for repeatable runs
+	srand((unsigned)SEED);
+	VirtualNetwork network(SEED);
+	VirtualLink link;
+	link.delayUs = 20000;
+	link.jitterUs = 5000;
+	link.loss = 0.01;
+	link.reorder = 0.01;
+	link.reorderUs = 3000;
+	link.bandwidth = 10000000;
+	VirtualLink serverLink;
+	serverLink.delayUs = 10000;
+	network.addStunServer(STUN_IP, STUN_ALT_IP, serverLink);
+
+	std::vector<std::unique_ptr<Member>> members;
+	for (size_t i = 0; i < count; ++i) {
+		size_t room = i / ROOM_SIZE;
+		size_t slot = i % ROOM_SIZE;
+		std::unique_ptr<Member> member(new Member());
+		member->master = NetAddress::ipv4(MASTER_IP + (uint32_t)room, MASTER_PORT);
+		member->roomSize = std::min(ROOM_SIZE, count - room * ROOM_SIZE);
+		ISocketBackend* backend;
+		if (slot == 0) {
+			member->natType = NatType::Unknown;
+			member->joinAt = network.now();
+			backend = network.addHost(MASTER_IP + (uint32_t)room, VirtualNetwork::NO_NAT, link);
+		} else {
+			VirtualNat nat;
+			nat.type = NAT_TYPES[i % (sizeof(NAT_TYPES) / sizeof(NAT_TYPES[0]))];
+			nat.publicIp = NAT_IP + (uint32_t)i;
+			nat.portDelta = 1 + (int)(i % 3);
+			member->natType = nat.type;
+			member->joinAt = network.now() + slot * JOIN_PERIOD_US;
+			backend = network.addHost(HOST_IP + (uint32_t)i, network.addNat(nat), link);
+		}
+
+		member->socket.reset(new Socket(backend));
+		member->socket->bind(NetAddress::any(slot == 0 ? MASTER_PORT : 0));
+		member->host.reset(new NetHost(slot == 0, *member->socket, { member.get() }));
+		member->host->resolveNat(std::vector<std::string>{ "13.0.0.1" }, nullptr);
+		snprintf(member->host->nickname, sizeof(member->host->nickname), "vnet%u", (uint32_t)i);
+		members.push_back(std::move(member));
+	}
+
+	Counters counters;
+	// the VirtualNetwork made Clock simulated, wall time comes from steady_clock
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	run(network, members, network.now() + SIM_SECONDS * 1000000, counters);
+	double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t connections = 0;
+	size_t wanted = 0;
+	size_t fullMesh = 0;
+	size_t byType[NAT_NAMES][2] = {};
+	size_t detected[NAT_NAMES] = {};
+	for (std::unique_ptr<Member> const& member : members) {
+		size_t connected = 0;
+		member->host->queryPeerInfos([&connected](PeerId, NetHost::PeerInfo const& info) {
+			connected += info.status == NetHost::PeerInfo::Connected ? 1 : 0;
+		});
+		connections += connected;
+		wanted += member->roomSize - 1;
+		fullMesh += connected == member->roomSize - 1 ? 1 : 0;
+		byType[(int)member->natType][0] += connected;
+		byType[(int)member->natType][1] += member->roomSize - 1;
+		if (member->natType != NatType::Unknown) {
+			detected[(int)member->host->natInfo().type] += 1;
+		}
+	}
+	VirtualNetwork::Stats stats = network.stats();
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"bench\": \"vnet\",\n");
+	fprintf(out, "  \"config\": {\"peers\": %u, \"room_size\": %u, \"sim_seconds\": %u, \"seed\": %u},\n",
+		(uint32_t)count, (uint32_t)ROOM_SIZE, (uint32_t)SIM_SECONDS, (uint32_t)SEED);
+	fprintf(out, "  \"wall_seconds\": %.3f,\n", wallSeconds);
+	fprintf(out, "  \"speedup\": %.1f,\n", SIM_SECONDS / wallSeconds);
+	fprintf(out, "  \"updates\": %llu,\n", (unsigned long long)counters.updates);
+	fprintf(out, "  \"steps\": %llu,\n", (unsigned long long)counters.steps);
+	fprintf(out, "  \"connections\": %u,\n", (uint32_t)connections);
+	fprintf(out, "  \"wanted\": %u,\n", (uint32_t)wanted);
+	fprintf(out, "  \"full_mesh_hosts\": %u,\n", (uint32_t)fullMesh);
+	fprintf(out, "  \"connections_by_nat\": {");
+	char const* separator = "";
+	for (size_t type = 0; type < NAT_NAMES; ++type) {
+		if (byType[type][1] != 0) {
+			fprintf(out, "%s\"%s\": [%u, %u]", separator, type == 0 ? "master" : NAMES[type], (uint32_t)byType[type][0], (uint32_t)byType[type][1]);
+			separator = ", ";
+		}
+	}
+	fprintf(out, "},\n");
+	fprintf(out, "  \"detected_nat\": {");
+	separator = "";
+	for (size_t type = 0; type < NAT_NAMES; ++type) {
+		if (detected[type] != 0) {
+			fprintf(out, "%s\"%s\": %u", separator, NAMES[type], (uint32_t)detected[type]);
+			separator = ", ";
+		}
+	}
+	fprintf(out, "},\n");
+	fprintf(out, "  \"datagrams\": {\"sent\": %llu, \"delivered\": %llu, \"lost\": %llu, \"queue_dropped\": %llu, \"filtered\": %llu, \"unroutable\": %llu, \"stun\": %llu}\n",
+		(unsigned long long)stats.sent, (unsigned long long)stats.delivered, (unsigned long long)stats.lost, (unsigned long long)stats.queueDropped,
+		(unsigned long long)stats.filtered, (unsigned long long)stats.unroutable, (unsigned long long)stats.stun);
+	fprintf(out, "}\n");
+}
@@ -0,0 +1,310 @@
+#include "capture.h"
+#include "log.h"
+#include "ring.h"
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+std::atomic<bool> Capture::s_enabled{ false };
+
+namespace {
+	const uint32_t PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+	const uint32_t PCAPNG_INTERFACE = 0x00000001;
+	const uint32_t PCAPNG_ENHANCED_PACKET = 0x00000006;
+	const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+	const uint16_t LINKTYPE_RAW = 101;   // packets begin with an IPv4 header
+
+	const size_t IP_HEADER_SIZE = 20;
+	const size_t UDP_HEADER_SIZE = 8;
+
+	struct CaptureRecord {
+		uint64_t timeUs;
+		uintptr_t socket;
+		NetAddress remote;
+		bool outbound;
+		uint32_t length;     // datagram length
+		uint32_t captured;   // bytes copied into 'data'
+		uint8_t data[Capture::SNAP_LENGTH];
+	};
+
+	struct CaptureState {
+		MpscRing<CaptureRecord> ring{ Capture::RING_SIZE };
+		Capture::Filter filter;
+
+		std::thread writer;
+		std::atomic<bool> stop{ false };
+		FILE* file = nullptr;
+		uint64_t startUs = 0;   // wall clock at 'startSteadyUs', pcapng wants absolute timestamps
+		uint64_t startSteadyUs = 0;
+
+		std::atomic<uint64_t> captured{ 0 };
+		std::atomic<uint64_t> filtered{ 0 };
+		std::atomic<uint64_t> dropped{ 0 };
+
+		std::vector<std::pair<uintptr_t, NetAddress>> localAddresses;   // writer thread only
+	};
+
+	CaptureState& state()
+	{
+		static CaptureState instance;
+		return instance;
+	}
+
+	bool matches(Capture::Filter const& filter, NetAddress const& remote, int length)
+	{
+		if ((size_t)length < filter.minSize || (size_t)length > filter.maxSize) {
+			return false;
+		}
+		if (filter.peers.empty()) {
+			return true;
+		}
+
+		sockaddr_in const* addr = (sockaddr_in const*)remote.data;
+		for (NetAddress const& peer : filter.peers) {
+			sockaddr_in const* peerAddr = (sockaddr_in const*)peer.data;
+			if (peerAddr->sin_addr.S_un.S_addr == addr->sin_addr.S_un.S_addr && (peerAddr->sin_port == 0 || peerAddr->sin_port == addr->sin_port)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void record(bool outbound, uintptr_t socket, NetAddress const& remote, void const* data, int length)
+	{
+		CaptureState& capture = state();
+		if (length <= 0 || !matches(capture.filter, remote, length)) {
+			capture.filtered.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		CaptureRecord record;
+		record.timeUs = Clock::preciseUs();
+		record.socket = socket;
+		record.remote = remote;
+		record.outbound = outbound;
+		record.length = (uint32_t)length;
+		record.captured = (uint32_t)std::min((size_t)length, (size_t)Capture::SNAP_LENGTH);
+		memcpy(record.data, data, record.captured);
+
+		if (capture.ring.push(std::move(record))) {
+			capture.captured.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			capture.dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Resolved by the writer so the hooks don't pay for a syscall. Sockets bound to 'any' give 0.0.0.0.
+	NetAddress localAddress(CaptureState& capture, uintptr_t socket)
+	{
+		for (auto const& entry : capture.localAddresses) {
+			if (entry.first == socket) {
+				return entry.second;
+			}
+		}
+
+		NetAddress address = NetAddress::any(0);
+		int length = sizeof(address.data);
+		::getsockname((SOCKET)socket, (sockaddr*)address.data, &length);
+		// unbound sockets get a port with the first send, don't cache them before that
+		if (address.getport() != 0) {
+			capture.localAddresses.emplace_back(socket, address);
+		}
+		return address;
+	}
+
+	uint16_t ipChecksum(uint8_t const* header, size_t size)
+	{
+		uint32_t sum = 0;
+		for (size_t i = 0; i < size; i += 2) {
+			sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+		}
+		while (sum >> 16) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+		return (uint16_t)~sum;
+	}
+
+	void writeBlock(FILE* file, uint32_t type, void const* body, size_t bodySize, void const* data, size_t dataSize)
+	{
+		static const uint8_t padding[4] = {};
+		const size_t paddedSize = (dataSize + 3) & ~(size_t)3;
+		const uint32_t totalLength = (uint32_t)(12 + bodySize + paddedSize);
+
+		fwrite(&type, 4, 1, file);
+		fwrite(&totalLength, 4, 1, file);
+		fwrite(body, 1, bodySize, file);
+		if (dataSize != 0) {
+			fwrite(data, 1, dataSize, file);
+			fwrite(padding, 1, paddedSize - dataSize, file);
+		}
+		fwrite(&totalLength, 4, 1, file);
+	}
+
+	void writeHeader(FILE* file)
+	{
+		struct {
+			uint32_t magic;
+			uint16_t major;
+			uint16_t minor;
+			int64_t sectionLength;
+		} section = { PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1 };
+		writeBlock(file, PCAPNG_SECTION_HEADER, &section, sizeof(section), nullptr, 0);
+
+		// default timestamp resolution is microseconds
+		struct {
+			uint16_t linkType;
+			uint16_t reserved;
+			uint32_t snapLength;
+		} iface = { LINKTYPE_RAW, 0, (uint32_t)(IP_HEADER_SIZE + UDP_HEADER_SIZE + Capture::SNAP_LENGTH) };
+		writeBlock(file, PCAPNG_INTERFACE, &iface, sizeof(iface), nullptr, 0);
+	}
+
+	void writeRecord(CaptureState& capture, CaptureRecord const& record)
+	{
+		NetAddress local = localAddress(capture, record.socket);
+		sockaddr_in const* src = (sockaddr_in const*)(record.outbound ? local.data : record.remote.data);
+		sockaddr_in const* dst = (sockaddr_in const*)(record.outbound ? record.remote.data : local.data);
+
+		uint8_t packet[IP_HEADER_SIZE + UDP_HEADER_SIZE + Capture::SNAP_LENGTH];
+		const size_t ipLength = std::min<size_t>(IP_HEADER_SIZE + UDP_HEADER_SIZE + record.length, 0xFFFF);
+		const size_t udpLength = ipLength - IP_HEADER_SIZE;
+
+		uint8_t* ip = packet;
+		memset(ip, 0, IP_HEADER_SIZE);
+		ip[0] = 0x45;                          // IPv4, 5 words header
+		ip[2] = (uint8_t)(ipLength >> 8);
+		ip[3] = (uint8_t)ipLength;
+		ip[6] = 0x40;                          // don't fragment
+		ip[8] = 64;                            // TTL
+		ip[9] = IPPROTO_UDP;
+		memcpy(ip + 12, &src->sin_addr, 4);
+		memcpy(ip + 16, &dst->sin_addr, 4);
+		uint16_t checksum = ipChecksum(ip, IP_HEADER_SIZE);
+		ip[10] = (uint8_t)(checksum >> 8);
+		ip[11] = (uint8_t)checksum;
+
+		uint8_t* udp = packet + IP_HEADER_SIZE;
+		memcpy(udp + 0, &src->sin_port, 2);
+		memcpy(udp + 2, &dst->sin_port, 2);
+		udp[4] = (uint8_t)(udpLength >> 8);
+		udp[5] = (uint8_t)udpLength;
+		udp[6] = udp[7] = 0;                   // no checksum, allowed for IPv4
+
+		memcpy(packet + IP_HEADER_SIZE + UDP_HEADER_SIZE, record.data, record.captured);
+
+		const uint64_t timeUs = capture.startUs + (record.timeUs - capture.startSteadyUs);
+		struct {
+			uint32_t interfaceId;
+			uint32_t timeHigh;
+			uint32_t timeLow;
+			uint32_t capturedLength;
+			uint32_t originalLength;
+		} header = {
+			0, (uint32_t)(timeUs >> 32), (uint32_t)timeUs,
+			(uint32_t)(IP_HEADER_SIZE + UDP_HEADER_SIZE + record.captured),
+			(uint32_t)(IP_HEADER_SIZE + UDP_HEADER_SIZE + record.length),
+		};
+		writeBlock(capture.file, PCAPNG_ENHANCED_PACKET, &header, sizeof(header), packet, header.capturedLength);
+	}
+
+	void runWriter()
+	{
+		CaptureState& capture = state();
+		CaptureRecord record;
+		bool stopping = false;
+		while (!stopping) {
+			// the flag is read before the last drain, so records pushed before 'stop' are written
+			stopping = capture.stop.load(std::memory_order_acquire);
+
+			size_t count = 0;
+			while (capture.ring.pop(record)) {
+				writeRecord(capture, record);
+				count += 1;
+			}
+			if (count == 0) {
+				fflush(capture.file);
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		}
+	}
+}
+
+
+bool Capture::start(char const* path, Filter const& filter)
+{
+	CaptureState& capture = state();
+	if (capture.writer.joinable()) {
+		stop();
+	}
+
+	if (fopen_s(&capture.file, path, "wb") != 0) {
+		capture.file = nullptr;
+		LOG(0, "Capture: unable to open '%s'.", path);
+		return false;
+	}
+
+	// leftovers of a previous session
+	CaptureRecord record;
+	while (capture.ring.pop(record)) {}
+
+	capture.filter = filter;
+	capture.localAddresses.clear();
+	capture.captured.store(0, std::memory_order_relaxed);
+	capture.filtered.store(0, std::memory_order_relaxed);
+	capture.dropped.store(0, std::memory_order_relaxed);
+
+	using namespace std::chrono;
+	capture.startUs = (uint64_t)duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+	capture.startSteadyUs = Clock::preciseUs();
+	writeHeader(capture.file);
+
+	capture.stop.store(false, std::memory_order_relaxed);
+	capture.writer = std::thread(runWriter);
+	s_enabled.store(true, std::memory_order_release);
+
+	LOG(1, "Capture: writing '%s'.", path);
+	return true;
+}
+
+void Capture::stop()
+{
+	CaptureState& capture = state();
+	s_enabled.store(false, std::memory_order_release);
+	if (capture.writer.joinable()) {
+		capture.stop.store(true, std::memory_order_release);
+		capture.writer.join();
+	}
+	if (capture.file != nullptr) {
+		fclose(capture.file);
+		capture.file = nullptr;
+
+		Stats stats = Capture::stats();
+		LOG(1, "Capture: stopped, %llu datagrams captured, %llu filtered out, %llu dropped.",
+			(unsigned long long)stats.captured, (unsigned long long)stats.filtered, (unsigned long long)stats.dropped);
+	}
+}
+
+Capture::Stats Capture::stats()
+{
+	CaptureState& capture = state();
+	return Stats{
+		capture.captured.load(std::memory_order_relaxed),
+		capture.filtered.load(std::memory_order_relaxed),
+		capture.dropped.load(std::memory_order_relaxed),
+	};
+}
+
+void Capture::onSend(uintptr_t socket, NetAddress const& to, void const* data, int length)
+{
+	record(true, socket, to, data, length);
+}
+
+void Capture::onReceive(uintptr_t socket, NetAddress const& from, void const* data, int length)
+{
+	record(false, socket, from, data, length);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "socket.h"
+#include "tools.h"
+
+#include <atomic>
+
+
+// Optional capture of the datagrams passing through sockets. Socket hooks copy at most SNAP_LENGTH
+// bytes of each datagram into a bounded ring and never block, a background thread writes them into
+// a pcapng file wrapped into synthetic IPv4/UDP headers (see p2ptest.lua for the protocol dissector).
+// Datagrams which don't fit into the ring are dropped and counted.
+struct Capture {
+	const static size_t SNAP_LENGTH = 256;
+	const static size_t RING_SIZE = 1024;
+	const static size_t MAX_PEERS = 8;
+
+	struct Filter {
+		// Only datagrams exchanged with these hosts are captured, port 0 matches any port. Empty to capture all.
+		FixedArray<NetAddress, MAX_PEERS> peers;
+		size_t minSize = 0;
+		size_t maxSize = SIZE_MAX;
+	};
+
+	struct Stats {
+		uint64_t captured;
+		uint64_t filtered;
+		uint64_t dropped;
+	};
+
+public:
+	// Not thread safe with respect to each other, sockets may be used meanwhile.
+	static bool start(char const* path, Filter const& filter);
+	static void stop();
+
+	static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+	static Stats stats();
+
+	// Socket hooks, called only if capture is enabled.
+	static void onSend(uintptr_t socket, NetAddress const& to, void const* data, int length);
+	static void onReceive(uintptr_t socket, NetAddress const& from, void const* data, int length);
+
+private:
+	static std::atomic<bool> s_enabled;
+};
@@ -12,6 +12,16 @@ void print_help()
 	printf("          --localport [int]                 Set port for local socket ('48800' by default)\n");
     printf("-n        --nickname  [string]              Set nickname\n");
     printf("          --noui      [void]                Disable UI elements\n");
+    printf("-s        --stun      [string:url]          Add STUN server ('host port'), servers are raced for the fastest answer\n");
+    printf("          --nat-cache [string]              Set NAT info cache file ('natcache.txt' by default, empty to disable)\n");
+    printf("-v        --verbose   [int]                 Set console log level ('0' by default, up to '2')\n");
+    printf("          --log-file  [string]              Write log of all levels to file\n");
+    printf("          --capture   [string]              Write socket traffic to pcapng file\n");
+    printf("          --capture-peer [string:ipv4addr]  Capture only traffic of this host ('host[ port]'), may be repeated\n");
+    printf("          --capture-size [string:'min max'] Capture only datagrams of this size range\n");
+    printf("          --metrics-file [string]           Write metrics in Prometheus text format to file every second\n");
+    printf("          --metrics-port [int]              Serve metrics over HTTP on 127.0.0.1\n");
+    printf("          --latency-file [string]           Write latency percentiles of the network loop to file every 10 seconds\n");
 }
 
 void read_string(int argc, char const* argv[], int& i, std::string& outStr)
@@ -28,13 +38,13 @@ void read_string(int argc, char const* argv[], int& i, std::string& outStr)
 void read_address(int argc, char const* argv[], int& i, NetAddress& outAddr)
 {
 	if (i + 1 > argc) {
-        log(0, "Invalid command line format: expect string+int after '%s'", argv[i]);
+        LOG(0, "Invalid command line format: expect string+int after '%s'", argv[i]);
 		return;
 	}
 
 	i += 1;
 	if (resolve_url(true, argv[i], outAddr) != 0) {
-        log(0, "Invalid command line format: ipv4 address '%s' after '%s' is incorrect", argv[i], argv[i - 1]);
+        LOG(0, "Invalid command line format: ipv4 address '%s' after '%s' is incorrect", argv[i], argv[i - 1]);
 		return;
 	}
 }
@@ -43,7 +53,7 @@ void read_address(int argc, char const* argv[], int& i, NetAddress& outAddr)
 void read_port(int argc, char const* argv[], int& i, NetAddress& outAddr)
 {
 	if (i + 1 == argc) {
-		log(0, "Invalid command line format: expect port number (integer) after '%s'", argv[i]);
+		LOG(0, "Invalid command line format: expect port number (integer) after '%s'", argv[i]);
 		return;
 	}
 
@@ -55,6 +65,7 @@ void read_port(int argc, char const* argv[], int& i, NetAddress& outAddr)
 Config::Config(int argc, char const* argv[])
 	: Config()
 {
+	std::vector<std::string> servers;
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			mode = Mode::Help;
@@ -82,6 +93,53 @@ Config::Config(int argc, char const* argv[])
         else if (!strcmp(argv[i], "--noui")) {
             withoutUi = true;
         }
+        else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stun")) {
+			servers.emplace_back();
+			read_string(argc, argv, i, servers.back());
+		}
+        else if (!strcmp(argv[i], "--nat-cache")) {
+			read_string(argc, argv, i, natCachePath);
+		}
+        else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+			std::string level;
+			read_string(argc, argv, i, level);
+			logLevel = strtol(level.c_str(), NULL, 10);
+		}
+        else if (!strcmp(argv[i], "--log-file")) {
+			read_string(argc, argv, i, logPath);
+		}
+        else if (!strcmp(argv[i], "--capture")) {
+			read_string(argc, argv, i, capturePath);
+		}
+        else if (!strcmp(argv[i], "--capture-peer")) {
+			capturePeers.push_back(NetAddress::any(0));
+			read_address(argc, argv, i, capturePeers.back());
+		}
+        else if (!strcmp(argv[i], "--capture-size")) {
+			std::string range;
+			read_string(argc, argv, i, range);
+			char* end = nullptr;
+			captureMinSize = strtoul(range.c_str(), &end, 10);
+			captureMaxSize = strtoul(end, NULL, 10);
+			if (captureMaxSize == 0) {
+				captureMaxSize = SIZE_MAX;
+			}
+		}
+        else if (!strcmp(argv[i], "--metrics-file")) {
+			read_string(argc, argv, i, metricsPath);
+		}
+        else if (!strcmp(argv[i], "--metrics-port")) {
+			std::string port;
+			read_string(argc, argv, i, port);
+			metricsPort = strtol(port.c_str(), NULL, 10);
+		}
+        else if (!strcmp(argv[i], "--latency-file")) {
+			read_string(argc, argv, i, latencyPath);
+		}
+	}
+
+	if (!servers.empty()) {
+		stunServers = std::move(servers);
 	}
 }
 
@@ -2,6 +2,7 @@
 
 #include "socket.h"
 #include <string>
+#include <vector>
 
 
 struct Config {
@@ -14,6 +15,21 @@ struct Config {
 	NetAddress endpoint = NetAddress::any(48800);
 	std::string nickname;
 
+	std::vector<std::string> stunServers = { "stun.hydrapi.net 3478", "stun.stunprotocol.org 3478" };
+	std::string natCachePath = "natcache.txt";
+
+	int logLevel = 0;        // highest level shown on console
+	std::string logPath;     // all levels go there, empty to disable
+
+	std::string capturePath;              // pcapng capture of socket traffic, empty to disable
+	std::vector<NetAddress> capturePeers;
+	size_t captureMinSize = 0;
+	size_t captureMaxSize = SIZE_MAX;
+
+	std::string metricsPath;              // Prometheus text file rewritten every second, empty to disable
+	int metricsPort = 0;                  // HTTP endpoint on 127.0.0.1, 0 to disable
+	std::string latencyPath;              // latency percentiles rewritten every 10 seconds, empty to disable
+
 public:
 	Config() = default;
 	Config(int argc, char const* argv[]);
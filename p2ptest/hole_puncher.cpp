@@ -1,76 +1,415 @@
 #include "hole_puncher.h"
 #include "log.h"
 
+#include <winsock2.h>
+#include <algorithm>
+
 
-static int sendPingMsg(Socket const& socket, NetAddress const& target, int msgId, PoolHandle id)
-{
 #pragma pack(push, 1)
-	struct PingMsg {
-		net_uint16_t msgId;
-		PoolHandle id;
-	} pingMsg{ (uint16_t)msgId, id };
+struct PingMsg {
+	net_uint16_t msgId;
+	PoolHandle id;
+	net_uint32_t stamp;
+};
 #pragma pack(pop)
 
-	log(2, "Send [%s '%d/%d'] message to '%s'.", msgId == 0 ? "PING" : "PONG", id.index, id.nonce, toString(target).c_str());
+static int sendPingMsg(Socket const& socket, NetAddress const& target, int msgId, PoolHandle id, uint32_t stamp = (uint32_t)getTimeMs())
+{
+	PingMsg pingMsg{ (uint16_t)msgId, id, stamp };
+
+	LOG(2, "Send [%s '%d/%d'] message to '%s'.", msgId == 0 ? "PING" : "PONG", id.index, id.nonce, toString(target).c_str());
 	return socket.sendto(target, &pingMsg, sizeof(pingMsg), 0);
 }
 
+// Candidates within the same private network are preferred, they don't hairpin through the router
+static int candidatePriority(NetAddress const& address)
+{
+	sockaddr_in const* addr = (sockaddr_in const*)address.data;
+	uint8_t const* ip = (uint8_t const*)&addr->sin_addr;
+
+	if (ip[0] == 127) return 3;
+	if (ip[0] == 10) return 2;
+	if (ip[0] == 172 && (ip[1] & 0xF0) == 16) return 2;
+	if (ip[0] == 192 && ip[1] == 168) return 2;
+	return 1;
+}
+
+// Spreads probes of hosts added at the same moment, so they don't leave in one burst
+static size_t jitter(size_t interval, int percent)
+{
+	int spread = (int)interval * percent / 100;
+	if (spread == 0) {
+		return interval;
+	}
+	return interval - spread + rand() % (2 * spread + 1);
+}
+
+
+HolePuncher::HolePuncher(bool autoping, Socket const& socket, TimerWheel& timers)
+	: m_autoping(autoping), m_socket(socket), m_timers(timers), m_keepalivePeriod(KEEPALIVE_DEFAULT_MS)
+{
+}
+
+HolePuncher::~HolePuncher()
+{
+	for (auto host : m_pendings) {
+		m_timers.cancel(host->timer);
+		m_timers.cancel(host->deadline);
+	}
+	for (auto keepalive : m_keepalives) {
+		m_timers.cancel(keepalive->timer);
+		m_timers.cancel(keepalive->recheckTimer);
+	}
+}
 
-void HolePuncher::addRemoteHost(PoolHandle id, Array<NetAddress const> addresses, size_t timeout, std::function<void(NetAddress const&)> callback)
+void HolePuncher::addRemoteHost(PoolHandle id, Array<NetAddress const> addresses, size_t timeout,
+	Callback<void(NetAddress const&)> callback, Callback<void()> onFailed)
 {
 	if (id.isValid()) {
 		auto& host = m_pendings.make(id);
-		host.addresses = std::vector<NetAddress>(addresses.begin, addresses.end);
-		host.callback = callback;
+		host.addresses = FixedArray<NetAddress, MAX_ADDRESSES>(addresses);
+		host.callback = std::move(callback);
+		host.onFailed = std::move(onFailed);
+
+		if (addresses.count() > host.addresses.count()) {
+			LOG(1, "HolePuncher: peer [%u/%u] has %u addresses, only %u are probed.", id.index, id.nonce, (unsigned)addresses.count(), (unsigned)MAX_ADDRESSES);
+		}
+
+		// check the most preferred candidates first; insertion sort is stable and, unlike std::stable_sort, doesn't allocate
+		for (size_t i = 1; i < host.addresses.count(); ++i) {
+			for (size_t j = i; j > 0 && candidatePriority(host.addresses[j]) > candidatePriority(host.addresses[j - 1]); --j) {
+				std::swap(host.addresses[j], host.addresses[j - 1]);
+			}
+		}
+		host.startTime = getTimeMs();
+
+		// the first probe goes out within the initial interval, hosts added together get spread over it
+		host.interval = PUNCH_INITIAL_MS;
+		host.timer = m_timers.schedule(rand() % PUNCH_INITIAL_MS, [this, id]() { onProbeTimer(id); });
+		if (timeout != 0) {
+			host.deadline = m_timers.schedule(timeout, [this, id]() { onDeadline(id); });
+		}
+	}
+}
+
+void HolePuncher::predictPorts(PoolHandle id, NetAddress const& mapped, int delta)
+{
+	auto host = m_pendings[id];
+	if (host != nullptr) {
+		LOG(2, "HolePuncher: predict ports of '%s' with step %d.", toString(mapped).c_str(), delta);
+		host->predictionBase = mapped;
+		host->portDelta = delta;
+		host->predicted = 0;
+		host->predictionTime = getTimeMs();
+	}
+}
+
+void HolePuncher::sprayPredictedPorts(Socket const& socket, PoolHandle id, PendingHost& host)
+{
+	const uint32_t limit = (host.portDelta != 0) ? PREDICTION_WINDOW : PREDICTION_RANDOM;
+	if (host.predictionBase.getport() == 0 || host.validAddress.getport() != 0 || host.predicted >= limit) {
+		return;
+	}
+
+	uint64_t now = getTimeMs();
+	uint32_t budget = (uint32_t)std::min<uint64_t>((now - host.predictionTime) * PREDICTION_RATE / 1000, PREDICTION_BURST);
+	if (budget == 0) {
+		return;
+	}
+	host.predictionTime = now;
+
+	for (; budget > 0 && host.predicted < limit; --budget) {
+		int port = 0;
+		if (host.portDelta != 0) {
+			port = host.predictionBase.getport() + host.portDelta * (int)(host.predicted + 1);
+		} else {
+			// birthday probing: the peer's NAT opens new mappings while it pings us, some of them get hit
+			port = 1024 + rand() % (65536 - 1024);
+		}
+		host.predicted += 1;
+		if (port <= 0 || port > 65535) {
+			continue;
+		}
+
+		NetAddress target = host.predictionBase;
+		target.setport(port);
+		sendPingMsg(socket, target, PING_MSGID, id);
+		host.pings += 1;
+		if (m_metrics != nullptr) {
+			m_metrics->onPunchAttempt(id);
+		}
 	}
 }
 
 void HolePuncher::delRemoteHost(PoolHandle id)
 {
-	if (m_pendings[id] != nullptr) {
+	PendingHost* host = m_pendings[id];
+	if (host != nullptr) {
+		m_timers.cancel(host->timer);
+		m_timers.cancel(host->deadline);
 		m_pendings.destroy(id);
 	}
 }
 
-void HolePuncher::update(Socket const& socket)
+void HolePuncher::addKeepAlive(PoolHandle id, NetAddress const& address, Array<NetAddress const> candidates)
 {
-	if (!m_resendTimer.shedule()) {
+	if (!id.isValid()) {
 		return;
 	}
 
+	KeepAlive* keepalive = m_keepalives[id];
+	if (keepalive == nullptr) {
+		keepalive = &m_keepalives.make(id);
+	} else {
+		forgetPaths(id, *keepalive);
+	}
+	keepalive->candidates.clear();
+	keepalive->candidates.push_back(Candidate{ address, candidatePriority(address), UINT32_MAX, getTimeMs(), 0 });
+	for (size_t i = 0; i < candidates.count(); ++i) {
+		NetAddress const& candidate = candidates[i];
+		if (candidate.getport() == 0 || candidate == address) continue;
+		keepalive->candidates.push_back(Candidate{ candidate, candidatePriority(candidate), UINT32_MAX, 0, 0 });
+	}
+	keepalive->nominated = 0;
+	keepalive->pinged = 0;
+
+	m_timers.cancel(keepalive->timer);
+	keepalive->timer = m_timers.schedule(m_keepalivePeriod, [this, id]() { onKeepAliveTimer(id); });
+	// first check goes out at once, so a better path is found right after connection
+	recheck(id, *keepalive);
+}
+
+void HolePuncher::delKeepAlive(PoolHandle id)
+{
+	KeepAlive* keepalive = m_keepalives[id];
+	if (keepalive != nullptr) {
+		m_timers.cancel(keepalive->timer);
+		m_timers.cancel(keepalive->recheckTimer);
+		forgetPaths(id, *keepalive);
+		m_keepalives.destroy(id);
+	}
+}
+
+PoolHandle HolePuncher::findByPath(NetAddress const& address) const
+{
+	auto path = m_paths.find(address);
+	return path != m_paths.end() ? path->second : PoolHandle();
+}
+
+void HolePuncher::forgetPaths(PoolHandle id, KeepAlive const& keepalive)
+{
+	for (Candidate const& candidate : keepalive.candidates) {
+		auto path = m_paths.find(candidate.address);
+		if (path != m_paths.end() && path->second == id) {
+			m_paths.erase(path);
+		}
+	}
+}
+
+void HolePuncher::setKeepAlivePeriod(size_t period)
+{
+	LOG(1, "HolePuncher: keepalive period set to %u ms.", (unsigned)period);
+
+	// running timers keep their deadlines, the new period applies from the next keepalive
+	m_keepalivePeriod = period;
+}
+
+void HolePuncher::update(Socket const& socket)
+{
 	for (auto remoteHost : m_pendings) {
-		if (!remoteHost) continue;
+		sprayPredictedPorts(socket, remoteHost.handle, *remoteHost.value);
+	}
+}
 
-		if (m_autoping && remoteHost->addresses.empty()) {
-			NetAddress fakeAddr = NetAddress::ipv4(8, 8, 8, 8, 48800);
-			sendPingMsg(socket, fakeAddr, PING_MSGID, PoolHandle());
+bool HolePuncher::predicting() const
+{
+	for (auto remoteHost : m_pendings) {
+		PendingHost const& host = *remoteHost.value;
+		const uint32_t limit = (host.portDelta != 0) ? PREDICTION_WINDOW : PREDICTION_RANDOM;
+		if (host.predictionBase.getport() != 0 && host.validAddress.getport() == 0 && host.predicted < limit) {
+			return true;
 		}
-		for (auto& address : remoteHost->addresses) {
-			sendPingMsg(socket, address, PING_MSGID, remoteHost.handle);
+	}
+	return false;
+}
+
+void HolePuncher::onKeepAliveTimer(PoolHandle id)
+{
+	KeepAlive& keepalive = m_keepalives.at(id);
+	Candidate& nominated = keepalive.candidates[keepalive.nominated];
+	size_t timeout = std::min<size_t>(KEEPALIVE_TIMEOUT_MS, m_keepalivePeriod / 2);
+
+	if (keepalive.pinged == 0) {
+		keepalive.timer = m_timers.schedule(timeout, [this, id]() { onKeepAliveTimer(id); });
+		keepalive.pinged = getTimeMs();
+		check(id, nominated);
+		return;
+	}
+
+	// the pong is due by now, the next keepalive goes out a period after the previous one
+	keepalive.timer = m_timers.schedule(m_keepalivePeriod - timeout, [this, id]() { onKeepAliveTimer(id); });
+	bool missed = nominated.lastPong < keepalive.pinged;
+	keepalive.pinged = 0;
+	if (missed) {
+		LOG(1, "HolePuncher: peer [%u/%u] missed keepalive on '%s', recheck paths.", id.index, id.nonce, toString(nominated.address).c_str());
+		recheck(id, keepalive);
+	}
+}
+
+void HolePuncher::onRecheckTimer(PoolHandle id)
+{
+	KeepAlive& keepalive = m_keepalives.at(id);
+	keepalive.recheckTimer = m_timers.schedule(jitter(keepalive.recheckInterval, PUNCH_JITTER_PERCENT), [this, id]() { onRecheckTimer(id); });
+	keepalive.recheckInterval = std::min<size_t>(keepalive.recheckInterval * 2, RECHECK_MAX_MS);
+
+	nominate(id, keepalive);
+	for (auto& candidate : keepalive.candidates) {
+		check(id, candidate);
+	}
+}
+
+void HolePuncher::recheck(PoolHandle id, KeepAlive& keepalive)
+{
+	m_timers.cancel(keepalive.recheckTimer);
+	keepalive.recheckInterval = RECHECK_INITIAL_MS;
+	keepalive.recheckTimer = m_timers.schedule(0, [this, id]() { onRecheckTimer(id); });
+}
+
+void HolePuncher::check(PoolHandle id, Candidate& candidate)
+{
+	sendPingMsg(m_socket, candidate.address, PING_MSGID, id);
+	candidate.unanswered += 1;
+}
+
+void HolePuncher::onProbeTimer(PoolHandle id)
+{
+	PendingHost& host = m_pendings.at(id);
+	host.timer = m_timers.schedule(jitter(host.interval, PUNCH_JITTER_PERCENT), [this, id]() { onProbeTimer(id); });
+	host.interval = std::min<size_t>(host.interval * 2, RESEND_PERIOD_MS);
+
+	if (m_autoping && host.addresses.empty()) {
+		NetAddress fakeAddr = NetAddress::ipv4(8, 8, 8, 8, 48800);
+		sendPingMsg(m_socket, fakeAddr, PING_MSGID, PoolHandle());
+	}
+	for (auto& address : host.addresses) {
+		sendPingMsg(m_socket, address, PING_MSGID, id);
+		host.pings += 1;
+		if (m_metrics != nullptr) {
+			m_metrics->onPunchAttempt(id);
 		}
 	}
 }
 
+void HolePuncher::onDeadline(PoolHandle id)
+{
+	PendingHost& host = m_pendings.at(id);
+	LOG(1, "HolePuncher: peer [%u/%u] not punched in %llu ms, %u pings sent, give up.", id.index, id.nonce,
+		(unsigned long long)(getTimeMs() - host.startTime), host.pings);
+
+	auto onFailed = std::move(host.onFailed);
+	delRemoteHost(id);
+	if (onFailed) {
+		onFailed();
+	}
+}
+
 void HolePuncher::onPingReceived(Socket const& socket, NetAddress const& src, CBytes bytes)
 {
-	PoolHandle id = *(PoolHandle*)(bytes.begin + 2);
-	log(2, "Receive punching message from '%s': [PING '%u/%u'].", toString(src).c_str(), id.index, id.nonce);
-	sendPingMsg(socket, src, PONG_MSGID, id);
+	if (bytes.size() < sizeof(PingMsg)) {
+		LOG(2, "Receive punching message from '%s': invalid [PING] format.", toString(src).c_str());
+		return;
+	}
+
+	PingMsg const* ping = (PingMsg const*)bytes.begin;
+	LOG(2, "Receive punching message from '%s': [PING '%u/%u'].", toString(src).c_str(), ping->id.index, ping->id.nonce);
+	sendPingMsg(socket, src, PONG_MSGID, ping->id, ping->stamp.get());
 }
 
 void HolePuncher::onPongReceived(Socket const&, NetAddress const& src, CBytes bytes)
 {
-	PoolHandle id = *(PoolHandle*)(bytes.begin + 2);
-	log(2, "Receive punching message from '%s': [PONG '%u/%u'].", toString(src).c_str(), id.index, id.nonce);
+	if (bytes.size() < sizeof(PingMsg)) {
+		LOG(2, "Receive punching message from '%s': invalid [PONG] format.", toString(src).c_str());
+		return;
+	}
+
+	PingMsg const* pong = (PingMsg const*)bytes.begin;
+	PoolHandle id = pong->id;
+	uint32_t rtt = (uint32_t)getTimeMs() - pong->stamp.get();
+	LOG(2, "Receive punching message from '%s': [PONG '%u/%u'], rtt %u ms.", toString(src).c_str(), id.index, id.nonce, rtt);
+
+	auto keepalive = m_keepalives[id];
+	if (keepalive != nullptr) {
+		onCandidatePong(id, *keepalive, src, rtt);
+		if (m_metrics != nullptr) {
+			m_metrics->onRtt(id, rtt);
+		}
+	}
 
 	auto host = m_pendings[id];
 	if (host != nullptr) {
+		if (host->validAddress.getport() == 0) {
+			m_timers.cancel(host->deadline);
+			LOG(1, "HolePuncher: peer [%u/%u] punched at '%s' in %llu ms, %u pings sent%s.", id.index, id.nonce, toString(src).c_str(),
+				(unsigned long long)(getTimeMs() - host->startTime), host->pings, host->predicted != 0 ? " (port prediction)" : "");
+		}
 		host->validAddress = src;
 		if (host->callback) {
 			auto callback = std::move(host->callback);
 			callback(src);
 		}
-	} else {
-		log(2, "Recv [PONG]: peer [%u/%u] not found.", id.index, id.nonce);
+	} else if (keepalive == nullptr) {
+		LOG(2, "Recv [PONG]: peer [%u/%u] not found.", id.index, id.nonce);
+	}
+}
+
+void HolePuncher::onCandidatePong(PoolHandle id, KeepAlive& keepalive, NetAddress const& src, uint32_t rtt)
+{
+	for (auto& candidate : keepalive.candidates) {
+		if (candidate.address == src) {
+			// only checked paths are looked up, gray addresses of different private networks may coincide
+			if (candidate.rtt == UINT32_MAX) {
+				m_paths[src] = id;
+			}
+			// the same smoothing TCP uses for its RTT estimate
+			candidate.rtt = (candidate.rtt == UINT32_MAX) ? rtt : (7 * candidate.rtt + rtt) / 8;
+			candidate.lastPong = getTimeMs();
+			candidate.unanswered = 0;
+			nominate(id, keepalive);
+			return;
+		}
+	}
+}
+
+void HolePuncher::nominate(PoolHandle id, KeepAlive& keepalive)
+{
+	auto dead = [](Candidate const& candidate) { return candidate.unanswered >= PATH_DEAD_PERIODS; };
+	auto answered = [&dead](Candidate const& candidate) { return candidate.rtt != UINT32_MAX && !dead(candidate); };
+
+	size_t best = keepalive.nominated;
+	for (size_t i = 0; i < keepalive.candidates.size(); ++i) {
+		Candidate const& candidate = keepalive.candidates[i];
+		if (!answered(candidate) || i == best) continue;
+
+		Candidate const& current = keepalive.candidates[best];
+		if (dead(current)) {
+			best = i;
+		} else if (current.rtt == UINT32_MAX) {
+			continue; // nominated path is not measured yet
+		} else if (candidate.rtt + PATH_SWITCH_MARGIN_MS < current.rtt) {
+			best = i;
+		} else if (candidate.rtt <= current.rtt + PATH_SWITCH_MARGIN_MS && candidate.priority > current.priority) {
+			best = i;
+		}
+	}
+
+	if (best != keepalive.nominated) {
+		Candidate const& candidate = keepalive.candidates[best];
+		LOG(1, "HolePuncher: peer [%u/%u] switches path '%s' -> '%s', rtt %u ms.", id.index, id.nonce,
+			toString(keepalive.candidates[keepalive.nominated].address).c_str(), toString(candidate.address).c_str(), candidate.rtt);
+
+		keepalive.nominated = best;
+		if (m_onPathChanged) {
+			m_onPathChanged(id, candidate.address);
+		}
 	}
 }
\ No newline at end of file
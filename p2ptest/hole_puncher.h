@@ -1,5 +1,6 @@
 #pragma once
 
+#include "metrics.h"
 #include "socket.h"
 
 #include <unordered_map>
@@ -18,30 +19,122 @@ namespace std {
 class HolePuncher {
 public:
 	static const int RESEND_PERIOD_MS = 1000;
+	static const int KEEPALIVE_DEFAULT_MS = 5000;
+	static const int MAX_ADDRESSES = 4;           // candidate addresses probed for one pending host
+
+	// Punching schedule of one pending host: probes start fast and back off up to the resend period
+	static const int PUNCH_INITIAL_MS = 50;
+	static const int PUNCH_JITTER_PERCENT = 25;   // every interval is randomised by that much either way
+
+	// Port prediction for peers behind symmetric NAT
+	static const int PREDICTION_RATE = 200;       // pings per second for one host
+	static const int PREDICTION_BURST = 16;       // pings per update for one host
+	static const int PREDICTION_WINDOW = 64;      // predicted allocations after the known one
+	static const int PREDICTION_RANDOM = 512;     // random ports probed when allocation step is unknown
+
+	// Path selection for established peers
+	static const int PATH_SWITCH_MARGIN_MS = 2;   // candidate has to be that much faster to replace nominated one
+	static const int PATH_DEAD_PERIODS = 3;       // candidate is considered dead after that many unanswered checks
+	static const int RECHECK_INITIAL_MS = 100;    // candidates are checked on a timer of their own, backing off
+	static const int RECHECK_MAX_MS = 30000;      // up to that
+	static const int KEEPALIVE_TIMEOUT_MS = 1000; // nominated path is rechecked at once if its keepalive isn't answered in time
 
 public:
-	HolePuncher(bool autoping) : m_autoping(autoping), m_resendTimer(RESEND_PERIOD_MS) {}
+	// Timers are run on 'timers', their callbacks send through 'socket'.
+	HolePuncher(bool autoping, Socket const& socket, TimerWheel& timers);
+	~HolePuncher();
 
-	void addRemoteHost(PoolHandle id, Array<NetAddress const> addresses, size_t timeout, std::function<void(NetAddress const&)> callback);
+	// Probes 'addresses' until one of them answers, 'callback' gets the first one answered.
+	// If nothing answers within 'timeout' ms (0 - never gives up) the host is dropped and 'onFailed' is called.
+	void addRemoteHost(PoolHandle id, Array<NetAddress const> addresses, size_t timeout,
+		Callback<void(NetAddress const&)> callback, Callback<void()> onFailed = nullptr);
 	void delRemoteHost(PoolHandle id);
 
+	// Remote host is behind symmetric NAT, its mapping towards us is unknown. Sprays pings over ports
+	// the NAT is expected to allocate next after 'mapped' ('delta' apart), or over random ports if delta is 0.
+	void predictPorts(PoolHandle id, NetAddress const& mapped, int delta);
+
+	// Keeps NAT mappings of an established peer open while it's idle, only the nominated path gets
+	// keepalives. All candidate paths are checked on a backing off timer, the one with the lowest RTT
+	// gets nominated through 'onPathChanged'. Unanswered keepalive restarts the checks.
+	void addKeepAlive(PoolHandle id, NetAddress const& address, Array<NetAddress const> candidates);
+	void delKeepAlive(PoolHandle id);
+	void setKeepAlivePeriod(size_t period);
+	void setPathCallback(std::function<void(PoolHandle, NetAddress const&)> onPathChanged) { m_onPathChanged = std::move(onPathChanged); }
+	// Established peer owning 'address' among its answered candidates. The remote side nominates its
+	// path on its own, so its traffic may come from any of them, not only from our nominated one.
+	PoolHandle findByPath(NetAddress const& address) const;
+	// Punch attempts and round trips are counted into 'metrics' if set.
+	void setMetrics(NetMetrics* metrics) { m_metrics = metrics; }
+
 	void onPingReceived(Socket const& socket, NetAddress const& src, CBytes bytes);
 	void onPongReceived(Socket const& socket, NetAddress const& src, CBytes bytes);
 
 	void update(Socket const& socket);
+	// True while 'update' sprays predicted ports, it has to be called every millisecond meanwhile.
+	bool predicting() const;
 
 private:
 	static const uint32_t PING_MSGID = 0;
 	static const uint32_t PONG_MSGID = 1;
 
 	struct PendingHost {
-		std::vector<NetAddress> addresses;
+		FixedArray<NetAddress, MAX_ADDRESSES> addresses;
 		NetAddress validAddress = NetAddress::any(0);
-		std::function<void(NetAddress const&)> callback;
+		Callback<void(NetAddress const&)> callback;
+		Callback<void()> onFailed;
+
+		uint64_t startTime = 0;
+		uint32_t pings = 0;
+		size_t interval = 0;
+		TimerWheel::Handle timer;
+		TimerWheel::Handle deadline;
+
+		NetAddress predictionBase = NetAddress::any(0);
+		int portDelta = 0;
+		uint32_t predicted = 0;
+		uint64_t predictionTime = 0;
+	};
+
+	struct Candidate {
+		NetAddress address;
+		int priority;
+		uint32_t rtt;       // smoothed, UINT32_MAX until the first pong
+		uint64_t lastPong;
+		uint32_t unanswered;   // pings since the last pong
+	};
+
+	struct KeepAlive {
+		std::vector<Candidate> candidates;
+		size_t nominated;
+		TimerWheel::Handle timer;
+		uint64_t pinged;       // when the keepalive awaiting its pong was sent, 0 if none is
+		TimerWheel::Handle recheckTimer;
+		size_t recheckInterval;
 	};
 
+private:
+	void sprayPredictedPorts(Socket const& socket, PoolHandle id, PendingHost& host);
+	void onCandidatePong(PoolHandle id, KeepAlive& keepalive, NetAddress const& src, uint32_t rtt);
+	void forgetPaths(PoolHandle id, KeepAlive const& keepalive);
+	void nominate(PoolHandle id, KeepAlive& keepalive);
+	void check(PoolHandle id, Candidate& candidate);
+	// Checks all candidates at once and restarts the backoff.
+	void recheck(PoolHandle id, KeepAlive& keepalive);
+	void onKeepAliveTimer(PoolHandle id);
+	void onRecheckTimer(PoolHandle id);
+	void onProbeTimer(PoolHandle id);
+	void onDeadline(PoolHandle id);
+
 private:
 	bool m_autoping;
-	Timer m_resendTimer;
+	Socket const& m_socket;
+	TimerWheel& m_timers;
 	PoolMirror<PendingHost> m_pendings;
+
+	size_t m_keepalivePeriod;
+	PoolMirror<KeepAlive> m_keepalives;
+	std::unordered_map<NetAddress, PoolHandle> m_paths;   // answered candidates, for 'findByPath'
+	std::function<void(PoolHandle, NetAddress const&)> m_onPathChanged;
+	NetMetrics* m_metrics = nullptr;
 };
\ No newline at end of file
@@ -1,26 +1,91 @@
-#include "host.h"
+﻿#include "host.h"
 #include "log.h"
 
+#include <algorithm>
 
-NetHost::NetHost(bool isMaster, Socket& socket, StunClient::Result const& natInfo, std::vector<INetClient*> clients)
-	: m_master(isMaster), m_puncher(isMaster), m_socket(socket), m_clients(std::move(clients)), peersInfoChanged(true)
+
+NetHost::NetHost(bool isMaster, Socket& socket, std::vector<INetClient*> clients)
+	: m_master(isMaster), m_puncher(isMaster, socket, m_timers), m_socket(socket), m_clients(std::move(clients)), peersInfoChanged(true), natInfoChanged(false)
 {
-	m_selfAddresses[0] = natInfo.grayAddress;
-	m_selfAddresses[1] = natInfo.whiteAddress;
+#if LATENCY_STATS
+	m_latency.reset(new Latency());
+#endif
+	m_startTime = getTimeMs();
+	m_natVersion = 0;
+	m_firstPacketReceived = false;
 	m_state.type = isMaster ? State::Idle : State::NotConnected;
+
+	m_selfAddresses[0] = resolve_local_address(m_socket);
+	m_selfAddresses[1] = NetAddress::any(0);
+
+	m_puncher.setPathCallback([this](PeerId peerId, NetAddress const& address) {
+		NetAddress* peerAddress = m_peers.get<PeerField::Address>(peerId);
+		if (peerAddress != nullptr) {
+			*peerAddress = address;
+			m_metrics.setPeerAddress(peerId, address);
+		}
+	});
+	m_puncher.setMetrics(&m_metrics);
+}
+
+void NetHost::resolveNat(std::vector<std::string> const& stunServers, char const* cachePath)
+{
+	// NAT type is resolved in background, host accepts traffic in the meantime
+	m_stun.start(m_socket, stunServers, cachePath);
+	updateNatInfo();
+}
+
+void NetHost::updateNatInfo()
+{
+	if (m_natVersion == m_stun.version()) {
+		return;
+	}
+
+	m_natVersion = m_stun.version();
+	m_selfAddresses[0] = m_stun.result().grayAddress;
+	m_selfAddresses[1] = m_stun.result().whiteAddress;
+	natInfoChanged = true;
+
+	// the master registers the latest Request from an address, a sent one with stale info is replaced at once
+	if (m_state.type == State::WaitResponce && natResolved()) {
+		sendRequest(m_state.waitResponce.address);
+		restartResponceTimer(CONNECT_RETRY_TIMEOUT_MS);
+	}
+}
+
+void NetHost::updateKeepAlive()
+{
+	if (m_lifetimeProbe.active()) {
+		m_lifetimeProbe.update();
+		size_t lifetime = m_lifetimeProbe.lifetime();
+		size_t expired = m_lifetimeProbe.expiredAfter();
+		if (m_lifetimeProbe.ready() && (lifetime != 0 || expired != 0)) {
+			// keep a safety margin below measured lifetime, it's only known with probe resolution;
+			// a mapping which didn't survive even the shortest interval probed gets half of it
+			size_t period = (lifetime != 0) ? lifetime - lifetime / 5 : expired / 2;
+			m_puncher.setKeepAlivePeriod(std::max<size_t>(NatLifetimeProbe::SHORTEST_INTERVAL_MS / 2, period));
+		}
+		return;
+	}
+
+	NatType type = m_stun.result().type;
+	bool behindNat = (type != NatType::Unknown && type != NatType::Open && type != NatType::Blocked);
+	if (behindNat && !m_stun.active() && !m_lifetimeProbe.ready() && m_stun.serverAddress().getport() != 0) {
+		m_lifetimeProbe.start(m_socket, m_stun.serverAddress());
+	}
 }
 
 
 void NetHost::queryPeerInfos(std::function<void(PeerId, PeerInfo const&)> const& callback)
 {
-    for (auto peer : m_peers) {
-        if (!peer || peer->nickname[0] == '\0') continue;
-        callback(peer.handle, *peer.value);
+    for (PeerId peer : m_peers) {
+        if (m_peers.at<PeerField::Details>(peer).nickname[0] == '\0') continue;
+        callback(peer, peerInfo(peer));
     }
 }
 
 
-PeerId NetHost::connect(Array<NetAddress const> addresses, std::function<void(int)> const& onFailed)
+PeerId NetHost::connect(Array<NetAddress const> addresses, Callback<void(int)> onFailed)
 {
 	if (addresses.empty() || m_state.type != State::NotConnected) {
 		return PeerId();
@@ -29,44 +94,124 @@ PeerId NetHost::connect(Array<NetAddress const> addresses, std::function<void(in
 	NetAddress altAddress = addresses.count() > 1 ? addresses[1] : NetAddress::any(0);
 	PeerId peerId = addPeer(NetAddress::any(0), addresses[0], altAddress);
 
-	m_connFailedCallback = onFailed;
+	m_connFailedCallback = std::move(onFailed);
 	m_puncher.addRemoteHost(peerId, addresses, CONNECT_INIT_TIMEOUT_MS, [this, peerId](NetAddress const& address){
 		m_state.type = State::WaitResponce;
 		m_state.waitResponce.address = address;
 		m_state.waitResponce.failReason = CONNECTION_RESPONCE_TIMEOUT;
-		m_state.waitResponce.timer = Timer(CONNECT_RETRY_TIMEOUT_MS);
+		m_state.waitResponce.timer = TimerWheel::Handle();
 		m_state.waitResponce.retries = 0;
+		restartResponceTimer(CONNECT_RETRY_TIMEOUT_MS);
 
-		m_peers.at(peerId).addresses[0] = address;
-		sendRequest(address);
+		m_peers.at<PeerField::Address>(peerId) = address;
+		if (natResolved()) {
+			sendRequest(address);
+		}
+	}, [this]() {
+		LOG(2, "NetHost: connection failed, master is unreachable.");
+		onConnectionFailed(INITIATE_CONNECTION_TIMEOUT);
 	});
 	return peerId;
 }
 
+void NetHost::restartResponceTimer(size_t delay)
+{
+	m_timers.cancel(m_state.waitResponce.timer);
+	m_state.waitResponce.timer = m_timers.schedule(delay, [this]() { onResponceTimeout(); });
+}
+
+void NetHost::onResponceTimeout()
+{
+	if (!natResolved()) {
+		// request carries our white address, so it can't be sent before NAT is resolved
+		restartResponceTimer(CONNECT_RETRY_TIMEOUT_MS);
+	} else if (m_state.waitResponce.retries != CONNECT_MAX_RETRIES) {
+		LOG(2, "NetHost: connection responce not received, retrying to send request.");
+		sendRequest(m_state.waitResponce.address);
+		m_state.waitResponce.retries += 1;
+		m_metrics.global.retransmits.add();
+		restartResponceTimer(CONNECT_RETRY_TIMEOUT_MS);
+	} else {
+		LOG(2, "NetHost: connection failed, master not responded.");
+		onConnectionFailed(m_state.waitResponce.failReason);
+	}
+}
+
 void NetHost::onConnectionFailed(int reason)
 {
+	if (m_state.type == State::WaitResponce) {
+		m_timers.cancel(m_state.waitResponce.timer);
+	}
 	if (m_connFailedCallback) {
 		m_connFailedCallback(reason);
 	}
-	for (auto peer : m_peers) {
-		if (peer) delPeer(peer.handle);
+	for (PeerId peer : m_peers) {
+		delPeer(peer);
 	}
 	m_state.type = State::NotConnected;
 }
 
 bool NetHost::send(PeerId dst, CBytes data)
 {
-	return false;
+	Packet msg = Packet::alloc(data.size());
+	memcpy(msg.data(), data.begin, data.size());
+	return send(dst, 0, std::move(msg));
+}
+
+bool NetHost::send(PeerId dst, int id, Packet msg)
+{
+	NetAddress const* address = m_peers.get<PeerField::Address>(dst);
+	if (address == nullptr || m_peers.at<PeerField::Status>(dst) != PeerInfo::Connected) {
+		return false;
+	}
+
+	MsgData* header = (MsgData*)msg.prepend(sizeof(MsgData));
+	if (header == nullptr) {
+		return false;
+	}
+	*header = MsgData();
+	header->id = (uint16_t)id;
+	int count = m_socket.sendto(*address, msg);
+	if (count > 0) {
+		m_metrics.onSentData(dst, (size_t)count);
+	}
+	return count == (int)msg.size();
 }
 
 void NetHost::receive()
 {
+	// the buffer is reused unless somebody kept a reference to it
+	if (!m_recvPacket.unique()) {
+		m_recvPacket = Packet::alloc();
+	}
+	m_recvPacket.clear();
+
 	NetAddress src;
-	int count = m_socket.recvfrom(m_recvBuffer, sizeof(m_recvBuffer), 0, src);
+	int count = m_socket.recvfrom(m_recvPacket, src);
 	if (count >= 2) {
-		CBytes bytes(m_recvBuffer, m_recvBuffer + count);
+		CBytes bytes(m_recvPacket.data(), m_recvPacket.data() + count);
+		if (!m_firstPacketReceived) {
+			LOG(1, "NetHost: first packet received in %llu ms after start.", (unsigned long long)(getTimeMs() - m_startTime));
+			m_firstPacketReceived = true;
+		}
+
+		if (StunClient::isStunMessage(bytes)) {
+			LATENCY_SCOPE(m_latency->stun);
+			if (!m_stun.onResponse(src, bytes)) {
+				LOG(2, "NetHost: unexpected STUN message received from '%s', skip.", toString(src).c_str());
+			}
+			return;
+		}
+
+		PeerId peerId = findPeerByAddress(src);
+		m_metrics.onReceived(peerId, (size_t)count);
+		uint64_t* lastSeen = m_peers.get<PeerField::LastSeen>(peerId);
+		if (lastSeen != nullptr) {
+			*lastSeen = getTimeMs();
+		}
 
-		net_uint16_t msgId = *(net_uint16_t*)m_recvBuffer;
+		net_uint16_t msgId = *(net_uint16_t const*)bytes.begin;
+		LATENCY_SCOPE(m_latency->handlers[std::min<int>(msgId.get(), MsgId::Count)]);
 		switch (msgId.get()) {
 		case MsgId::Ping: m_puncher.onPingReceived(m_socket, src, bytes); break;
 		case MsgId::Pong: m_puncher.onPongReceived(m_socket, src, bytes); break;
@@ -77,46 +222,117 @@ void NetHost::receive()
 		case MsgId::Join:     onJoin(src, bytes); break;
 		case MsgId::JoinOk:   onJoinOk(src, bytes); break;
 		case MsgId::PingA:    onPingA(src, bytes); break;
+		case MsgId::Data:     onData(peerId, src); break;
 		default:
-			log(2, "NetHost: invalid message received [id%u], skip. count=%d", msgId.get(), count);
+			LOG(2, "NetHost: invalid message received [id%u], skip. count=%d", msgId.get(), count);
+			m_metrics.onDrop(DropReason::UnknownMessage);
 		}
 	}
 }
 
+void NetHost::wait(size_t maxTimeout)
+{
+	uint64_t now = Clock::preciseUs() / 1000;
+	uint64_t deadline = nextDeadline();
+	if (deadline > now) {
+		m_socket.wait((size_t)std::min<uint64_t>(deadline - now, maxTimeout));
+	}
+}
+
+void NetHost::wait(size_t maxTimeout, Socket const& wakeup)
+{
+	uint64_t now = Clock::preciseUs() / 1000;
+	uint64_t deadline = nextDeadline();
+	if (deadline > now) {
+		m_socket.wait((size_t)std::min<uint64_t>(deadline - now, maxTimeout), wakeup);
+	}
+}
+
+uint64_t NetHost::nextDeadline() const
+{
+	uint64_t deadline = m_timers.nextDeadline();
+	if (m_lifetimeProbe.active()) {
+		deadline = std::min<uint64_t>(deadline, m_lifetimeProbe.deadline());
+	}
+	if (m_stun.active() || m_puncher.predicting()) {
+		// polled by 'update'
+		deadline = std::min<uint64_t>(deadline, m_timers.now() + 1);
+	}
+	return deadline;
+}
+
 void NetHost::update()
 {
-	receive();
-	m_puncher.update(m_socket);
+	LATENCY_SCOPE(m_latency->tick);
+	Clock::tick();
+	{
+		LATENCY_SCOPE(m_latency->timers);
+		m_timers.advance(getTimeMs());
+	}
+	{
+		LATENCY_SCOPE(m_latency->receive);
+		receive();
+	}
+	{
+		LATENCY_SCOPE(m_latency->punching);
+		m_puncher.update(m_socket);
+	}
+	if (m_stun.active()) {
+		LATENCY_SCOPE(m_latency->stun);
+		m_stun.update();
+	}
+	updateNatInfo();
+	{
+		LATENCY_SCOPE(m_latency->keepalive);
+		updateKeepAlive();
+	}
 
-	if (m_state.type == State::WaitResponce) {
-		if (m_state.waitResponce.timer.expired()) {
-			if (m_state.waitResponce.retries != CONNECT_MAX_RETRIES) {
-				log(2, "NetHost: connection responce not received, retrying to send request.");
-				sendRequest(m_state.waitResponce.address);
-				m_state.waitResponce.retries += 1;
-			} else {
-				log(2, "NetHost: connection failed, master not responded.");
-				onConnectionFailed(m_state.waitResponce.failReason);
-			}
-		}
+	m_metrics.global.peers.set((int64_t)m_peers.count());
+	m_metrics.global.timers.set((int64_t)m_timers.count());
+	m_metrics.global.packetSlabs.set((int64_t)Packet::stats().slabs);
+}
+
+void NetHost::dumpLatency(FILE* out) const
+{
+#if LATENCY_STATS
+	static char const* const handlers[MsgId::Count + 1] = {
+		"onPing", "onPong", "onHeartbeat", "onRequest", "onReject", "onResponce",
+		"onPingA", "onPingB", "onJoin", "onJoinOk", "onLeave", "onData", "unknown",
+	};
+
+	printLatencyHeader(out);
+	printLatency(out, "tick", m_latency->tick);
+	printLatency(out, "timers", m_latency->timers);
+	printLatency(out, "receive", m_latency->receive);
+	printLatency(out, "stun", m_latency->stun);
+	printLatency(out, "punching", m_latency->punching);
+	printLatency(out, "keepalive", m_latency->keepalive);
+	for (size_t i = 0; i <= MsgId::Count; ++i) {
+		printLatency(out, handlers[i], m_latency->handlers[i]);
 	}
+#else
+	fprintf(out, "Latency statistics are compiled out (LATENCY_STATS=0).\n");
+#endif
 }
 
 PeerId NetHost::findPeerByAddress(NetAddress const& address)
 {
-	for (auto peer : m_peers) {
-		if (peer && peer->addresses[0] == address) {
-			return peer.handle;
+	// scans the address column only
+	Array<NetAddress> addresses = m_peers.column<PeerField::Address>();
+	for (PeerId peer : m_peers) {
+		if (addresses[peer.index] == address) {
+			return peer;
 		}
 	}
-	return PeerId();
+	// the peer may send over another path than the one nominated here
+	return m_puncher.findByPath(address);
 }
 
 PeerId NetHost::findPeerByNonce(int nonce)
 {
-	for (auto peer : m_peers) {
-		if (peer && peer.handle.nonce == nonce) {
-			return peer.handle;
+	for (PeerId peer : m_peers) {
+		if (peer.nonce == nonce) {
+			return peer;
 		}
 	}
 	return PeerId();
@@ -126,156 +342,274 @@ PeerId NetHost::addPeer(NetAddress const& hostAddress, NetAddress const& grayAdd
 {
 	peersInfoChanged = true;
 
-	PeerInfo peerInfo;
-	peerInfo.addresses[0] = hostAddress;
-	peerInfo.addresses[1] = grayAddress;
-	peerInfo.addresses[2] = whiteAddress;
-	peerInfo.status = PeerInfo::Connecting;
-    memset(peerInfo.nickname, 0, sizeof(peerInfo.nickname));
-	return m_peers.alloc(std::move(peerInfo));
+	PeerId peerId = m_peers.alloc();
+	m_peers.at<PeerField::Status>(peerId) = PeerInfo::Connecting;
+	m_peers.at<PeerField::Address>(peerId) = hostAddress;
+	m_peers.at<PeerField::LastSeen>(peerId) = getTimeMs();
+
+	PeerDetails& details = m_peers.at<PeerField::Details>(peerId);
+	details.grayAddress = grayAddress;
+	details.whiteAddress = whiteAddress;
+	details.nat = NatHint();
+    memset(details.nickname, 0, sizeof(details.nickname));
+
+	PeerTable::Entry entry = {};
+	entry.status = PeerInfo::Connecting;
+	details.published = m_peerTable.entries.alloc(entry);
+	m_peerTable.version.fetch_add(1, std::memory_order_release);
+
+	m_metrics.addPeer(peerId, hostAddress);
+	return peerId;
+}
+
+void NetHost::publishPeer(PeerId peerId)
+{
+	PeerDetails const& details = m_peers.at<PeerField::Details>(peerId);
+	PeerTable::Entry entry;
+	memcpy(entry.nickname, details.nickname, sizeof(entry.nickname));
+	entry.status = m_peers.at<PeerField::Status>(peerId);
+	if (m_peerTable.entries.store(details.published, entry)) {
+		m_peerTable.version.fetch_add(1, std::memory_order_release);
+	}
+}
+
+NetHost::PeerInfo NetHost::peerInfo(PeerId peerId) const
+{
+	PeerDetails const& details = m_peers.at<PeerField::Details>(peerId);
+
+	PeerInfo info;
+	memcpy(info.nickname, details.nickname, sizeof(info.nickname));
+	info.addresses[0] = m_peers.at<PeerField::Address>(peerId);
+	info.addresses[1] = details.grayAddress;
+	info.addresses[2] = details.whiteAddress;
+	info.nat = details.nat;
+	info.status = m_peers.at<PeerField::Status>(peerId);
+	info.lastSeen = m_peers.at<PeerField::LastSeen>(peerId);
+	return info;
 }
 
 void NetHost::delPeer(PeerId peerId)
 {
 	peersInfoChanged = true;
-	if (peerId.isValid()) {
+	if (m_peers.contains(peerId)) {
+		setPeerStatus(peerId, PeerInfo::Disconnecting);
 		m_puncher.delRemoteHost(peerId);
+		m_puncher.delKeepAlive(peerId);
+		m_metrics.delPeer(peerId);
+		if (m_peerTable.entries.dealloc(m_peers.at<PeerField::Details>(peerId).published)) {
+			m_peerTable.version.fetch_add(1, std::memory_order_release);
+		}
 		m_peers.dealloc(peerId);
 	}
 }
 
 void NetHost::onReject(NetAddress const& src, CBytes data)
 {
-	log(2, "NetHost: receive 'Reject' message.");
+	LOG(2, "NetHost: receive 'Reject' message.");
 
 	MsgResponceHeader* header = (MsgResponceHeader*)data.begin;
 	if (header->length.get() == RejectReason::NotMaster) {
 		onConnectionFailed(CONNECTION_NOT_MASTER);
 	}
-	if (header->length.get() == RejectReason::InvalidMessageFormat) {
+	if (header->length.get() == RejectReason::InvalidMessageFormat && m_state.type == State::WaitResponce) {
 		m_state.waitResponce.failReason = CORRUPTED_CHANNEL;
-		m_state.waitResponce.timer.activate();
+		restartResponceTimer(0);
 	}
 }
 
 void NetHost::onRequest(NetAddress const& src, CBytes data)
 {
-	log(2, "NetHost: receive 'Request' message from '%s'.", toString(src).c_str());
+	LOG(2, "NetHost: receive 'Request' message from '%s'.", toString(src).c_str());
 
 	if (!m_master || m_state.type != State::Idle) {
 		MsgResponceHeader header{ MsgId::Reject, RejectReason::NotMaster };
-		m_socket.sendto(src, &header, sizeof(header), 0);
+		sendTo(src, &header, sizeof(header));
+		m_metrics.onDrop(DropReason::NotMaster);
 		return;
 	}
 	if (data.size() != sizeof(MsgInitRequest)) {
-		log(1, "NetHost: 'Request' message has invalid format.");
+		LOG(1, "NetHost: 'Request' message has invalid format.");
 		MsgResponceHeader header{ MsgId::Reject, RejectReason::InvalidMessageFormat };
-		m_socket.sendto(src, &header, sizeof(header), 0);
+		sendTo(src, &header, sizeof(header));
+		m_metrics.onDrop(DropReason::InvalidFormat);
 		return;
 	}
     MsgInitRequest* request = (MsgInitRequest*)data.begin;
 
 	delPeer(findPeerByAddress(src));
 	PeerId peerId = addPeer(src, request->addresses[0], request->addresses[1]);
-    memcpy(m_peers[peerId]->nickname, request->nickname, sizeof(request->nickname));
-    m_peers[peerId]->status = PeerInfo::Status::Connected;
+    PeerDetails& details = m_peers.at<PeerField::Details>(peerId);
+    memcpy(details.nickname, request->nickname, sizeof(request->nickname));
+    details.nat = request->nat;
+	setPeerStatus(peerId, PeerInfo::Connected);
+	m_puncher.addKeepAlive(peerId, src, peerInfo(peerId).addresses);
 
 	uint16_t clientsCount = (uint16_t)m_peers.count() - 1;
-	Buffer buffer(sizeof(MsgResponceHeader) + clientsCount * sizeof(MsgResponceFragment));
-	MsgResponceHeader* header = (MsgResponceHeader*)buffer.begin;
+	Packet response = Packet::alloc(sizeof(MsgResponceHeader) + clientsCount * sizeof(MsgResponceFragment));
+	MsgResponceHeader* header = (MsgResponceHeader*)response.data();
 	MsgResponceFragment* fragment = (MsgResponceFragment*)(header + 1);
 
 	header->msgId = MsgId::Response;
 	header->length = clientsCount;
     memcpy(header->nickname, nickname, sizeof(nickname));
-	for (auto peer : m_peers) {
-		if (peer && peerId != peer.handle) {
-			log(2, "NetHost: send connected client '%s'.", toString(peer->addresses[0]).c_str());
+	for (PeerId peer : m_peers) {
+		if (peerId != peer) {
+			PeerInfo info = peerInfo(peer);
+			LOG(2, "NetHost: send connected client '%s'.", toString(info.addresses[0]).c_str());
+
+			memcpy(fragment->addresses, info.addresses, sizeof(info.addresses));
+			fragment->nat = info.nat;
+            memcpy(fragment->nickname, info.nickname, sizeof(info.nickname));
+			fragment += 1;
+		}
+	}
+	sendTo(src, response);
+	sendPingA(peerId, 0);
+}
 
-			MsgRequest ping = *request;
-			ping.msgId = MsgId::PingA;
-			m_socket.sendto(peer->addresses[0], &ping, sizeof(ping), 0);
+void NetHost::sendPingA(PeerId peerId, int repeats)
+{
+	if (!m_peers.contains(peerId)) {
+		return;
+	}
 
-			memcpy(fragment->addresses, peer->addresses, sizeof(peer->addresses));
-            memcpy(fragment->nickname, peer->nickname, sizeof(peer->nickname));
-			fragment += 1;
+	PeerDetails const& details = m_peers.at<PeerField::Details>(peerId);
+	MsgRequest ping;
+	ping.msgId = MsgId::PingA;
+	ping.addresses[0] = details.grayAddress;
+	ping.addresses[1] = details.whiteAddress;
+	ping.nat = details.nat;
+	for (PeerId peer : m_peers) {
+		if (peer != peerId) {
+			sendTo(m_peers.at<PeerField::Address>(peer), &ping, sizeof(ping));
 		}
 	}
-	m_socket.sendto(src, buffer.begin, (int)buffer.size(), 0);
+
+	// nobody acknowledges 'PingA', and a peer behind restricted NAT which missed it never lets the new one in
+	if (repeats != PINGA_REPEATS) {
+		m_timers.schedule(CONNECT_RETRY_TIMEOUT_MS, [this, peerId, repeats]() { sendPingA(peerId, repeats + 1); });
+	}
 }
 
 
 void NetHost::onResponce(NetAddress const& src, CBytes data)
 {
-	log(2, "NetHost: receive 'Response' message.");
+	LOG(2, "NetHost: receive 'Response' message.");
 
 	if (data.size() < sizeof(MsgResponceHeader)) {
-		log(1, "NetHost: 'Response' message has invalid format.");
+		LOG(1, "NetHost: 'Response' message has invalid format.");
+		m_metrics.onDrop(DropReason::InvalidFormat);
+		return;
 	}
 
 	MsgResponceHeader* header = (MsgResponceHeader*)data.begin;
 	if (data.size() != sizeof(MsgResponceHeader) + header->length.get() * sizeof(MsgResponceFragment)) {
-		log(1, "NetHost: 'Response' message has invalid format.");
+		LOG(1, "NetHost: 'Response' message has invalid format.");
+		m_metrics.onDrop(DropReason::InvalidFormat);
+		return;
 	}
 
+	if (m_state.type == State::WaitResponce) {
+		m_timers.cancel(m_state.waitResponce.timer);
+	}
 	m_state.type = State::WaitClients;
 	m_state.waitClients.count = header->length.get();
 	m_puncher.delRemoteHost(findPeerByAddress(src));
 
 	MsgResponceFragment* fragment = (MsgResponceFragment*)(header + 1);
 	for (size_t i = 0; i < m_state.waitClients.count; ++i) {
-		log(2, "NetHost: initiate connect to client '%s'.", toString(fragment->addresses[0]).c_str());
+		LOG(2, "NetHost: initiate connect to client '%s'.", toString(fragment->addresses[0]).c_str());
 
 		PeerId peerId = addPeer(fragment->addresses[0], fragment->addresses[1], fragment->addresses[2]);
-		m_puncher.addRemoteHost(peerId, fragment->addresses, CONNECT_INIT_TIMEOUT_MS, [this](const NetAddress& addr) {
-			log(2, "NetHost: send 'Join' message to '%s'.", toString(addr).c_str());
-			//sendShortMessage(addr, MsgId::Join);
-
-            MsgJoin msgjoin;
-            memcpy(msgjoin.nickname, nickname, sizeof(nickname));
-            m_socket.sendto(addr, &msgjoin, sizeof(msgjoin), 0);
-
-			m_state.waitClients.count -= 1;
-			if (m_state.waitClients.count == 0) {
-				m_state.type = State::Idle;
-			}
+		m_puncher.addRemoteHost(peerId, fragment->addresses, CONNECT_INIT_TIMEOUT_MS, [this, peerId](const NetAddress& addr) {
+			m_peers.at<PeerField::Address>(peerId) = addr;
+			sendJoin(peerId, 0);
+			onClientPunched();
+		}, [this, peerId]() {
+			LOG(2, "NetHost: client [%u/%u] is unreachable, skip.", peerId.index, peerId.nonce);
+			delPeer(peerId);
+			onClientPunched();
 		});
 
-        memcpy(m_peers[peerId]->nickname, fragment->nickname, sizeof(fragment->nickname));
+        PeerDetails& details = m_peers.at<PeerField::Details>(peerId);
+        memcpy(details.nickname, fragment->nickname, sizeof(fragment->nickname));
+		details.nat = fragment->nat;
+		publishPeer(peerId);
+		predictPorts(peerId, fragment->nat, fragment->addresses[2]);
 		fragment += 1;
 	}
 
 	setPeerStatus(src, PeerInfo::Connected);
 
-    auto const peer = m_peers[findPeerByAddress(src)];
-    if (peer != nullptr) {
-        memcpy(peer->nickname, header->nickname, sizeof(header->nickname));
+    PeerId master = findPeerByAddress(src);
+    PeerDetails* details = m_peers.get<PeerField::Details>(master);
+    if (details != nullptr) {
+        memcpy(details->nickname, header->nickname, sizeof(header->nickname));
+        publishPeer(master);
     }
 }
 
 void NetHost::onJoin(NetAddress const& src, CBytes data)
 {
-	log(2, "NetHost: receive 'Join' message from '%s'.", toString(src).c_str());
+	LOG(2, "NetHost: receive 'Join' message from '%s'.", toString(src).c_str());
 
     MsgJoin* msg = (MsgJoin*)data.begin;
     if (data.size() != sizeof(MsgJoin)) {
-        log(1, "NetHost: 'Join' message has invalid format.");
+        LOG(1, "NetHost: 'Join' message has invalid format.");
+        m_metrics.onDrop(DropReason::InvalidFormat);
+        return;
     }
 
 	PeerId peerId = findPeerByAddress(src);
 	if (!peerId.isValid()) {
 		peerId = addPeer(src);
+	} else if (m_peers.at<PeerField::Status>(peerId) == PeerInfo::Connected) {
+		// resent because our 'JoinOk' was lost
+		sendShortMessage(src, MsgId::JoinOk);
+		return;
 	}
 
-	peersInfoChanged = true;
-	m_peers.at(peerId).status = PeerInfo::Connected;
-    memcpy(m_peers.at(peerId).nickname, msg->nickname, sizeof(msg->nickname));
+    memcpy(m_peers.at<PeerField::Details>(peerId).nickname, msg->nickname, sizeof(msg->nickname));
+	setPeerStatus(peerId, PeerInfo::Connected);
+	m_puncher.addKeepAlive(peerId, src, peerInfo(peerId).addresses);
 	sendShortMessage(src, MsgId::JoinOk);
 }
 
+void NetHost::sendJoin(PeerId peerId, int retries)
+{
+	if (!m_peers.contains(peerId) || m_peers.at<PeerField::Status>(peerId) == PeerInfo::Connected) {
+		return;
+	}
+	if (retries > CONNECT_MAX_RETRIES) {
+		LOG(2, "NetHost: client [%u/%u] not answered 'Join', skip.", peerId.index, peerId.nonce);
+		delPeer(peerId);
+		return;
+	}
+
+	NetAddress const& address = m_peers.at<PeerField::Address>(peerId);
+	LOG(2, "NetHost: send 'Join' message to '%s'.", toString(address).c_str());
+	MsgJoin msgjoin;
+	memcpy(msgjoin.nickname, nickname, sizeof(nickname));
+	sendTo(address, &msgjoin, sizeof(msgjoin));
+	if (retries != 0) {
+		m_metrics.global.retransmits.add();
+	}
+
+	// repeated until 'JoinOk' comes, the peer knows about us only from this message
+	m_timers.schedule(CONNECT_RETRY_TIMEOUT_MS, [this, peerId, retries]() { sendJoin(peerId, retries + 1); });
+}
+
+void NetHost::onClientPunched()
+{
+	m_state.waitClients.count -= 1;
+	if (m_state.waitClients.count == 0) {
+		m_state.type = State::Idle;
+	}
+}
+
 void NetHost::onJoinOk(NetAddress const& src, CBytes data)
 {
-	log(2, "NetHost: receive 'JoinOk' message from '%s'.", toString(src).c_str());
+	LOG(2, "NetHost: receive 'JoinOk' message from '%s'.", toString(src).c_str());
 
 	m_puncher.delRemoteHost(findPeerByAddress(src));
 	setPeerStatus(src, PeerInfo::Connected);
@@ -284,37 +618,136 @@ void NetHost::onJoinOk(NetAddress const& src, CBytes data)
 void NetHost::onPingA(NetAddress const& src, CBytes data)
 {
 	MsgRequest* request = (MsgRequest*)data.begin;
-	log(2, "NetHost: receive 'PingA' message from '%s'. Ping host '%s'/'%s'", toString(src).c_str(),
+	if (data.size() < sizeof(MsgRequest)) {
+		LOG(1, "NetHost: 'PingA' message has invalid format.");
+		m_metrics.onDrop(DropReason::InvalidFormat);
+		return;
+	}
+
+	LOG(2, "NetHost: receive 'PingA' message from '%s'. Ping host '%s'/'%s'", toString(src).c_str(),
 		toString(request->addresses[0]).c_str(), toString(request->addresses[1]).c_str());
-	
+
+	for (PeerId peer : m_peers) {
+		PeerDetails const& details = m_peers.at<PeerField::Details>(peer);
+		if (details.grayAddress == request->addresses[0] && details.whiteAddress == request->addresses[1]) {
+			// repeated by the master, the host is already known
+			return;
+		}
+	}
+
 	PeerId peerId = addPeer(NetAddress::any(0), request->addresses[0], request->addresses[1]);
-	m_puncher.addRemoteHost(peerId, request->addresses, 0, [this, peerId](NetAddress const& address){
+	m_puncher.addRemoteHost(peerId, request->addresses, CONNECT_INIT_TIMEOUT_MS, [this, peerId](NetAddress const& address){
+		PeerId joined = findPeerByAddress(address);
+		if (joined.isValid() && joined != peerId) {
+			// its 'Join' came first and got an entry of its own, which takes over what 'PingA' told
+			PeerDetails& details = m_peers.at<PeerField::Details>(joined);
+			PeerDetails const& placeholder = m_peers.at<PeerField::Details>(peerId);
+			details.grayAddress = placeholder.grayAddress;
+			details.whiteAddress = placeholder.whiteAddress;
+			details.nat = placeholder.nat;
+			delPeer(peerId);
+			return;
+		}
+
+		// its 'Join' comes from this address and must find the entry rather than add another one
+		m_peers.at<PeerField::Address>(peerId) = address;
+		m_metrics.setPeerAddress(peerId, address);
 		m_puncher.delRemoteHost(peerId);
+	}, [this, peerId]() {
+		LOG(2, "NetHost: client [%u/%u] is unreachable, skip.", peerId.index, peerId.nonce);
+		delPeer(peerId);
 	});
+	m_peers.at<PeerField::Details>(peerId).nat = request->nat;
+	predictPorts(peerId, request->nat, request->addresses[1]);
+}
+
+void NetHost::onData(PeerId peerId, NetAddress const& src)
+{
+	if (!m_peers.contains(peerId) || m_recvPacket.size() < sizeof(MsgData)) {
+		LOG(2, "NetHost: 'Data' message from unknown host '%s', skip.", toString(src).c_str());
+		m_metrics.onDrop(m_peers.contains(peerId) ? DropReason::InvalidFormat : DropReason::UnknownPeer);
+		return;
+	}
+
+	int id = ((MsgData const*)m_recvPacket.data())->id.get();
+	m_recvPacket.consume(sizeof(MsgData));
+	// clients get references to the receive buffer, it's replaced by a fresh one if any of them keeps it;
+	// the last one gets ours, so it can forward the message with the header prepended in place
+	for (size_t i = 0; i < m_clients.size(); ++i) {
+		m_clients[i]->onMessageReceived(peerId, id, i + 1 < m_clients.size() ? m_recvPacket.share() : std::move(m_recvPacket));
+	}
+}
+
+void NetHost::predictPorts(PeerId peerId, NatHint const& nat, NetAddress const& whiteAddr)
+{
+	// Mappings of symmetric NAT are per destination, the one reported by STUN is useless for us
+	if (nat.natType() == NatType::Symmetric && whiteAddr.getport() != 0) {
+		m_puncher.predictPorts(peerId, whiteAddr, nat.delta());
+	}
 }
 
 void NetHost::sendRequest(NetAddress const& target)
 {
-	log(2, "NetHost: send 'Request' message to '%s'.", toString(target).c_str());
+	LOG(2, "NetHost: send 'Request' message to '%s'.", toString(target).c_str());
 
     MsgInitRequest request;
 	request.addresses[0] = m_selfAddresses[0];
 	request.addresses[1] = m_selfAddresses[1];
+	request.nat = NatHint(m_stun.result());
     memcpy(request.nickname, nickname, sizeof(nickname));
-	m_socket.sendto(target, &request, sizeof(request), 0);
+	sendTo(target, &request, sizeof(request));
 }
 
 void NetHost::sendShortMessage(NetAddress const& target, uint16_t msgid)
 {	
 	net_uint16_t msgjoin = msgid;
-	m_socket.sendto(target, &msgjoin, sizeof(msgjoin), 0);
+	sendTo(target, &msgjoin, sizeof(msgjoin));
+}
+
+void NetHost::sendTo(NetAddress const& target, void const* data, size_t size)
+{
+	int count = m_socket.sendto(target, data, (int)size, 0);
+	if (count > 0) {
+		m_metrics.onSent((size_t)count);
+	}
+}
+
+void NetHost::sendTo(NetAddress const& target, Packet const& packet)
+{
+	int count = m_socket.sendto(target, packet);
+	if (count > 0) {
+		m_metrics.onSent((size_t)count);
+	}
 }
 
 void NetHost::setPeerStatus(NetAddress const& addr, PeerInfo::Status status)
 {
-	auto peer = m_peers[findPeerByAddress(addr)];
-	if (peer != nullptr) {
-		peer->status = status;
+	PeerId peerId = findPeerByAddress(addr);
+	if (m_peers.contains(peerId)) {
+		setPeerStatus(peerId, status);
+		if (status == PeerInfo::Connected) {
+			m_puncher.addKeepAlive(peerId, addr, peerInfo(peerId).addresses);
+		}
 	}
 	peersInfoChanged = true;
+}
+
+void NetHost::setPeerStatus(PeerId peerId, PeerInfo::Status status)
+{
+	PeerInfo::Status& current = m_peers.at<PeerField::Status>(peerId);
+	PeerInfo::Status previous = current;
+	current = status;
+	peersInfoChanged = true;
+	publishPeer(peerId);
+
+	// clients only learn about peers they can send to
+	if (previous != PeerInfo::Connected && status == PeerInfo::Connected) {
+		for (INetClient* client : m_clients) {
+			client->onPeerConnected(peerId);
+		}
+	} else if (previous == PeerInfo::Connected && status != PeerInfo::Connected) {
+		for (INetClient* client : m_clients) {
+			client->onPeerDisconnected(peerId);
+		}
+	}
 }
\ No newline at end of file
@@ -3,8 +3,11 @@
 #include "socket.h"
 #include "stun_client.h"
 #include "hole_puncher.h"
+#include "latency.h"
+#include "metrics.h"
 #include "tools.h"
 
+#include <atomic>
 #include <functional>
 #include <vector>
 #include <chrono>
@@ -16,6 +19,9 @@ struct INetClient {
 	virtual void onPeerConnected(PeerId peer) = 0;
 	virtual void onPeerDisconnected(PeerId peer) = 0;
 	virtual void onMessageReceived(PeerId peer, int id, CBytes msg) = 0;
+	// Owning variant, 'msg' references the receive buffer itself and may be kept or passed to another
+	// thread without copying. The buffer goes back to the pool once the last reference is released.
+	virtual void onMessageReceived(PeerId peer, int id, Packet msg) { onMessageReceived(peer, id, CBytes(msg.data(), msg.data() + msg.size())); }
 };
 
 
@@ -24,8 +30,9 @@ public:
     char nickname[32];
 
 	const static int CONNECT_MAX_RETRIES = 5;
-	const static int CONNECT_INIT_TIMEOUT_MS = 1000;
+	const static int CONNECT_INIT_TIMEOUT_MS = 10000;
 	const static int CONNECT_RETRY_TIMEOUT_MS = 1000;
+	const static int PINGA_REPEATS = 2;        // extra 'PingA' rounds about a new peer, CONNECT_RETRY_TIMEOUT_MS apart
 
 	enum ConnFailReason {
 		INITIATE_CONNECTION_TIMEOUT,
@@ -38,26 +45,62 @@ public:
 		enum Status { Connecting, Connected, Inactive, Offline, Disconnecting };
 		char nickname[32];
 		NetAddress addresses[3];
+		NatHint nat;
 		Status status;
+		uint64_t lastSeen;
+	};
+
+	// Status and nickname of every peer, published for other threads by the thread running 'update'.
+	struct PeerTable {
+		const static size_t CAPACITY = 256;   // peers beyond it aren't published
+
+		struct Entry {
+			char nickname[32];
+			PeerInfo::Status status;
+		};
+
+		ConcurrentPool<Entry> entries;
+		std::atomic<uint32_t> version;        // bumped after every change, readers only rescan when it moves
+
+		PeerTable() : entries(CAPACITY), version(0) {}
 	};
 
 	bool peersInfoChanged;
+	bool natInfoChanged;
 
 public:
-	NetHost(bool isMaster, Socket& socket, StunClient::Result const& natInfo, std::vector<INetClient*> clients);
+	NetHost(bool isMaster, Socket& socket, std::vector<INetClient*> clients);
 
-	PeerId connect(Array<NetAddress const> addresses, std::function<void(int)> const& onFailed);
+	StunClient::Result const& natInfo() const { return m_stun.result(); }
+	void resolveNat(std::vector<std::string> const& stunServers, char const* cachePath);
+
+	PeerId connect(Array<NetAddress const> addresses, Callback<void(int)> onFailed);
 	PeerId findPeerByAddress(NetAddress const& address);
 	PeerId findPeerByNonce(int nonce);
 
 	void queryPeerInfos(std::function<void(PeerId, PeerInfo const&)> const& callback);
 
 	bool send(PeerId dst, CBytes data);
+	// The message header is prepended in the packet headroom, the payload isn't copied.
+	bool send(PeerId dst, int id, Packet msg);
 	void update();
+	// Blocks until a packet arrives, 'update' has something to do (see 'nextDeadline') or 'maxTimeout' ms pass.
+	void wait(size_t maxTimeout);
+	// Other threads end the wait early by sending to 'wakeup'.
+	void wait(size_t maxTimeout, Socket const& wakeup);
+	// Earliest time 'update' has something to do besides receiving, ms. Lets simulations skip idle hosts.
+	uint64_t nextDeadline() const;
+
+	// Counters are updated by the thread running 'update', any thread may take snapshots.
+	NetMetrics const& metrics() const { return m_metrics; }
+	// Any thread may read it while the host lives.
+	PeerTable const& peerTable() const { return m_peerTable; }
+	// Latency of the update stages and message handlers, see LATENCY_STATS. Any thread may call it.
+	void dumpLatency(FILE* out) const;
 
 private:
 	struct MsgId {
-		enum { Ping, Pong, Heartbeat, Request, Reject, Response, PingA, PingB, Join, JoinOk, Leave, Data };
+		enum { Ping, Pong, Heartbeat, Request, Reject, Response, PingA, PingB, Join, JoinOk, Leave, Data, Count };
 	};
 	struct RejectReason {
 		enum { NotMaster, InvalidMessageFormat, AlreadyRegistered };
@@ -72,7 +115,7 @@ private:
 			struct {
 				int failReason;
 				NetAddress address;
-				Timer timer;
+				TimerWheel::Handle timer;
 				int retries;
 			} waitResponce;
 			struct {
@@ -86,6 +129,7 @@ private:
     struct MsgRequest {
         net_uint16_t msgId = { MsgId::Request };
         NetAddress addresses[2];
+        NatHint nat;
     };
     struct MsgInitRequest : MsgRequest {
         char nickname[32];
@@ -98,45 +142,106 @@ private:
 	};
 	struct MsgResponceFragment {
 		NetAddress addresses[3];
+        NatHint nat;
         char nickname[32];
 	};
 
+	// Peer table is split by access pattern: hot columns are read by per-packet lookups and status
+	// updates, the cold one only when a peer joins or its info is queried.
+	struct PeerDetails {
+		char nickname[32];
+		NetAddress grayAddress;
+		NetAddress whiteAddress;
+		NatHint nat;
+		PoolHandle published;   // in 'm_peerTable', invalid if it's full
+	};
+	struct PeerField {
+		enum { Status, Address, LastSeen, Details };
+	};
+
+	struct MsgData {
+		net_uint16_t msgId = { MsgId::Data };
+		net_uint16_t id;
+	};
+
     struct MsgJoin {
         net_uint16_t msgId = { MsgId::Join };
         char nickname[32];
     };
 
+#if LATENCY_STATS
+	struct Latency {
+		LatencyHistogram tick;
+		LatencyHistogram timers;
+		LatencyHistogram receive;      // whole receive, dispatch included
+		LatencyHistogram stun;         // STUN responses and polling
+		LatencyHistogram punching;
+		LatencyHistogram keepalive;
+		LatencyHistogram handlers[MsgId::Count + 1];   // by message id, the last one gets unknown ids
+	};
+#endif
+
 private:
 	bool m_master;
 	State m_state;
 
 	std::vector<INetClient*> m_clients;
 	NetAddress m_selfAddresses[2];
+	TimerWheel m_timers;
 	HolePuncher m_puncher;
+	StunClient m_stun;
+	NatLifetimeProbe m_lifetimeProbe;
 	Socket& m_socket;
+	NetMetrics m_metrics;
+	PeerTable m_peerTable;
+#if LATENCY_STATS
+	std::unique_ptr<Latency> m_latency;   // ~300 KB, kept off the stack
+#endif
 
-	Pool<PeerInfo> m_peers;
-	uint8_t m_recvBuffer[2048];
+	PoolSoA<PeerInfo::Status, NetAddress, uint64_t, PeerDetails> m_peers;
+	Packet m_recvPacket;
+	uint64_t m_startTime;
+	uint32_t m_natVersion;
+	bool m_firstPacketReceived;
 
-	std::function<void(int)> m_connFailedCallback;
+	Callback<void(int)> m_connFailedCallback;
 
 private:
 	PeerId addPeer(NetAddress const& hostAddress, NetAddress const& grayAddr = NetAddress::any(0), NetAddress const& whiteAddr = NetAddress::any(0));
 	void delPeer(PeerId peerId);
+	PeerInfo peerInfo(PeerId peerId) const;
+	// Copies the status and nickname to 'm_peerTable'.
+	void publishPeer(PeerId peerId);
 
 	void onConnectionFailed(int reason);
+	void restartResponceTimer(size_t delay);
+	void onResponceTimeout();
 
 	void onReject(NetAddress const& src, CBytes data);
 	void onRequest(NetAddress const& src, CBytes data);
+	void sendPingA(PeerId peerId, int repeats);
 	void onResponce(NetAddress const& src, CBytes data);
 	void onJoinOk(NetAddress const& src, CBytes data);
+	void onClientPunched();
+	void sendJoin(PeerId peerId, int retries);
 	void onJoin(NetAddress const& src, CBytes data);
 	void onPingA(NetAddress const& src, CBytes data);
+	void onData(PeerId peerId, NetAddress const& src);
+	void predictPorts(PeerId peerId, NatHint const& nat, NetAddress const& whiteAddr);
 
 	void receive();
+	void updateNatInfo();
+	void updateKeepAlive();
+	// A cached result is only used once its white address is confirmed by this run's bind.
+	bool natResolved() const { return (m_stun.ready() && m_stun.mapped()) || !m_stun.active(); }
 	void sendRequest(NetAddress const& target);
 	void sendPingMessage(NetAddress const& target, uint16_t msgid);
 	void sendShortMessage(NetAddress const& target, uint16_t msgid);
+	// Protocol messages go through these to be counted.
+	void sendTo(NetAddress const& target, void const* data, size_t size);
+	void sendTo(NetAddress const& target, Packet const& packet);
 
 	void setPeerStatus(NetAddress const& addr, PeerInfo::Status status);
+	// Clients are notified when the peer becomes connected or stops being so.
+	void setPeerStatus(PeerId peerId, PeerInfo::Status status);
 };
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "latency.h"
+
+#include <algorithm>
+
+
+// ------------------------------------------------------------------------
+uint64_t LatencyHistogram::highestEquivalent(size_t bucket)
+{
+	if (bucket < (HALF_COUNT << 1)) {
+		return bucket;
+	}
+	size_t shift = bucket / HALF_COUNT - 1;
+	uint64_t low = (uint64_t)(bucket % HALF_COUNT + HALF_COUNT) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double quantile) const
+{
+	uint64_t value = 0;
+	percentiles(&quantile, &value, 1);
+	return value;
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary() const
+{
+	static const double quantiles[3] = { 0.5, 0.99, 0.999 };
+	uint64_t values[3];
+	percentiles(quantiles, values, 3);
+	return Summary{ count(), values[0], values[1], values[2], max() };
+}
+
+void LatencyHistogram::percentiles(double const* quantiles, uint64_t* values, size_t size) const
+{
+	// buckets are read one by one while the owner keeps recording, the total is taken from them
+	uint64_t counts[BUCKETS];
+	uint64_t total = 0;
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		counts[i] = m_counts[i].get();
+		total += counts[i];
+	}
+
+	uint64_t maxValue = max();
+	for (size_t q = 0; q < size; ++q) {
+		values[q] = 0;
+		if (total == 0) {
+			continue;
+		}
+		uint64_t rank = std::max<uint64_t>(1, (uint64_t)(quantiles[q] * (double)total + 0.5));
+		uint64_t seen = 0;
+		values[q] = maxValue;
+		for (size_t i = 0; i < BUCKETS; ++i) {
+			seen += counts[i];
+			if (seen >= rank) {
+				values[q] = std::min(highestEquivalent(i), maxValue);
+				break;
+			}
+		}
+	}
+}
+
+
+// ------------------------------------------------------------------------
+void printLatencyHeader(FILE* out)
+{
+	fprintf(out, "%-16s %12s %10s %10s %10s %10s\n", "us", "count", "p50", "p99", "p999", "max");
+}
+
+void printLatency(FILE* out, char const* name, LatencyHistogram const& histogram)
+{
+	LatencyHistogram::Summary summary = histogram.summary();
+	if (summary.count == 0) {
+		return;
+	}
+	fprintf(out, "%-16s %12llu %10.2f %10.2f %10.2f %10.2f\n", name, (unsigned long long)summary.count,
+		summary.p50 / 1000.0, summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "metrics.h"
+#include "tools.h"
+
+#include <stdio.h>
+
+
+// With 0 the instrumentation is compiled out together with the histograms and clock reads.
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 1
+#endif
+
+
+// HDR histogram of durations in nanoseconds. Values below 2^SUB_BITS are exact, bigger ones are kept
+// with SUB_BITS - 1 significant bits (error below 1/64), up to 2^MAX_BITS ns (~68 s).
+// Recorded by one thread only and read by any, like the MetricCounters it is made of.
+class LatencyHistogram {
+public:
+	const static int SUB_BITS = 7;
+	const static int MAX_BITS = 36;
+	const static size_t HALF_COUNT = (size_t)1 << (SUB_BITS - 1);
+	const static size_t BUCKETS = (MAX_BITS - SUB_BITS + 2) * HALF_COUNT;
+
+	struct Summary {
+		uint64_t count;
+		uint64_t p50, p99, p999, max;
+	};
+
+public:
+	LatencyHistogram() = default;
+
+	LatencyHistogram(LatencyHistogram const&) = delete;
+	LatencyHistogram& operator=(LatencyHistogram const&) = delete;
+
+	void record(uint64_t ns)
+	{
+		m_counts[bucket(ns)].add();
+		m_count.add();
+		// the max only grows, so it's a counter too
+		uint64_t max = m_max.get();
+		if (ns > max) {
+			m_max.add(ns - max);
+		}
+	}
+
+	uint64_t count() const { return m_count.get(); }
+	uint64_t max() const { return m_max.get(); }
+	// Highest value equivalent to the one at 'quantile' (0..1), clamped to the max.
+	uint64_t percentile(double quantile) const;
+	Summary summary() const;
+
+private:
+	static size_t bucket(uint64_t ns)
+	{
+		if (ns < (HALF_COUNT << 1)) {
+			return (size_t)ns;
+		}
+		int shift = highestBit(ns) - (SUB_BITS - 1);
+		if (shift > MAX_BITS - SUB_BITS) {
+			return BUCKETS - 1;
+		}
+		return (size_t)(shift + 1) * HALF_COUNT + (size_t)(ns >> shift) - HALF_COUNT;
+	}
+	static uint64_t highestEquivalent(size_t bucket);
+	void percentiles(double const* quantiles, uint64_t* values, size_t size) const;
+
+private:
+	MetricCounter m_counts[BUCKETS];
+	MetricCounter m_count;
+	MetricCounter m_max;
+};
+
+
+// Records the lifetime of the scope.
+class LatencyScope {
+public:
+	explicit LatencyScope(LatencyHistogram& histogram) : m_histogram(histogram), m_start(Clock::preciseNs()) {}
+	~LatencyScope() { m_histogram.record(Clock::preciseNs() - m_start); }
+
+	LatencyScope(LatencyScope const&) = delete;
+	LatencyScope& operator=(LatencyScope const&) = delete;
+
+private:
+	LatencyHistogram& m_histogram;
+	uint64_t m_start;
+};
+
+#define LATENCY_CONCAT_(a, b) a##b
+#define LATENCY_CONCAT(a, b) LATENCY_CONCAT_(a, b)
+
+// The argument isn't evaluated when the statistics are disabled, histograms may be compiled out too.
+#if LATENCY_STATS
+#define LATENCY_SCOPE(histogram) LatencyScope LATENCY_CONCAT(latencyScope, __LINE__)(histogram)
+#else
+#define LATENCY_SCOPE(histogram) do {} while (0)
+#endif
+
+
+// Prints a row per histogram which has samples: count, p50, p99, p999 and max in microseconds.
+void printLatencyHeader(FILE* out);
+void printLatency(FILE* out, char const* name, LatencyHistogram const& histogram);
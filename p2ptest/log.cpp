@@ -1,15 +1,298 @@
 #include "log.h"
+#include "ring.h"
 
 #include <stdio.h>
-#include <stdarg.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 
-// TODO: write todo
-void log(int lvl, char const* fmt, ...)
+std::atomic<int> log_maxlevel{ 0 };
+
+namespace {
+	// Single producer ring of one thread, records are written in place.
+	struct ThreadLog {
+		const static size_t CAPACITY = 512;
+
+		std::atomic<size_t> head{ 0 };   // writer thread
+		uint8_t padding0[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> tail{ 0 };   // owning thread
+		std::atomic<uint64_t> dropped{ 0 };
+		std::atomic<bool> closed{ false };
+		uint8_t padding1[CACHE_LINE_SIZE];
+
+		LogRecord records[CAPACITY];
+	};
+
+	// Messages of different threads are written in order per thread only.
+	class LogWriter {
+	public:
+		LogWriter() : m_stop(false), m_passes(0), m_file(nullptr), m_consoleMax(0), m_fileMin(-1), m_fileMax(-1) {}
+		~LogWriter();
+
+		ThreadLog* add();
+		void configure(int consoleMax, int fileMin, int fileMax, char const* filePath);
+		void flush();
+
+	private:
+		std::mutex m_mutex;   // taken by the writer pass, thread registration and configuration
+		std::vector<std::unique_ptr<ThreadLog>> m_threads;
+		std::thread m_thread;
+		std::atomic<bool> m_stop;
+		std::atomic<uint64_t> m_passes;
+
+		FILE* m_file;
+		int m_consoleMax;
+		int m_fileMin;
+		int m_fileMax;
+
+	private:
+		void run();
+		bool pass();
+		void write(LogRecord const& record);
+	};
+
+	LogWriter& writer()
+	{
+		static LogWriter instance;
+		return instance;
+	}
+
+	struct ThreadLogHandle {
+		ThreadLog* log = nullptr;
+		~ThreadLogHandle() { if (log != nullptr) log->closed.store(true, std::memory_order_release); }
+	};
+
+	thread_local ThreadLogHandle t_log;
+
+	// Conversion characters of printf specifications.
+	char const* const CONVERSIONS = "diouxXeEfFgGaAcspn";
+
+	// printf with a single specification and the argument converted to the type the specification expects.
+	int formatArg(char* dst, size_t size, char const* spec, char conversion, LogRecord const& record, LogArg const& arg)
+	{
+		switch (conversion) {
+		case 's':
+			return snprintf(dst, size, spec, arg.type == LogArg::String ? record.strings + arg.offset : "(?)");
+		case 'p':
+			return snprintf(dst, size, spec, arg.type == LogArg::Pointer ? arg.p : nullptr);
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			return snprintf(dst, size, spec, arg.type == LogArg::Double ? arg.d : (double)arg.i);
+		case 'c':
+			return snprintf(dst, size, spec, (int)arg.i);
+		default:
+			break;
+		}
+
+		int64_t value = arg.type == LogArg::Double ? (int64_t)arg.d : arg.i;
+		const bool wide = strstr(spec, "ll") != nullptr || strstr(spec, "I64") != nullptr || strchr(spec, 'j') != nullptr
+			|| (sizeof(size_t) == 8 && (strchr(spec, 'z') != nullptr || strchr(spec, 'I') != nullptr));
+		if (wide) {
+			return snprintf(dst, size, spec, (long long)value);
+		}
+		if (strchr(spec, 'l') != nullptr) {
+			return snprintf(dst, size, spec, (long)value);
+		}
+		return snprintf(dst, size, spec, (int)value);
+	}
+
+	size_t formatRecord(LogRecord const& record, char* out, size_t size)
+	{
+		size_t length = 0;
+		int argIndex = 0;
+		char spec[32];
+
+		char const* p = record.fmt;
+		while (*p != '\0' && length + 1 < size) {
+			if (*p != '%') {
+				out[length++] = *p++;
+				continue;
+			}
+			if (p[1] == '%') {
+				out[length++] = '%';
+				p += 2;
+				continue;
+			}
+
+			// specification up to the conversion character, '*' widths are taken from the arguments
+			size_t specLength = 0;
+			spec[specLength++] = *p++;
+			while (*p != '\0' && strchr(CONVERSIONS, *p) == nullptr && specLength + 12 < sizeof(spec)) {
+				if (*p == '*') {
+					int width = argIndex < record.argc ? (int)record.args[argIndex++].i : 0;
+					specLength += snprintf(spec + specLength, sizeof(spec) - specLength, "%d", width);
+					p += 1;
+				} else {
+					spec[specLength++] = *p++;
+				}
+			}
+			if (*p == '\0') {
+				break;
+			}
+			char conversion = *p++;
+			spec[specLength++] = conversion;
+			spec[specLength] = '\0';
+
+			if (conversion == 'n' || argIndex >= record.argc) {
+				continue;
+			}
+			int written = formatArg(out + length, size - length, spec, conversion, record, record.args[argIndex++]);
+			if (written > 0) {
+				length += std::min((size_t)written, size - length - 1);
+			}
+		}
+		out[length] = '\0';
+		return length;
+	}
+
+
+	LogWriter::~LogWriter()
+	{
+		if (m_thread.joinable()) {
+			m_stop.store(true, std::memory_order_release);
+			m_thread.join();
+		}
+		if (m_file != nullptr) {
+			fclose(m_file);
+		}
+	}
+
+	ThreadLog* LogWriter::add()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_threads.emplace_back(new ThreadLog());
+		if (!m_thread.joinable()) {
+			m_thread = std::thread(&LogWriter::run, this);
+		}
+		return m_threads.back().get();
+	}
+
+	void LogWriter::configure(int consoleMax, int fileMin, int fileMax, char const* filePath)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_file != nullptr) {
+			fclose(m_file);
+			m_file = nullptr;
+		}
+		if (fileMin >= 0 && filePath != nullptr && filePath[0] != '\0') {
+			if (fopen_s(&m_file, filePath, "a") != 0) {
+				m_file = nullptr;
+			}
+		}
+
+		m_consoleMax = consoleMax;
+		m_fileMin = m_file != nullptr ? fileMin : -1;
+		m_fileMax = m_file != nullptr ? fileMax : -1;
+		log_maxlevel.store(std::max(m_consoleMax, m_fileMin >= 0 ? m_fileMax : -1), std::memory_order_relaxed);
+	}
+
+	void LogWriter::flush()
+	{
+		// a pass started after this point has seen every record committed before it
+		uint64_t target = m_passes.load(std::memory_order_acquire) + 2;
+		while (m_thread.joinable() && m_passes.load(std::memory_order_acquire) < target) {
+			std::this_thread::yield();
+		}
+	}
+
+	void LogWriter::run()
+	{
+		while (!m_stop.load(std::memory_order_acquire)) {
+			if (!pass()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		pass();
+	}
+
+	bool LogWriter::pass()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		bool written = false;
+		for (size_t i = 0; i < m_threads.size(); ) {
+			ThreadLog& log = *m_threads[i];
+			// read before the records, a thread exiting after that has nothing left uncommitted
+			const bool closed = log.closed.load(std::memory_order_acquire);
+
+			size_t head = log.head.load(std::memory_order_relaxed);
+			size_t tail = log.tail.load(std::memory_order_acquire);
+			written = written || head != tail;
+			for (; head != tail; ++head) {
+				write(log.records[head % ThreadLog::CAPACITY]);
+			}
+			log.head.store(head, std::memory_order_release);
+
+			uint64_t dropped = log.dropped.exchange(0, std::memory_order_relaxed);
+			if (dropped != 0) {
+				LogRecord note = { "[log] %llu messages dropped, ring is full", 0, 1, 0 };
+				note.args[0].type = LogArg::Int;
+				note.args[0].i = (int64_t)dropped;
+				write(note);
+			}
+			written = written || dropped != 0;
+
+			if (closed) {
+				m_threads.erase(m_threads.begin() + i);
+			} else {
+				i += 1;
+			}
+		}
+
+		if (written && m_file != nullptr) {
+			fflush(m_file);
+		}
+		m_passes.fetch_add(1, std::memory_order_release);
+		return written;
+	}
+
+	void LogWriter::write(LogRecord const& record)
+	{
+		char line[512];
+		formatRecord(record, line, sizeof(line));
+
+		if (record.level <= m_consoleMax) {
+			printf("%s\n", line);
+		}
+		if (m_file != nullptr && record.level >= m_fileMin && record.level <= m_fileMax) {
+			fprintf(m_file, "%s\n", line);
+		}
+	}
+}
+
+
+namespace logdetail {
+	LogRecord* acquire()
+	{
+		if (t_log.log == nullptr) {
+			t_log.log = writer().add();
+		}
+
+		ThreadLog& log = *t_log.log;
+		size_t tail = log.tail.load(std::memory_order_relaxed);
+		if (tail - log.head.load(std::memory_order_acquire) >= ThreadLog::CAPACITY) {
+			log.dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		return &log.records[tail % ThreadLog::CAPACITY];
+	}
+
+	void commit()
+	{
+		ThreadLog& log = *t_log.log;
+		log.tail.store(log.tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+}
+
+
+void log_configure(int consoleMax, int fileMin, int fileMax, char const* filePath)
+{
+	writer().configure(consoleMax, fileMin, fileMax, filePath);
+}
+
+void log_flush()
 {
-	va_list args;
-	va_start(args, fmt);
-	vprintf(fmt, args);
-	va_end(args);
-	printf("\n");
-}
\ No newline at end of file
+	writer().flush();
+}
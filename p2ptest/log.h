@@ -1,8 +1,121 @@
 #pragma once
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
-static int log_consolemax = 0;
-static int log_filemin = -1;
-static int log_filemax = -1;
+#include <atomic>
+#include <type_traits>
 
-void log(int lvl, char const* fmt, ...);
+
+// Levels above it are compiled out together with their arguments.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 2
+#endif
+
+// Arguments are evaluated only if the level passes both the compile-time and the runtime filter.
+#define LOG(lvl, ...) do { if ((lvl) <= LOG_MAX_LEVEL && log_enabled(lvl)) log(lvl, __VA_ARGS__); } while (0)
+
+
+// Console gets levels up to 'consoleMax', the file levels from 'fileMin' to 'fileMax'. Negative bounds disable a target.
+void log_configure(int consoleMax, int fileMin, int fileMax, char const* filePath);
+// Blocks until everything logged so far is written.
+void log_flush();
+
+extern std::atomic<int> log_maxlevel;
+
+inline bool log_enabled(int lvl) { return lvl <= log_maxlevel.load(std::memory_order_relaxed); }
+
+
+// Raw log argument, formatted later by the writer thread.
+struct LogArg {
+	enum Type : uint8_t { Int, Double, Pointer, String };
+
+	Type type;
+	union {
+		int64_t i;
+		double d;
+		void const* p;
+		uint32_t offset;   // of the string copy in LogRecord::strings
+	};
+};
+
+// A log call as stored in the per-thread ring. Strings are copied, everything else is kept as is.
+struct LogRecord {
+	const static int MAX_ARGS = 8;
+	const static int STRINGS_SIZE = 192;
+
+	char const* fmt;
+	int level;
+	int argc;
+	uint32_t stringsUsed;
+	LogArg args[MAX_ARGS];
+	char strings[STRINGS_SIZE];
+};
+
+namespace logdetail {
+	inline void encode(LogRecord& record, LogArg& arg, char const* value) {
+		arg.type = LogArg::String;
+		arg.offset = record.stringsUsed;
+
+		size_t room = LogRecord::STRINGS_SIZE - record.stringsUsed;
+		if (room == 0) {
+			// the area is full and ends with a terminator, the string is shown empty
+			arg.offset = LogRecord::STRINGS_SIZE - 1;
+			return;
+		}
+		if (value == nullptr) {
+			value = "(null)";
+		}
+		size_t length = strnlen(value, room - 1);
+		memcpy(record.strings + record.stringsUsed, value, length);
+		record.strings[record.stringsUsed + length] = '\0';
+		record.stringsUsed += (uint32_t)length + 1;
+	}
+	inline void encode(LogRecord& record, LogArg& arg, char* value) { encode(record, arg, (char const*)value); }
+
+	template <class T>
+	typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type encode(LogRecord&, LogArg& arg, T value) {
+		arg.type = LogArg::Int;
+		arg.i = (int64_t)value;
+	}
+	template <class T>
+	typename std::enable_if<std::is_floating_point<T>::value>::type encode(LogRecord&, LogArg& arg, T value) {
+		arg.type = LogArg::Double;
+		arg.d = value;
+	}
+	template <class T>
+	void encode(LogRecord&, LogArg& arg, T const* value) {
+		arg.type = LogArg::Pointer;
+		arg.p = value;
+	}
+
+	inline void encodeAll(LogRecord&, int) {}
+
+	template <class T, class... Rest>
+	void encodeAll(LogRecord& record, int index, T const& value, Rest const&... rest) {
+		encode(record, record.args[index], value);
+		encodeAll(record, index + 1, rest...);
+	}
+
+	LogRecord* acquire();
+	void commit();
+}
+
+// Stores the format pointer and raw arguments in the calling thread's ring, formatting and output
+// happen on the writer thread. 'fmt' has to be a string literal. Drops the message if the ring is full.
+template <class... Args>
+void log(int lvl, char const* fmt, Args const&... args)
+{
+	static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS, "Too many log arguments");
+
+	LogRecord* record = logdetail::acquire();
+	if (record == nullptr) {
+		return;
+	}
+	record->fmt = fmt;
+	record->level = lvl;
+	record->argc = (int)sizeof...(Args);
+	record->stringsUsed = 0;
+	logdetail::encodeAll(*record, 0, args...);
+	logdetail::commit();
+}
@@ -3,20 +3,45 @@
 #include "hole_puncher.h"
 #include "stun_client.h"
 #include "host.h"
+#include "net_thread.h"
 #include "log.h"
+#include "capture.h"
+#include "metrics.h"
 
 #include <thread>
 #include <atomic>
 #include "ui.h"
 
 
+static const size_t UI_PERIOD_MS = 50;
+
+
 class NetHostClient : public INetClient {
-	virtual void onPeerConnected(PeerId peer) override { log(0, "Peer [%d/%d] connected.", peer.index, peer.nonce); }
-	virtual void onPeerDisconnected(PeerId peer) override { log(0, "Peer [%d/%d] disconnected.", peer.index, peer.nonce); }
-	virtual void onMessageReceived(PeerId peer, int id, CBytes msg) override { log(0, "Msg [%d/%d]: %s", toString(msg).c_str()); }
+	virtual void onPeerConnected(PeerId peer) override { LOG(0, "Peer [%d/%d] connected.", peer.index, peer.nonce); }
+	virtual void onPeerDisconnected(PeerId peer) override { LOG(0, "Peer [%d/%d] disconnected.", peer.index, peer.nonce); }
+	virtual void onMessageReceived(PeerId peer, int id, CBytes msg) override { LOG(0, "Msg [%d/%d]: %s", peer.index, peer.nonce, toString(msg).c_str()); }
 };
 
 
+// Runs on the I/O thread.
+static void publishState(NetHost& host, ConsoleUi* ui)
+{
+	// the UI never blocks us, updates which didn't fit into its queue are repeated next iteration
+	if (host.natInfoChanged) {
+		if (host.natInfo().type == NatType::Symmetric) {
+			//ui->onWarning("NAT type is 'Symmetric': connections with other peers can be impossible!");
+			LOG(0, "NAT type is 'Symmetric': connections with other peers can be impossible!");
+		}
+		host.natInfoChanged = !ui->setNatInfo(host.natInfo());
+	}
+
+	// the peers themselves are read by the UI from the host table
+	if (host.peersInfoChanged) {
+		host.peersInfoChanged = !ui->setServerStatus(ConsoleUi::PeerStatus::Connected);
+	}
+}
+
+
 int netw_main(Config cfg, ConsoleUi* ui)
 {
 	Socket socket;
@@ -29,19 +54,14 @@ int netw_main(Config cfg, ConsoleUi* ui)
 		return 0;
 	}
 
-	auto natInfo = StunClient::resolve(socket);
-	ui->setNatInfo(natInfo);
-
-	if (natInfo.type == NatType::Symmetric) {
-		//ui->onWarning("NAT type is 'Symmetric': connections with other peers can be impossible!");
-        log(0, "NAT type is 'Symmetric': connections with other peers can be impossible!");
-	}
-	
 	ui->askUserConfig(cfg);
 
 	NetHostClient netClient;
-	NetHost host(cfg.isMaster(), socket, natInfo, { &netClient });
+	NetThread net(cfg.isMaster(), socket);
+	NetHost& host = net.host();
+	ui->watchPeers(&host.peerTable());
     strcpy_s(host.nickname, sizeof(host.nickname), cfg.nickname.c_str());
+	host.resolveNat(cfg.stunServers, cfg.natCachePath.c_str());
 
 	if (!cfg.isMaster()) {
 		ui->setServerStatus(ConsoleUi::PeerStatus::Connecting);
@@ -49,23 +69,42 @@ int netw_main(Config cfg, ConsoleUi* ui)
 		NetAddress addresses[2] = { cfg.localServerAddress, cfg.remoteServerAddress };
 		host.connect(addresses, [ui](int code) {
             ui->setServerStatus(ConsoleUi::PeerStatus::Offline);
-			log(0, "Connection failed: error code - %d", code);
+			LOG(0, "Connection failed: error code - %d", code);
 		});
 	}
+	net.start();
+
+	// exporters read snapshots, they never stop the host
+	Timer metricsTimer(1000);
+	Timer latencyTimer(10000);
+	MetricsServer metricsServer;
+	if (cfg.metricsPort > 0 && cfg.metricsPort <= 65535 && !metricsServer.listen((uint16_t)cfg.metricsPort)) {
+		LOG(0, "Metrics: unable to listen on port %d.", cfg.metricsPort);
+	}
 
 	while (true) {
-		host.update();
+		net.poll(netClient);
 
-		if (host.peersInfoChanged) {
-            ui->setServerStatus(ConsoleUi::PeerStatus::Connected);
+		// metrics, latency and the peer table are the only parts of the host other threads may read
+		if (!cfg.metricsPath.empty() && metricsTimer.shedule()) {
+			if (!writeMetricsFile(host.metrics().snapshot(), cfg.metricsPath.c_str())) {
+				LOG(1, "Metrics: unable to write '%s'.", cfg.metricsPath.c_str());
+			}
+		}
+		metricsServer.poll(host.metrics());
 
-			host.queryPeerInfos([ui](PeerId id, NetHost::PeerInfo const& peer){
-                ui->setClient(id, peer.nickname, (ConsoleUi::PeerStatus)peer.status);
-			});
-			host.peersInfoChanged = false;
+		if (!cfg.latencyPath.empty() && latencyTimer.shedule()) {
+			FILE* file = nullptr;
+			if (fopen_s(&file, cfg.latencyPath.c_str(), "wb") == 0) {
+				host.dumpLatency(file);
+				fclose(file);
+			}
 		}
 
-		std::this_thread::sleep_for(std::chrono::microseconds(10));
+		// NAT and peer info belong to the I/O thread, the UI queue accepts events from any thread
+		net.post([ui](NetHost& host) { publishState(host, ui); });
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(UI_PERIOD_MS));
 	}
 
 	return 0;
@@ -86,10 +125,25 @@ int main(int argc, char const* argv[])
     if (conui.config.mode == Config::Mode::Help) {
         return 0;
     }
+    log_configure(conui.config.logLevel, conui.config.logPath.empty() ? -1 : 0, LOG_MAX_LEVEL, conui.config.logPath.c_str());
+
+	// before any other thread reads the clock
+	Clock::calibrateTsc();
+
+	if (!conui.config.capturePath.empty()) {
+		Capture::Filter filter;
+		for (NetAddress const& peer : conui.config.capturePeers) {
+			filter.peers.push_back(peer);
+		}
+		filter.minSize = conui.config.captureMinSize;
+		filter.maxSize = conui.config.captureMaxSize;
+		Capture::start(conui.config.capturePath.c_str(), filter);
+	}
 
 	std::thread networkThread(netw_main, conui.config, &conui);
     while (conui.update());
 	networkThread.join();
+	Capture::stop();
 
 
 	/*
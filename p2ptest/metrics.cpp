@@ -0,0 +1,357 @@
+#include "metrics.h"
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <algorithm>
+
+
+namespace {
+	uint64_t packAddress(NetAddress const& address)
+	{
+		sockaddr_in const* addr = (sockaddr_in const*)address.data;
+		return (uint64_t)ntohl(addr->sin_addr.S_un.S_addr) << 16 | ntohs(addr->sin_port);
+	}
+
+	void appendf(std::string& out, char const* fmt, ...)
+	{
+		char buffer[256];
+		va_list args;
+		va_start(args, fmt);
+		int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+		va_end(args);
+		if (length > 0) {
+			out.append(buffer, std::min<size_t>((size_t)length, sizeof(buffer) - 1));
+		}
+	}
+
+	void appendHeader(std::string& out, char const* name, char const* type, char const* help)
+	{
+		appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	}
+
+	void appendMetric(std::string& out, char const* name, char const* type, char const* help, int64_t value)
+	{
+		appendHeader(out, name, type, help);
+		appendf(out, "%s %lld\n", name, (long long)value);
+	}
+
+	template <class Field>
+	void appendPeerMetric(std::string& out, NetMetrics::Snapshot const& snapshot, char const* name, char const* type, char const* help, Field field)
+	{
+		appendHeader(out, name, type, help);
+		for (auto const& peer : snapshot.peerMetrics) {
+			appendf(out, "%s{peer=\"%u/%u\",address=\"%u.%u.%u.%u:%u\"} %lld\n", name, peer.id.index, peer.id.nonce,
+				(uint32_t)(peer.address >> 40) & 0xFF, (uint32_t)(peer.address >> 32) & 0xFF, (uint32_t)(peer.address >> 24) & 0xFF,
+				(uint32_t)(peer.address >> 16) & 0xFF, (uint32_t)peer.address & 0xFFFF, (long long)field(peer));
+		}
+	}
+}
+
+
+// ------------------------------------------------------------------------
+NetMetrics::NetMetrics()
+{
+	for (auto& chunk : m_chunks) {
+		chunk.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+NetMetrics::~NetMetrics()
+{
+	for (auto& chunk : m_chunks) {
+		delete[] chunk.load(std::memory_order_relaxed);
+	}
+}
+
+void NetMetrics::addPeer(PoolHandle id, NetAddress const& address)
+{
+	size_t chunkIndex = id.index >> PEER_CHUNK_BITS;
+	if (!id.isValid() || chunkIndex >= MAX_PEER_CHUNKS) {
+		return;
+	}
+
+	PeerMetrics* chunk = m_chunks[chunkIndex].load(std::memory_order_relaxed);
+	if (chunk == nullptr) {
+		chunk = new PeerMetrics[PEER_CHUNK_SIZE];
+		m_chunks[chunkIndex].store(chunk, std::memory_order_release);
+	}
+
+	PeerMetrics& peer = chunk[id.index & (PEER_CHUNK_SIZE - 1)];
+	peer.nonce.store(0, std::memory_order_relaxed);
+	peer.address.store(packAddress(address), std::memory_order_relaxed);
+	peer.packetsIn.reset();
+	peer.bytesIn.reset();
+	peer.packetsOut.reset();
+	peer.bytesOut.reset();
+	peer.punchAttempts.reset();
+	peer.rttMs.set(-1);
+	// published last, snapshots skip the slot until then
+	peer.nonce.store(id.nonce, std::memory_order_release);
+}
+
+void NetMetrics::setPeerAddress(PoolHandle id, NetAddress const& address)
+{
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->address.store(packAddress(address), std::memory_order_relaxed);
+	}
+}
+
+void NetMetrics::delPeer(PoolHandle id)
+{
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->nonce.store(0, std::memory_order_release);
+	}
+}
+
+PeerMetrics* NetMetrics::peer(PoolHandle id) const
+{
+	size_t chunkIndex = id.index >> PEER_CHUNK_BITS;
+	if (!id.isValid() || chunkIndex >= MAX_PEER_CHUNKS) {
+		return nullptr;
+	}
+	PeerMetrics* chunk = m_chunks[chunkIndex].load(std::memory_order_acquire);
+	if (chunk == nullptr) {
+		return nullptr;
+	}
+	PeerMetrics& metrics = chunk[id.index & (PEER_CHUNK_SIZE - 1)];
+	return metrics.nonce.load(std::memory_order_relaxed) == id.nonce ? &metrics : nullptr;
+}
+
+void NetMetrics::onReceived(PoolHandle id, size_t bytes)
+{
+	global.packetsIn.add();
+	global.bytesIn.add(bytes);
+
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->packetsIn.add();
+		metrics->bytesIn.add(bytes);
+	}
+}
+
+void NetMetrics::onSentData(PoolHandle id, size_t bytes)
+{
+	onSent(bytes);
+
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->packetsOut.add();
+		metrics->bytesOut.add(bytes);
+	}
+}
+
+void NetMetrics::onPunchAttempt(PoolHandle id)
+{
+	global.punchAttempts.add();
+
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->punchAttempts.add();
+	}
+}
+
+void NetMetrics::onRtt(PoolHandle id, uint32_t rtt)
+{
+	PeerMetrics* metrics = peer(id);
+	if (metrics != nullptr) {
+		metrics->rttMs.set(rtt);
+	}
+}
+
+NetMetrics::Snapshot NetMetrics::snapshot() const
+{
+	Snapshot snapshot;
+	snapshot.packetsIn = global.packetsIn.get();
+	snapshot.bytesIn = global.bytesIn.get();
+	snapshot.packetsOut = global.packetsOut.get();
+	snapshot.bytesOut = global.bytesOut.get();
+	snapshot.punchAttempts = global.punchAttempts.get();
+	snapshot.retransmits = global.retransmits.get();
+	for (int i = 0; i < DropReason::Count; ++i) {
+		snapshot.drops[i] = global.drops[i].get();
+	}
+	snapshot.peers = global.peers.get();
+	snapshot.timers = global.timers.get();
+	snapshot.packetSlabs = global.packetSlabs.get();
+
+	for (size_t chunkIndex = 0; chunkIndex < MAX_PEER_CHUNKS; ++chunkIndex) {
+		PeerMetrics const* chunk = m_chunks[chunkIndex].load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			continue;
+		}
+		for (size_t i = 0; i < PEER_CHUNK_SIZE; ++i) {
+			PeerMetrics const& metrics = chunk[i];
+			uint32_t nonce = metrics.nonce.load(std::memory_order_acquire);
+			if (nonce == 0) {
+				continue;
+			}
+
+			PeerSnapshot peer;
+			peer.id = PoolHandle((uint32_t)(chunkIndex << PEER_CHUNK_BITS | i), nonce);
+			peer.address = metrics.address.load(std::memory_order_relaxed);
+			peer.packetsIn = metrics.packetsIn.get();
+			peer.bytesIn = metrics.bytesIn.get();
+			peer.packetsOut = metrics.packetsOut.get();
+			peer.bytesOut = metrics.bytesOut.get();
+			peer.punchAttempts = metrics.punchAttempts.get();
+			peer.rttMs = metrics.rttMs.get();
+			snapshot.peerMetrics.push_back(peer);
+		}
+	}
+	return snapshot;
+}
+
+
+// ------------------------------------------------------------------------
+std::string toPrometheus(NetMetrics::Snapshot const& snapshot)
+{
+	static char const* const dropReasons[DropReason::Count] = { "invalid_format", "unknown_message", "unknown_peer", "not_master" };
+
+	std::string out;
+	out.reserve(4096 + snapshot.peerMetrics.size() * 768);
+
+	appendMetric(out, "p2p_packets_received_total", "counter", "Datagrams received by the host.", snapshot.packetsIn);
+	appendMetric(out, "p2p_bytes_received_total", "counter", "Bytes received by the host.", snapshot.bytesIn);
+	appendMetric(out, "p2p_packets_sent_total", "counter", "Datagrams sent by the host, punching excluded.", snapshot.packetsOut);
+	appendMetric(out, "p2p_bytes_sent_total", "counter", "Bytes sent by the host, punching excluded.", snapshot.bytesOut);
+	appendMetric(out, "p2p_punch_attempts_total", "counter", "Punching pings sent.", snapshot.punchAttempts);
+	appendMetric(out, "p2p_retransmits_total", "counter", "Connection requests sent again after a timeout.", snapshot.retransmits);
+
+	appendHeader(out, "p2p_dropped_total", "counter", "Received messages dropped, by reason.");
+	for (int i = 0; i < DropReason::Count; ++i) {
+		appendf(out, "p2p_dropped_total{reason=\"%s\"} %llu\n", dropReasons[i], (unsigned long long)snapshot.drops[i]);
+	}
+
+	appendMetric(out, "p2p_peers", "gauge", "Peers in the peer table.", snapshot.peers);
+	appendMetric(out, "p2p_timers", "gauge", "Scheduled protocol timers.", snapshot.timers);
+	appendMetric(out, "p2p_packet_slabs", "gauge", "Packet buffer slabs allocated.", snapshot.packetSlabs);
+
+	typedef NetMetrics::PeerSnapshot Peer;
+	appendPeerMetric(out, snapshot, "p2p_peer_packets_received_total", "counter", "Datagrams received from the peer.", [](Peer const& p) { return (int64_t)p.packetsIn; });
+	appendPeerMetric(out, snapshot, "p2p_peer_bytes_received_total", "counter", "Bytes received from the peer.", [](Peer const& p) { return (int64_t)p.bytesIn; });
+	appendPeerMetric(out, snapshot, "p2p_peer_packets_sent_total", "counter", "Data messages sent to the peer.", [](Peer const& p) { return (int64_t)p.packetsOut; });
+	appendPeerMetric(out, snapshot, "p2p_peer_bytes_sent_total", "counter", "Data bytes sent to the peer.", [](Peer const& p) { return (int64_t)p.bytesOut; });
+	appendPeerMetric(out, snapshot, "p2p_peer_punch_attempts_total", "counter", "Punching pings sent to the peer.", [](Peer const& p) { return (int64_t)p.punchAttempts; });
+	appendPeerMetric(out, snapshot, "p2p_peer_rtt_ms", "gauge", "Latest keepalive round trip, -1 if unknown.", [](Peer const& p) { return p.rttMs; });
+	return out;
+}
+
+bool writeMetricsFile(NetMetrics::Snapshot const& snapshot, char const* path)
+{
+	std::string text = toPrometheus(snapshot);
+	std::string tmpPath = std::string(path) + ".tmp";
+
+	FILE* file = nullptr;
+	if (fopen_s(&file, tmpPath.c_str(), "wb") != 0) {
+		return false;
+	}
+	bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+	fclose(file);
+
+	return written && MoveFileExA(tmpPath.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+
+// ------------------------------------------------------------------------
+MetricsServer::MetricsServer()
+	: m_socket(INVALID_SOCKET)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+	for (Client const& client : m_clients) {
+		closesocket(client.socket);
+	}
+	if (m_socket != INVALID_SOCKET) {
+		closesocket(m_socket);
+	}
+}
+
+bool MetricsServer::listen(uint16_t port)
+{
+	m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (m_socket == INVALID_SOCKET) {
+		return false;
+	}
+
+	u_long mode = 1;
+	NetAddress address = NetAddress::ipv4(127, 0, 0, 1, port);
+	if (ioctlsocket(m_socket, FIONBIO, &mode) != NO_ERROR
+		|| ::bind(m_socket, (sockaddr*)address.data, sizeof(address.data)) == SOCKET_ERROR
+		|| ::listen(m_socket, (int)MAX_CLIENTS) == SOCKET_ERROR) {
+		closesocket(m_socket);
+		m_socket = INVALID_SOCKET;
+		return false;
+	}
+	return true;
+}
+
+void MetricsServer::poll(NetMetrics const& metrics)
+{
+	if (m_socket == INVALID_SOCKET) {
+		return;
+	}
+
+	uint64_t now = getTimeMs();
+	while (m_clients.count() < MAX_CLIENTS) {
+		SOCKET client = accept(m_socket, nullptr, nullptr);
+		if (client == INVALID_SOCKET) {
+			break;
+		}
+		u_long mode = 1;
+		ioctlsocket(client, FIONBIO, &mode);
+		m_clients.push_back(Client{ client, now, std::string(), 0 });
+	}
+
+	// clients which haven't sent the request or read the whole response yet are kept for the next poll
+	FixedArray<Client, MAX_CLIENTS> pending;
+	for (Client& client : m_clients) {
+		if (serve(client, metrics, now)) {
+			pending.push_back(std::move(client));
+		} else {
+			closesocket(client.socket);
+		}
+	}
+	m_clients = std::move(pending);
+}
+
+bool MetricsServer::serve(Client& client, NetMetrics const& metrics, uint64_t now)
+{
+	if (client.response.empty()) {
+		// any request gets the metrics
+		char request[1024];
+		int count = recv(client.socket, request, sizeof(request), 0);
+		if (count == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+			return now - client.lastActive < IDLE_TIMEOUT_MS;
+		}
+		if (count <= 0) {
+			return false;
+		}
+
+		std::string body = toPrometheus(metrics.snapshot());
+		char header[128];
+		int headerLength = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n", (uint32_t)body.size());
+		client.response.assign(header, headerLength);
+		client.response += body;
+		client.sent = 0;
+		client.lastActive = now;
+	}
+
+	// the socket buffer takes what it can, the rest goes out on the next polls
+	while (client.sent < client.response.size()) {
+		int count = send(client.socket, client.response.data() + client.sent, (int)(client.response.size() - client.sent), 0);
+		if (count == SOCKET_ERROR) {
+			return WSAGetLastError() == WSAEWOULDBLOCK && now - client.lastActive < IDLE_TIMEOUT_MS;
+		}
+		client.sent += (size_t)count;
+		client.lastActive = now;
+	}
+	return false;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "socket.h"
+#include "tools.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+// Metrics are written by the thread running NetHost only, so an update is a relaxed load and store
+// without a locked instruction. Any thread may read them at any time.
+struct MetricCounter {
+	std::atomic<uint64_t> value{ 0 };
+
+	void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+	void reset() { value.store(0, std::memory_order_relaxed); }
+};
+
+struct MetricGauge {
+	std::atomic<int64_t> value{ 0 };
+
+	void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+	int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct DropReason {
+	enum { InvalidFormat, UnknownMessage, UnknownPeer, NotMaster, Count };
+};
+
+struct PeerMetrics {
+	std::atomic<uint32_t> nonce{ 0 };      // 0 if the slot is unused
+	std::atomic<uint64_t> address{ 0 };    // ipv4 << 16 | port, in host order
+
+	MetricCounter packetsIn;
+	MetricCounter bytesIn;
+	MetricCounter packetsOut;              // data messages only, protocol traffic is counted globally
+	MetricCounter bytesOut;
+	MetricCounter punchAttempts;
+	MetricGauge rttMs;                     // latest keepalive round trip, -1 until measured
+};
+
+
+class NetMetrics {
+public:
+	const static size_t PEER_CHUNK_BITS = 6;
+	const static size_t PEER_CHUNK_SIZE = 1 << PEER_CHUNK_BITS;
+	const static size_t MAX_PEER_CHUNKS = 256;   // peers with bigger pool indices aren't tracked
+
+	struct Global {
+		MetricCounter packetsIn;
+		MetricCounter bytesIn;
+		MetricCounter packetsOut;
+		MetricCounter bytesOut;
+		MetricCounter punchAttempts;
+		MetricCounter retransmits;
+		MetricCounter drops[DropReason::Count];
+
+		MetricGauge peers;
+		MetricGauge timers;
+		MetricGauge packetSlabs;
+	};
+
+	struct PeerSnapshot {
+		PoolHandle id;
+		uint64_t address;
+		uint64_t packetsIn, bytesIn, packetsOut, bytesOut, punchAttempts;
+		int64_t rttMs;
+	};
+
+	struct Snapshot {
+		uint64_t packetsIn, bytesIn, packetsOut, bytesOut, punchAttempts, retransmits;
+		uint64_t drops[DropReason::Count];
+		int64_t peers, timers, packetSlabs;
+		std::vector<PeerSnapshot> peerMetrics;
+	};
+
+	Global global;
+
+public:
+	NetMetrics();
+	~NetMetrics();
+
+	NetMetrics(NetMetrics const&) = delete;
+	NetMetrics& operator=(NetMetrics const&) = delete;
+
+	// Owner thread. Slots are allocated in chunks which are never freed or moved.
+	void addPeer(PoolHandle id, NetAddress const& address);
+	void setPeerAddress(PoolHandle id, NetAddress const& address);
+	void delPeer(PoolHandle id);
+	// Returns nullptr if the peer isn't tracked.
+	PeerMetrics* peer(PoolHandle id) const;
+
+	void onReceived(PoolHandle id, size_t bytes);
+	void onSent(size_t bytes) { global.packetsOut.add(); global.bytesOut.add(bytes); }
+	void onSentData(PoolHandle id, size_t bytes);
+	void onDrop(int reason) { global.drops[reason].add(); }
+	void onPunchAttempt(PoolHandle id);
+	void onRtt(PoolHandle id, uint32_t rtt);
+
+	// Any thread, never blocks the owner. Values are read one by one, so the snapshot is not an atomic cut.
+	Snapshot snapshot() const;
+
+private:
+	mutable std::atomic<PeerMetrics*> m_chunks[MAX_PEER_CHUNKS];
+};
+
+
+// Prometheus text exposition format.
+std::string toPrometheus(NetMetrics::Snapshot const& snapshot);
+// Replaces 'path' at once, scrapers never see a partially written file.
+bool writeMetricsFile(NetMetrics::Snapshot const& snapshot, char const* path);
+
+
+// Minimal HTTP endpoint answering every request with the current metrics. Connections are served
+// from 'poll' without blocking, so it can run in the network loop.
+class MetricsServer {
+public:
+	const static size_t MAX_CLIENTS = 4;
+	const static size_t IDLE_TIMEOUT_MS = 5000;   // clients which neither send nor read are dropped
+
+public:
+	MetricsServer();
+	~MetricsServer();
+
+	// Listens on the loopback interface.
+	bool listen(uint16_t port);
+	void poll(NetMetrics const& metrics);
+
+private:
+	struct Client {
+		uintptr_t socket;
+		uint64_t lastActive;
+		std::string response;   // empty until the request arrives
+		size_t sent;
+	};
+
+private:
+	uintptr_t m_socket;
+	FixedArray<Client, MAX_CLIENTS> m_clients;
+
+private:
+	// Returns false once the client is done with or has to be dropped.
+	bool serve(Client& client, NetMetrics const& metrics, uint64_t now);
+};
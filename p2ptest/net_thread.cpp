@@ -0,0 +1,190 @@
+#include "net_thread.h"
+#include "log.h"
+
+
+NetThread::NetThread(bool isMaster, Socket& socket, size_t queueSize)
+	: m_host(isMaster, socket, { this }), m_stop(false), m_sleeping(false), m_events(queueSize), m_outbound(queueSize), m_commands(queueSize / 8 + 1)
+	, m_received(0), m_dropped(0), m_sendRejected(0), m_parkedCount(0)
+{
+	m_reserved = m_events.capacity() / 8;
+
+	m_wakeupAddress = NetAddress::any(0);
+	if (m_wakeup.valid() && m_wakeup.bind(NetAddress::ipv4(127, 0, 0, 1, 0))) {
+		m_wakeupAddress = m_wakeup.sockname();
+	} else {
+		LOG(1, "NetThread: unable to open wakeup socket [code 0x%08X], the I/O thread polls every %u ms.", WinSock::getLastError(), (unsigned)PARKED_RETRY_MS);
+	}
+}
+
+NetThread::~NetThread()
+{
+	stop();
+}
+
+void NetThread::start()
+{
+	ASSERT(!m_thread.joinable());
+	m_stop.store(false, std::memory_order_relaxed);
+	m_thread = std::thread(&NetThread::run, this);
+}
+
+void NetThread::stop()
+{
+	if (m_thread.joinable()) {
+		m_stop.store(true, std::memory_order_release);
+		wake();
+		m_thread.join();
+	}
+}
+
+bool NetThread::post(Callback<void(NetHost&)> command)
+{
+	if (!m_commands.push(std::move(command))) {
+		return false;
+	}
+	wake();
+	return true;
+}
+
+bool NetThread::send(PeerId dst, int id, Packet msg)
+{
+	Outbound outbound{ dst, id, std::move(msg) };
+	if (!m_outbound.push(std::move(outbound))) {
+		m_sendRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	wake();
+	return true;
+}
+
+size_t NetThread::poll(INetClient& client, size_t maxEvents)
+{
+	size_t count = 0;
+	Event event;
+	while (count < maxEvents && m_events.pop(event)) {
+		switch (event.type) {
+		case Event::PeerConnected:    client.onPeerConnected(event.peer); break;
+		case Event::PeerDisconnected: client.onPeerDisconnected(event.peer); break;
+		case Event::Message:          client.onMessageReceived(event.peer, event.id, std::move(event.msg)); break;
+		}
+		count += 1;
+	}
+	return count;
+}
+
+bool NetThread::congested() const
+{
+	return m_events.count() + m_reserved >= m_events.capacity();
+}
+
+NetThread::Stats NetThread::stats() const
+{
+	return Stats{
+		m_received.load(std::memory_order_relaxed),
+		m_dropped.load(std::memory_order_relaxed),
+		m_sendRejected.load(std::memory_order_relaxed),
+		m_parkedCount.load(std::memory_order_relaxed),
+	};
+}
+
+void NetThread::run()
+{
+	LOG(2, "NetThread: I/O thread started.");
+
+	Callback<void(NetHost&)> command;
+	Outbound outbound;
+	while (!m_stop.load(std::memory_order_acquire)) {
+		flushParked();
+		while (m_commands.pop(command)) {
+			command(m_host);
+			command.reset();
+		}
+		while (m_outbound.pop(outbound)) {
+			m_host.send(outbound.dst, outbound.id, std::move(outbound.msg));
+		}
+		m_host.update();
+
+		if (m_wakeupAddress.getport() == 0 || !m_parked.empty()) {
+			m_host.wait(PARKED_RETRY_MS);
+			continue;
+		}
+
+		// pairs with the fence in 'wake': either the producer sees us sleeping or we see its push
+		m_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (idle()) {
+			m_host.wait(MAX_SLEEP_MS, m_wakeup);
+			uint8_t signal[16];
+			while (m_wakeup.recv(signal, sizeof(signal), 0) > 0) {
+			}
+		}
+		m_sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	LOG(2, "NetThread: I/O thread stopped.");
+}
+
+bool NetThread::idle() const
+{
+	return m_commands.empty() && m_outbound.empty() && !m_stop.load(std::memory_order_relaxed);
+}
+
+void NetThread::wake()
+{
+	// only the first producer to find the thread sleeping sends, the rest are covered by its datagram
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_wakeupAddress.getport() != 0 && m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false, std::memory_order_relaxed)) {
+		uint8_t signal = 0;
+		m_wakeup.sendto(m_wakeupAddress, &signal, sizeof(signal), 0);
+	}
+}
+
+void NetThread::pushEvent(Event&& event)
+{
+	// connection events wait for the application rather than get lost, but the I/O thread doesn't
+	flushParked();
+	if (!m_parked.empty() || !m_events.push(std::move(event))) {
+		m_parkedCount.fetch_add(1, std::memory_order_relaxed);
+		m_parked.push_back(std::move(event));
+	}
+}
+
+void NetThread::flushParked()
+{
+	while (!m_parked.empty() && m_events.push(std::move(m_parked.front()))) {
+		m_parked.pop_front();
+	}
+}
+
+void NetThread::onPeerConnected(PeerId peer)
+{
+	pushEvent(Event{ Event::PeerConnected, peer, 0, Packet() });
+}
+
+void NetThread::onPeerDisconnected(PeerId peer)
+{
+	pushEvent(Event{ Event::PeerDisconnected, peer, 0, Packet() });
+}
+
+void NetThread::onMessageReceived(PeerId peer, int id, CBytes msg)
+{
+	Packet packet = Packet::alloc(msg.size());
+	memcpy(packet.data(), msg.begin, msg.size());
+	onMessageReceived(peer, id, std::move(packet));
+}
+
+void NetThread::onMessageReceived(PeerId peer, int id, Packet msg)
+{
+	// the tail of the ring is kept for connection events, parked ones go first
+	flushParked();
+	if (!m_parked.empty() || m_events.count() + m_reserved >= m_events.capacity()) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	Event event{ Event::Message, peer, id, std::move(msg) };
+	if (m_events.push(std::move(event))) {
+		m_received.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
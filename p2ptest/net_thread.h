@@ -0,0 +1,100 @@
+#pragma once
+
+#include "host.h"
+#include "packet.h"
+#include "ring.h"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+
+
+// Threaded mode of NetHost. The I/O thread owns the host with its socket, punching and protocol
+// timers, so slow INetClient callbacks don't delay them. Events reach the application through an
+// SPSC ring drained by 'poll', sends and commands go the other way through MPSC rings.
+// Bounded rings give backpressure: 'send' and 'post' fail when the I/O thread falls behind, data
+// messages are dropped when the application falls behind. Connection events are never dropped
+// for data, a part of the event ring is reserved for them; if even that is full they are parked on
+// the I/O thread until the application makes room, and data messages are dropped meanwhile.
+// When idle, the I/O thread sleeps until a packet arrives or the host's next deadline. 'send',
+// 'post' and 'stop' wake it early with a datagram to a loopback socket of its own.
+class NetThread : private INetClient {
+public:
+	const static size_t DEFAULT_QUEUE_SIZE = 1024;
+	const static size_t PARKED_RETRY_MS = 1;   // the application doesn't signal room for parked events, they are retried that often
+	const static size_t MAX_SLEEP_MS = 1000;   // longer idle periods are slept in steps
+
+	struct Stats {
+		uint64_t received;       // data messages queued for the application
+		uint64_t dropped;        // data messages dropped because the event ring was full
+		uint64_t sendRejected;   // 'send' calls failed because the outbound ring was full
+		uint64_t parked;         // connection events which didn't fit into the event ring at once
+	};
+
+public:
+	NetThread(bool isMaster, Socket& socket, size_t queueSize = DEFAULT_QUEUE_SIZE);
+	~NetThread();
+
+	// The host may be accessed directly only before 'start', afterwards use 'post'.
+	NetHost& host() { return m_host; }
+
+	void start();
+	void stop();
+
+	// Runs 'command' on the I/O thread. Returns false if the command ring is full.
+	bool post(Callback<void(NetHost&)> command);
+	// Safe to call from any thread. Returns false if the outbound ring is full, the caller should back off.
+	bool send(PeerId dst, int id, Packet msg);
+
+	// Dispatches up to 'maxEvents' pending events to 'client'. Must be called from a single thread.
+	size_t poll(INetClient& client, size_t maxEvents = SIZE_MAX);
+
+	// The application drains events slower than they arrive, data messages are about to be dropped.
+	bool congested() const;
+	Stats stats() const;
+
+private:
+	struct Event {
+		enum Type { PeerConnected, PeerDisconnected, Message } type;
+		PeerId peer;
+		int id;
+		Packet msg;
+	};
+
+	struct Outbound {
+		PeerId dst;
+		int id;
+		Packet msg;
+	};
+
+private:
+	NetHost m_host;
+	std::thread m_thread;
+	std::atomic<bool> m_stop;
+	std::atomic<bool> m_sleeping;   // set by the I/O thread before it checks the rings and waits
+	Socket m_wakeup;
+	NetAddress m_wakeupAddress;     // port 0 if the wakeup socket is unavailable, the thread polls then
+
+	SpscRing<Event> m_events;
+	MpscRing<Outbound> m_outbound;
+	MpscRing<Callback<void(NetHost&)>> m_commands;
+	size_t m_reserved;
+	std::deque<Event> m_parked;   // touched by the producer of events only
+
+	std::atomic<uint64_t> m_received;
+	std::atomic<uint64_t> m_dropped;
+	std::atomic<uint64_t> m_sendRejected;
+	std::atomic<uint64_t> m_parkedCount;
+
+private:
+	void run();
+	bool idle() const;
+	void wake();
+	void pushEvent(Event&& event);
+	void flushParked();
+
+	virtual void onPeerConnected(PeerId peer) override;
+	virtual void onPeerDisconnected(PeerId peer) override;
+	virtual void onMessageReceived(PeerId peer, int id, CBytes msg) override;
+	virtual void onMessageReceived(PeerId peer, int id, Packet msg) override;
+};
@@ -0,0 +1,52 @@
+-- Wireshark dissector of the p2ptest protocol, for captures written with '--capture'.
+-- Copy into the Wireshark personal plugins folder or load with 'wireshark -X lua_script:p2ptest.lua'.
+
+local p2p = Proto("p2ptest", "p2ptest NetHost")
+
+-- Has to match NetHost::MsgId
+local msg_names = {
+	[0] = "Ping", [1] = "Pong", [2] = "Heartbeat", [3] = "Request", [4] = "Reject", [5] = "Response",
+	[6] = "PingA", [7] = "PingB", [8] = "Join", [9] = "JoinOk", [10] = "Leave", [11] = "Data",
+}
+local MSG_DATA = 11
+
+local f_msgid = ProtoField.uint16("p2ptest.msgid", "Message", base.DEC, msg_names)
+local f_dataid = ProtoField.uint16("p2ptest.data.id", "Data id", base.DEC)
+local f_payload = ProtoField.bytes("p2ptest.payload", "Payload")
+p2p.fields = { f_msgid, f_dataid, f_payload }
+
+function p2p.dissector(buffer, pinfo, tree)
+	if buffer:len() < 2 then
+		return 0
+	end
+	local msgid = buffer(0, 2):uint()
+	if msg_names[msgid] == nil then
+		return 0
+	end
+
+	pinfo.cols.protocol = "p2ptest"
+	pinfo.cols.info = msg_names[msgid]
+
+	local subtree = tree:add(p2p, buffer(), "p2ptest " .. msg_names[msgid])
+	subtree:add(f_msgid, buffer(0, 2))
+	local offset = 2
+	if msgid == MSG_DATA and buffer:len() >= 4 then
+		subtree:add(f_dataid, buffer(2, 2))
+		offset = 4
+	end
+	if buffer:len() > offset then
+		subtree:add(f_payload, buffer(offset))
+	end
+	return buffer:len()
+end
+
+-- STUN shares the socket, leave it to the STUN dissector
+local function heuristic(buffer, pinfo, tree)
+	if buffer:len() >= 20 and buffer(4, 4):uint() == 0x2112A442 then
+		return false
+	end
+	return p2p.dissector(buffer, pinfo, tree) > 0
+end
+
+p2p:register_heuristic("udp", heuristic)
+DissectorTable.get("udp.port"):add(48800, p2p)
@@ -0,0 +1,205 @@
+#include "packet.h"
+#include "log.h"
+
+#include <cstring>
+#include <mutex>
+#include <new>
+
+
+namespace {
+	const size_t SLAB_PACKETS = 64;
+	const size_t LOCAL_MAX = 4 * SLAB_PACKETS;   // a thread's list is trimmed above that
+	const size_t BATCH = SLAB_PACKETS;
+
+	// Buffers released by other threads pile up in the releasing thread's list; the excess goes
+	// back to the shared list in batches, so producers and consumers on different threads balance out.
+	struct FreeList {
+		PacketBuffer* head = nullptr;
+		size_t count = 0;
+
+		void push(PacketBuffer* buffer) { buffer->next = head; head = buffer; count += 1; }
+		PacketBuffer* pop() { PacketBuffer* buffer = head; head = buffer->next; count -= 1; return buffer; }
+	};
+
+	struct SharedList {
+		std::mutex mutex;
+		FreeList list;
+		std::atomic<size_t> slabs{ 0 };
+		std::atomic<size_t> oversize{ 0 };
+		std::atomic<size_t> transfers{ 0 };
+		std::atomic<size_t> copies{ 0 };
+	};
+
+	SharedList& shared()
+	{
+		static SharedList list;
+		return list;
+	}
+
+	// Buffers left by an exiting thread go to the shared list.
+	struct LocalList : FreeList {
+		~LocalList();
+	};
+
+	thread_local LocalList t_free;
+
+	LocalList::~LocalList()
+	{
+		SharedList& global = shared();
+		std::lock_guard<std::mutex> lock(global.mutex);
+		while (head != nullptr) {
+			global.list.push(pop());
+		}
+	}
+
+	void moveBatch(FreeList& from, FreeList& to)
+	{
+		for (size_t i = 0; i < BATCH && from.head != nullptr; ++i) {
+			to.push(from.pop());
+		}
+	}
+
+	// Slabs live until the process exits, buffers only circulate between the free lists.
+	void allocSlab(FreeList& list)
+	{
+		uint8_t* slab = (uint8_t*)malloc(SLAB_PACKETS * Packet::BUFFER_SIZE);
+		ASSERT(slab != nullptr);
+		for (size_t i = 0; i < SLAB_PACKETS; ++i) {
+			PacketBuffer* buffer = new(slab + i * Packet::BUFFER_SIZE) PacketBuffer();
+			buffer->capacity = (uint32_t)Packet::CAPACITY;
+			buffer->oversize = false;
+			list.push(buffer);
+		}
+		shared().slabs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	PacketBuffer* takeBuffer()
+	{
+		if (t_free.head == nullptr) {
+			SharedList& global = shared();
+			{
+				std::lock_guard<std::mutex> lock(global.mutex);
+				if (global.list.head != nullptr) {
+					moveBatch(global.list, t_free);
+					global.transfers.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			if (t_free.head == nullptr) {
+				allocSlab(t_free);
+			}
+		}
+		return t_free.pop();
+	}
+
+	void returnBuffer(PacketBuffer* buffer)
+	{
+		if (buffer->oversize) {
+			buffer->~PacketBuffer();
+			free(buffer);
+			return;
+		}
+
+		t_free.push(buffer);
+		if (t_free.count > LOCAL_MAX) {
+			SharedList& global = shared();
+			std::lock_guard<std::mutex> lock(global.mutex);
+			moveBatch(t_free, global.list);
+			global.transfers.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+
+// ------------------------------------------------------------------------
+Packet Packet::alloc(size_t length)
+{
+	PacketBuffer* buffer = nullptr;
+	if (length <= MAX_PAYLOAD) {
+		buffer = takeBuffer();
+	} else {
+		size_t capacity = HEADROOM + length;
+		buffer = new(malloc(sizeof(PacketBuffer) + capacity)) PacketBuffer();
+		buffer->capacity = (uint32_t)capacity;
+		buffer->oversize = true;
+		shared().oversize.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	buffer->refs.store(1, std::memory_order_relaxed);
+	buffer->next = nullptr;
+	return Packet(buffer, (uint32_t)HEADROOM, (uint32_t)length);
+}
+
+// ------------------------------------------------------------------------
+PacketStats Packet::stats()
+{
+	SharedList& global = shared();
+	return PacketStats{
+		global.slabs.load(std::memory_order_relaxed),
+		global.oversize.load(std::memory_order_relaxed),
+		global.transfers.load(std::memory_order_relaxed),
+		global.copies.load(std::memory_order_relaxed),
+	};
+}
+
+// ------------------------------------------------------------------------
+Packet Packet::share() const
+{
+	ASSERT(m_buffer != nullptr);
+	m_buffer->refs.fetch_add(1, std::memory_order_relaxed);
+	return Packet(m_buffer, m_offset, m_length);
+}
+
+// ------------------------------------------------------------------------
+Packet& Packet::operator=(Packet&& other) noexcept
+{
+	if (this != &other) {
+		reset();
+		m_buffer = other.m_buffer;
+		m_offset = other.m_offset;
+		m_length = other.m_length;
+		other.m_buffer = nullptr;
+	}
+	return *this;
+}
+
+// ------------------------------------------------------------------------
+void Packet::reset()
+{
+	if (m_buffer == nullptr) {
+		return;
+	}
+	if (m_buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		returnBuffer(m_buffer);
+	}
+	m_buffer = nullptr;
+}
+
+// ------------------------------------------------------------------------
+uint8_t* Packet::prepend(size_t length)
+{
+	if (length > HEADROOM) {
+		LOG(0, "Packet: %u bytes don't fit into the headroom.", (uint32_t)length);
+		return nullptr;
+	}
+	// other holders may still read their view, and the headroom is the same memory for all of them
+	if (!unique() || length > m_offset) {
+		Packet copy = alloc(m_length);
+		memcpy(copy.data(), data(), m_length);
+		*this = std::move(copy);
+		shared().copies.fetch_add(1, std::memory_order_relaxed);
+	}
+	m_offset -= (uint32_t)length;
+	m_length += (uint32_t)length;
+	return data();
+}
+
+// ------------------------------------------------------------------------
+bool Packet::consume(size_t length)
+{
+	if (length > m_length) {
+		return false;
+	}
+	m_offset += (uint32_t)length;
+	m_length -= (uint32_t)length;
+	return true;
+}
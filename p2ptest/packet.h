@@ -0,0 +1,86 @@
+#pragma once
+
+#include "tools.h"
+
+#include <atomic>
+
+
+// Packet buffer header, the payload follows it in the same allocation.
+struct PacketBuffer {
+	std::atomic<uint32_t> refs;
+	uint32_t capacity;      // bytes available after the header
+	bool oversize;          // allocated separately, doesn't belong to any slab
+	PacketBuffer* next;     // free list link
+
+	uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+struct PacketStats {
+	size_t slabs;           // slab allocations
+	size_t oversize;        // payloads which didn't fit into a slab buffer
+	size_t transfers;       // free list batches moved between threads
+	size_t copies;          // payloads copied by 'prepend' because the buffer was shared or short of headroom
+};
+
+
+// Owning reference to a packet buffer. Buffers are carved from slabs of MTU-sized blocks and kept
+// in per-thread free lists, so taking and releasing one doesn't touch the heap. Every packet keeps
+// HEADROOM bytes in front of the payload for headers prepended in place. References are moved, or
+// shared explicitly with 'share'; the buffer returns to the free list of the thread releasing the last one.
+// Every reference has its own view (payload start and length) of the buffer, so consuming or prepending
+// through one of them doesn't move the payload under the others.
+class Packet {
+public:
+	static const size_t BUFFER_SIZE = 2048;
+	static const size_t HEADROOM = 64;
+	static const size_t CAPACITY = BUFFER_SIZE - sizeof(PacketBuffer);
+	static const size_t MAX_PAYLOAD = CAPACITY - HEADROOM;
+
+public:
+	// Payloads bigger than MAX_PAYLOAD get a separate heap buffer.
+	static Packet alloc(size_t length = 0);
+	static PacketStats stats();
+
+public:
+	Packet() : m_buffer(nullptr), m_offset(0), m_length(0) {}
+	~Packet() { reset(); }
+
+	Packet(Packet&& other) noexcept : m_buffer(other.m_buffer), m_offset(other.m_offset), m_length(other.m_length) { other.m_buffer = nullptr; }
+	Packet& operator=(Packet&& other) noexcept;
+
+	Packet(Packet const&) = delete;
+	Packet& operator=(Packet const&) = delete;
+
+	// Another reference to the same buffer with the same view, the payload is not copied.
+	Packet share() const;
+	void reset();
+
+	// Empties the payload and restores the full headroom.
+	void clear() { m_offset = (uint32_t)HEADROOM; m_length = 0; }
+
+	explicit operator bool() const { return m_buffer != nullptr; }
+	bool unique() const { return m_buffer != nullptr && m_buffer->refs.load(std::memory_order_acquire) == 1; }
+
+	uint8_t* data() const { return m_buffer->data() + m_offset; }
+	size_t size() const { return m_length; }
+	Bytes bytes() const { return Bytes(data(), data() + size()); }
+
+	// Room available for the payload after its start.
+	size_t tailroom() const { return m_buffer->capacity - m_offset; }
+	size_t headroom() const { return m_offset; }
+
+	void resize(size_t length) { ASSERT(length <= tailroom()); m_length = (uint32_t)length; }
+	// Extends the payload to the front, returns the new start or nullptr if the headroom is too small.
+	// Headers are written into the buffer, so a shared one is copied first.
+	uint8_t* prepend(size_t length);
+	// Drops 'length' bytes from the front of the payload, fails if there are fewer.
+	bool consume(size_t length);
+
+private:
+	PacketBuffer* m_buffer;
+	uint32_t m_offset;      // payload start, everything before it is headroom
+	uint32_t m_length;      // payload length
+
+private:
+	Packet(PacketBuffer* buffer, uint32_t offset, uint32_t length) : m_buffer(buffer), m_offset(offset), m_length(length) {}
+};
@@ -66,46 +66,75 @@ T* PoolCell<T>::get() const
 }
 
 // ------------------------------------------------------------------------
-template <class T>
+template <class T, template <class> class StorageTy>
 template <class... ArgsTy>
-void Pool<T>::Cell::make(uint32_t nonce, ArgsTy&&... args)
+void Pool<T, StorageTy>::Cell::make(uint32_t nonce, ArgsTy&&... args)
 {
 	next = UINT_MAX;
 	PoolCell<T>::make(nonce, std::forward<ArgsTy>(args)...);
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-void Pool<T>::Cell::destroy()
+template <class T, template <class> class StorageTy>
+void Pool<T, StorageTy>::Cell::destroy()
 {
 	PoolCell<T>::destroy();
 }
 
+// ------------------------------------------------------------------------
+// PoolChunks implementation
+// ------------------------------------------------------------------------
+template <class CellTy>
+uint32_t PoolChunks<CellTy>::grow()
+{
+	if (m_size == m_chunks.size() * CHUNK_SIZE) {
+		m_chunks.emplace_back(new CellTy[CHUNK_SIZE]);
+	}
+	return (uint32_t)m_size++;
+}
+
+// ------------------------------------------------------------------------
+template <class CellTy>
+void PoolChunks<CellTy>::reserve(size_t n)
+{
+	while (m_chunks.size() * CHUNK_SIZE < n) {
+		m_chunks.emplace_back(new CellTy[CHUNK_SIZE]);
+	}
+}
+
+
 // ------------------------------------------------------------------------
 // Pool implementation
 // ------------------------------------------------------------------------
-template <class T>
-Pool<T>::Pool(Pool<T>&& other) noexcept
+template <class T, template <class> class StorageTy>
+Pool<T, StorageTy>::Pool(Pool<T, StorageTy>&& other) noexcept
 	: m_storage(std::move(other.m_storage))
+	, m_occupied(std::move(other.m_occupied))
 	, m_head(other.m_head)
+	, m_autoinc(other.m_autoinc)
+	, m_count(other.m_count)
 {
 	other.m_head = UINT_MAX;
+	other.m_count = 0;
 	ASSERT(m_head == UINT_MAX || !m_storage[m_head].isValid());
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-Pool<T>& Pool<T>::operator=(Pool<T>&& other) noexcept
+template <class T, template <class> class StorageTy>
+Pool<T, StorageTy>& Pool<T, StorageTy>::operator=(Pool<T, StorageTy>&& other) noexcept
 {
 	std::swap(m_storage, other.m_storage);
+	std::swap(m_occupied, other.m_occupied);
 	std::swap(m_head, other.m_head);
+	std::swap(m_autoinc, other.m_autoinc);
+	std::swap(m_count, other.m_count);
 	return *this;
 }
 
 
 // ------------------------------------------------------------------------
-template <class T>
-auto Pool<T>::getCell(PoolHandle idx) const -> Cell*
+template <class T, template <class> class StorageTy>
+auto Pool<T, StorageTy>::getCell(PoolHandle idx) const -> Cell*
 {
 	if (m_storage.size() <= idx.index) return nullptr;
 	Cell& cell = m_storage[idx.index];
@@ -116,8 +145,8 @@ auto Pool<T>::getCell(PoolHandle idx) const -> Cell*
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-T* Pool<T>::operator[](PoolHandle idx) const
+template <class T, template <class> class StorageTy>
+T* Pool<T, StorageTy>::operator[](PoolHandle idx) const
 {
 	Cell* cell = getCell(idx);
 	if (cell == nullptr) {
@@ -127,8 +156,8 @@ T* Pool<T>::operator[](PoolHandle idx) const
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-T& Pool<T>::at(PoolHandle idx) const
+template <class T, template <class> class StorageTy>
+T& Pool<T, StorageTy>::at(PoolHandle idx) const
 {
 	ASSERT_MSG(idx.index < m_storage.size(), "Element not exist");
 	ASSERT_MSG(m_storage[idx.index].nonce != 0, "Element not exist");
@@ -137,9 +166,9 @@ T& Pool<T>::at(PoolHandle idx) const
 }
 
 // ------------------------------------------------------------------------
-template <class T>
+template <class T, template <class> class StorageTy>
 template <class... ArgsTy>
-PoolHandle Pool<T>::alloc(ArgsTy&&... args)
+PoolHandle Pool<T, StorageTy>::alloc(ArgsTy&&... args)
 {
 	PoolHandle handle;
 	handle.nonce = m_autoinc++;
@@ -156,18 +185,18 @@ PoolHandle Pool<T>::alloc(ArgsTy&&... args)
 
 		ASSERT_MSG(m_head == UINT_MAX || !m_storage[m_head].isValid(), "inconsistent pool (2): head %d, handle [%d/%d]", m_head, handle.index, handle.nonce);
 	} else {
-		uint32_t idx = (uint32_t)m_storage.size();
-		m_storage.emplace_back(UINT_MAX);
+		uint32_t idx = m_storage.grow();
 
 		handle.index = idx;
 		m_storage[idx].make(handle.nonce, std::forward<ArgsTy>(args)...);
 	}
+	m_occupied.set(handle.index);
 	return handle;
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-void Pool<T>::dealloc(PoolHandle idx)
+template <class T, template <class> class StorageTy>
+void Pool<T, StorageTy>::dealloc(PoolHandle idx)
 {
 	Cell* cell = getCell(idx);
 	if (cell != nullptr) {
@@ -177,14 +206,15 @@ void Pool<T>::dealloc(PoolHandle idx)
 		ASSERT(m_head == UINT_MAX || !m_storage[m_head].isValid());
 		cell->next = m_head;
 		m_head = idx.index;
+		m_occupied.reset(idx.index);
+		m_count -= 1;
 	}
 	ASSERT(m_head == UINT_MAX || !m_storage[m_head].isValid());
-	m_count -= 1;
 }
 
 // ------------------------------------------------------------------------
-template <class T>
-bool Pool<T>::check()
+template <class T, template <class> class StorageTy>
+bool Pool<T, StorageTy>::check()
 {
 	auto current = m_head;
 	while (current != UINT_MAX) {
@@ -199,27 +229,53 @@ bool Pool<T>::check()
 }
 
 // ------------------------------------------------------------------------
-   // PoolMirror implementation
-   // ------------------------------------------------------------------------
+// PoolMirror implementation
+// ------------------------------------------------------------------------
 template <class T>
-T* PoolMirror<T>::operator[](PoolHandle idx) const
+uint32_t PoolMirror<T>::find(PoolHandle idx) const
 {
-	if (m_storage.size() <= idx.index) return nullptr;
-	PoolCell<T>& cell = m_storage[idx.index];
+	uint32_t page = idx.index >> PAGE_BITS;
+	if (page >= m_pages.size() || !m_pages[page]) return NONE;
 
-	if (cell.nonce != idx.nonce) return nullptr;
-	if (cell.nonce == 0) return nullptr;
-	return cell.get();
+	uint32_t position = m_pages[page][idx.index & (PAGE_SIZE - 1)];
+	if (position == NONE) return NONE;
+	if (idx.nonce == 0 || m_dense[position].handle.nonce != idx.nonce) return NONE;
+	return position;
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+uint32_t& PoolMirror<T>::slot(uint32_t index)
+{
+	uint32_t page = index >> PAGE_BITS;
+	if (page >= m_pages.size()) {
+		m_pages.resize(page + 1);
+	}
+	if (!m_pages[page]) {
+		m_pages[page].reset(new uint32_t[PAGE_SIZE]);
+		std::fill(m_pages[page].get(), m_pages[page].get() + PAGE_SIZE, NONE);
+	}
+	return m_pages[page][index & (PAGE_SIZE - 1)];
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+T* PoolMirror<T>::operator[](PoolHandle idx) const
+{
+	uint32_t position = find(idx);
+	if (position == NONE) {
+		return nullptr;
+	}
+	return &m_dense[position].value;
 }
 
 // ------------------------------------------------------------------------
 template <class T>
 T& PoolMirror<T>::at(PoolHandle idx) const
 {
-	ASSERT_MSG(m_storage.size() > idx.index, "Element [%d/%d] not exist", idx.index, idx.nonce);
-	ASSERT_MSG(m_storage[idx.index].nonce != 0, "Element [%d/%d] not exist", idx.index, idx.nonce);
-	ASSERT_MSG(m_storage[idx.index].nonce == idx.nonce, "Element [%d/%d] not exist", idx.index, idx.nonce);
-	return *m_storage[idx.index].get();
+	uint32_t position = find(idx);
+	ASSERT_MSG(position != NONE, "Element [%d/%d] not exist", idx.index, idx.nonce);
+	return m_dense[position].value;
 }
 
 // ------------------------------------------------------------------------
@@ -228,18 +284,20 @@ template <class... ArgsTy>
 T& PoolMirror<T>::make(PoolHandle idx, ArgsTy&&... args)
 {
 	ASSERT(idx.isValid());
-	if (idx.index >= m_storage.size()) {
-		m_storage.resize(idx.index + 1);
-	}
 
-	PoolCell<T>& cell = m_storage[idx.index];
-	ASSERT_MSG(!cell.isValid(), "You have to destroy pool element before it construction (elem #%d)", idx.index);
-	if (cell.isValid()) {
-		cell.destroy();
+	uint32_t page = idx.index >> PAGE_BITS;
+	if (page < m_pages.size() && m_pages[page]) {
+		uint32_t existing = m_pages[page][idx.index & (PAGE_SIZE - 1)];
+		ASSERT_MSG(existing == NONE, "You have to destroy pool element before it construction (elem #%d)", idx.index);
+		if (existing != NONE) {
+			destroy(m_dense[existing].handle);
+		}
 	}
 
-	cell.make(idx.nonce, std::forward<ArgsTy>(args)...);
-	return *reinterpret_cast<T*>(cell.data);
+	uint32_t& position = slot(idx.index);
+	position = (uint32_t)m_dense.size();
+	m_dense.emplace_back(idx, std::forward<ArgsTy>(args)...);
+	return m_dense.back().value;
 }
 
 // ------------------------------------------------------------------------
@@ -248,10 +306,267 @@ template <class T>
 void PoolMirror<T>::destroy(PoolHandle idx)
 {
 	CHECK(return, idx.isValid(), "Invalid handle value");
-	CHECK(return, m_storage.size() > idx.index, "You have to make pool element before it destruction (elem #%d)", idx.index);
-	CHECK(return, m_storage[idx.index].nonce == idx.nonce, "You have to make pool element before it destruction (elem #%d)", idx.index);
 
-	PoolCell<T>& cell = m_storage[idx.index];
-	cell.destroy();
+	uint32_t position = find(idx);
+	CHECK(return, position != NONE, "You have to make pool element before it destruction (elem #%d)", idx.index);
+
+	// the last element fills the hole
+	uint32_t last = (uint32_t)m_dense.size() - 1;
+	if (position != last) {
+		m_dense[position] = std::move(m_dense[last]);
+		m_pages[m_dense[position].handle.index >> PAGE_BITS][m_dense[position].handle.index & (PAGE_SIZE - 1)] = position;
+	}
+	m_dense.pop_back();
+
+	m_pages[idx.index >> PAGE_BITS][idx.index & (PAGE_SIZE - 1)] = NONE;
+}
+#undef CHECK
+
+
+// ------------------------------------------------------------------------
+// PoolSoA implementation
+// ------------------------------------------------------------------------
+template <class... Fields>
+PoolHandle PoolSoA<Fields...>::alloc()
+{
+	PoolHandle handle;
+	handle.nonce = m_autoinc++;
+	m_count += 1;
+
+	if (!m_free.empty()) {
+		handle.index = m_free.back();
+		m_free.pop_back();
+	} else {
+		handle.index = (uint32_t)m_nonces.size();
+		m_nonces.push_back(0);
+		growColumns(std::index_sequence_for<Fields...>());
+	}
+
+	ASSERT(m_nonces[handle.index] == 0);
+	m_nonces[handle.index] = handle.nonce;
+	m_occupied.set(handle.index);
+	return handle;
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+void PoolSoA<Fields...>::dealloc(PoolHandle handle)
+{
+	if (!contains(handle)) {
+		return;
+	}
+
+	resetColumns(handle.index, std::index_sequence_for<Fields...>());
+	m_nonces[handle.index] = 0;
+	m_occupied.reset(handle.index);
+	m_free.push_back(handle.index);
+	m_count -= 1;
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+template <size_t I>
+auto PoolSoA<Fields...>::at(PoolHandle handle) const -> Field<I>&
+{
+	ASSERT_MSG(contains(handle), "Element [%d/%d] not exist", handle.index, handle.nonce);
+	return std::get<I>(m_columns)[handle.index];
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+void PoolSoA<Fields...>::reserve(size_t n)
+{
+	m_nonces.reserve(n);
+	reserveColumns(n, std::index_sequence_for<Fields...>());
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+void PoolSoA<Fields...>::clear()
+{
+	m_columns = std::tuple<std::vector<Fields>...>();
+	m_nonces.clear();
+	m_free.clear();
+	m_occupied.clear();
+	m_count = 0;
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+template <size_t... Is>
+void PoolSoA<Fields...>::growColumns(std::index_sequence<Is...>)
+{
+	int expand[] = { 0, (std::get<Is>(m_columns).emplace_back(), 0)... };
+	(void)expand;
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+template <size_t... Is>
+void PoolSoA<Fields...>::resetColumns(uint32_t index, std::index_sequence<Is...>)
+{
+	int expand[] = { 0, (std::get<Is>(m_columns)[index] = Field<Is>(), 0)... };
+	(void)expand;
+}
+
+// ------------------------------------------------------------------------
+template <class... Fields>
+template <size_t... Is>
+void PoolSoA<Fields...>::reserveColumns(size_t n, std::index_sequence<Is...>)
+{
+	int expand[] = { 0, (std::get<Is>(m_columns).reserve(n), 0)... };
+	(void)expand;
+}
+
+
+// ------------------------------------------------------------------------
+// ConcurrentPool implementation
+// ------------------------------------------------------------------------
+template <class T>
+ConcurrentPool<T>::ConcurrentPool(size_t capacity)
+	: m_slots(new Slot[capacity]), m_capacity(capacity), m_head(0), m_count(0)
+{
+	ASSERT(capacity != 0 && capacity < NONE);
+	for (size_t i = 0; i < capacity; ++i) {
+		m_slots[i].generation.store(0, std::memory_order_relaxed);
+		m_slots[i].sequence.store(0, std::memory_order_relaxed);
+		m_slots[i].next.store(i + 1 < capacity ? (uint32_t)(i + 1) : NONE, std::memory_order_relaxed);
+	}
+	m_head.store(0, std::memory_order_release);
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+PoolHandle ConcurrentPool<T>::alloc(T const& value)
+{
+	uint32_t index = pop();
+	if (index == NONE) {
+		return PoolHandle();
+	}
+
+	Slot& slot = m_slots[index];
+	write(slot, value);
+
+	// the slot is owned exclusively until it's published as live
+	uint32_t generation = slot.generation.load(std::memory_order_relaxed) + 1;
+	slot.generation.store(generation, std::memory_order_release);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	return PoolHandle(index, generation);
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+bool ConcurrentPool<T>::dealloc(PoolHandle handle)
+{
+	if (handle.index >= m_capacity || (handle.nonce & 1) == 0) {
+		return false;
+	}
+
+	uint32_t generation = handle.nonce;
+	if (!m_slots[handle.index].generation.compare_exchange_strong(generation, generation + 1, std::memory_order_acq_rel)) {
+		return false;
+	}
+	m_count.fetch_sub(1, std::memory_order_relaxed);
+	push(handle.index);
+	return true;
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+bool ConcurrentPool<T>::contains(PoolHandle handle) const
+{
+	return handle.index < m_capacity && (handle.nonce & 1) != 0
+		&& m_slots[handle.index].generation.load(std::memory_order_acquire) == handle.nonce;
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+PoolHandle ConcurrentPool<T>::handle(size_t index) const
+{
+	ASSERT(index < m_capacity);
+	uint32_t generation = m_slots[index].generation.load(std::memory_order_acquire);
+	return (generation & 1) != 0 ? PoolHandle((uint32_t)index, generation) : PoolHandle();
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+bool ConcurrentPool<T>::load(PoolHandle handle, T& value) const
+{
+	if (handle.index >= m_capacity || (handle.nonce & 1) == 0) {
+		return false;
+	}
+
+	Slot const& slot = m_slots[handle.index];
+	while (true) {
+		uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (slot.generation.load(std::memory_order_acquire) != handle.nonce) {
+			return false;
+		}
+		if (sequence & 1) {
+			continue; // writer is in the middle of an update
+		}
+
+		memcpy(&value, &slot.value, sizeof(T));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+			// slot could have been freed and reused while copying
+			return slot.generation.load(std::memory_order_relaxed) == handle.nonce;
+		}
+	}
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+bool ConcurrentPool<T>::store(PoolHandle handle, T const& value)
+{
+	if (!contains(handle)) {
+		return false;
+	}
+	write(m_slots[handle.index], value);
+	return true;
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+void ConcurrentPool<T>::write(Slot& slot, T const& value)
+{
+	uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&slot.value, &value, sizeof(T));
+	slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+uint32_t ConcurrentPool<T>::pop()
+{
+	uint64_t head = m_head.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t index = (uint32_t)head;
+		if (index == NONE) {
+			return NONE;
+		}
+
+		// 'next' may be stale if the slot was popped meanwhile, the tag makes the exchange fail then
+		uint64_t next = m_slots[index].next.load(std::memory_order_relaxed);
+		uint64_t tagged = ((head >> 32) + 1) << 32 | next;
+		if (m_head.compare_exchange_weak(head, tagged, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return index;
+		}
+	}
+}
+
+// ------------------------------------------------------------------------
+template <class T>
+void ConcurrentPool<T>::push(uint32_t index)
+{
+	uint64_t head = m_head.load(std::memory_order_relaxed);
+	while (true) {
+		m_slots[index].next.store((uint32_t)head, std::memory_order_relaxed);
+		uint64_t tagged = ((head >> 32) + 1) << 32 | index;
+		if (m_head.compare_exchange_weak(head, tagged, std::memory_order_release, std::memory_order_relaxed)) {
+			return;
+		}
+	}
 }
-#undef CHECK
\ No newline at end of file
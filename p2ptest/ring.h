@@ -0,0 +1,149 @@
+#pragma once
+
+#include "tools.h"
+
+#include <atomic>
+#include <memory>
+
+
+// Rings are over-aligned to it, so heap allocations of them rely on C++17 aligned new.
+const size_t CACHE_LINE_SIZE = 64;
+
+inline size_t roundUpPow2(size_t value)
+{
+	size_t result = 1;
+	while (result < value) {
+		result <<= 1;
+	}
+	return result;
+}
+
+
+// Bounded single producer/single consumer queue. Producer and consumer indices live on separate
+// cache lines, each side keeps a cached copy of the other one's index and reloads it only when
+// the ring looks full or empty, so in steady state the sides don't share written lines at all.
+template <class T>
+class SpscRing {
+public:
+	// Capacity is rounded up to a power of two.
+	explicit SpscRing(size_t capacity) : m_items(new T[roundUpPow2(capacity)]), m_mask(roundUpPow2(capacity) - 1) {}
+
+	SpscRing(SpscRing const&) = delete;
+	SpscRing& operator=(SpscRing const&) = delete;
+
+	// Returns false if the ring is full, 'value' is left untouched then.
+	bool push(T&& value) {
+		size_t tail = m_tail.value.load(std::memory_order_relaxed);
+		if (tail - m_tail.cached > m_mask) {
+			m_tail.cached = m_head.value.load(std::memory_order_acquire);
+			if (tail - m_tail.cached > m_mask) {
+				return false;
+			}
+		}
+		m_items[tail & m_mask] = std::move(value);
+		m_tail.value.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& value) {
+		size_t head = m_head.value.load(std::memory_order_relaxed);
+		if (head == m_head.cached) {
+			m_head.cached = m_tail.value.load(std::memory_order_acquire);
+			if (head == m_head.cached) {
+				return false;
+			}
+		}
+		value = std::move(m_items[head & m_mask]);
+		m_head.value.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate when called concurrently with push or pop.
+	size_t count() const {
+		size_t head = m_head.value.load(std::memory_order_acquire);
+		size_t tail = m_tail.value.load(std::memory_order_acquire);
+		return tail - head <= m_mask + 1 ? tail - head : 0;
+	}
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	struct alignas(CACHE_LINE_SIZE) Index {
+		std::atomic<size_t> value{ 0 };   // written by the owning side only
+		size_t cached = 0;                // owner's copy of the opposite index
+	};
+
+private:
+	std::unique_ptr<T[]> m_items;
+	size_t m_mask;
+	Index m_head;   // consumer
+	Index m_tail;   // producer
+};
+
+
+// Bounded multiple producers/single consumer queue. Every cell carries a sequence number telling
+// whose turn it is, producers claim cells by advancing the shared tail with CAS and publish them
+// through the cell sequence, so a producer preempted mid-push only stalls the consumer at its cell.
+template <class T>
+class MpscRing {
+public:
+	// Capacity is rounded up to a power of two.
+	explicit MpscRing(size_t capacity) : m_cells(new Cell[roundUpPow2(capacity)]), m_mask(roundUpPow2(capacity) - 1) {
+		for (size_t i = 0; i <= m_mask; ++i) {
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	MpscRing(MpscRing const&) = delete;
+	MpscRing& operator=(MpscRing const&) = delete;
+
+	// Safe to call from any thread. Returns false if the ring is full, 'value' is left untouched then.
+	bool push(T&& value) {
+		Cell* cell = nullptr;
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &m_cells[tail & m_mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)tail;
+			if (diff == 0) {
+				if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				tail = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = std::move(value);
+		cell->sequence.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, one thread only.
+	bool pop(T& value) {
+		Cell& cell = m_cells[m_head & m_mask];
+		if (cell.sequence.load(std::memory_order_acquire) != m_head + 1) {
+			return false;
+		}
+		value = std::move(cell.value);
+		cell.sequence.store(m_head + m_mask + 1, std::memory_order_release);
+		m_head += 1;
+		return true;
+	}
+
+	// Consumer side, one thread only.
+	bool empty() const { return m_cells[m_head & m_mask].sequence.load(std::memory_order_acquire) != m_head + 1; }
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+private:
+	std::unique_ptr<Cell[]> m_cells;
+	size_t m_mask;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_tail{ 0 };   // producers
+	alignas(CACHE_LINE_SIZE) size_t m_head = 0;                 // consumer
+};
@@ -1,12 +1,15 @@
 #include "socket.h"
+#include "capture.h"
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <mswsock.h>
+#include <iphlpapi.h>
 #include <assert.h>
 #include <time.h>
 
 #pragma comment (lib, "Ws2_32.lib")
+#pragma comment (lib, "Iphlpapi.lib")
 
 
 uint16_t net_uint16_t::get() const { return ntohs(value); }
@@ -78,13 +81,17 @@ int resolve_url(bool ipv4, char const* url, NetAddress& address)
 
 NetAddress resolve_local_address(Socket const& sock)
 {
-	auto sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock.backend != nullptr) {
+		return sock.sockname();
+	}
+
+	// Connecting UDP socket sends nothing and needs no DNS, it just makes the system pick a route
+	auto sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (sockfd == INVALID_SOCKET) {
 		return sock.sockname();
 	}
 
-	NetAddress remoteAddress;
-	resolve_url(true, "stackoverflow.com", 80, remoteAddress);
+	NetAddress remoteAddress = NetAddress::ipv4(8, 8, 8, 8, 53);
 	if (connect(sockfd, (sockaddr*)remoteAddress.data, sizeof(remoteAddress.data)) < 0) {
 		closesocket(sockfd);
 		return sock.sockname();
@@ -104,11 +111,40 @@ NetAddress resolve_local_address(Socket const& sock)
 	}
 
 	localAddress.setport(sock.sockname().getport());
-	//shutdown(sockfd, SHUT_RDWR);
 	closesocket(sockfd);
 	return localAddress;
 }
 
+NetAddress resolve_gateway_address(NetAddress const& localAddress)
+{
+	ULONG size = 0;
+	if (GetAdaptersInfo(NULL, &size) != ERROR_BUFFER_OVERFLOW) {
+		return NetAddress::any(0);
+	}
+
+	std::vector<uint8_t> buffer(size);
+	IP_ADAPTER_INFO* adapters = (IP_ADAPTER_INFO*)buffer.data();
+	if (GetAdaptersInfo(adapters, &size) != NO_ERROR) {
+		return NetAddress::any(0);
+	}
+
+	sockaddr_in const* local = (sockaddr_in const*)localAddress.data;
+	for (IP_ADAPTER_INFO* adapter = adapters; adapter != NULL; adapter = adapter->Next) {
+		for (IP_ADDR_STRING* ip = &adapter->IpAddressList; ip != NULL; ip = ip->Next) {
+			IN_ADDR addr;
+			if (inet_pton(AF_INET, ip->IpAddress.String, &addr) != 1 || addr.S_un.S_addr != local->sin_addr.S_un.S_addr) {
+				continue;
+			}
+
+			NetAddress gateway = NetAddress::any(0);
+			sockaddr_in* gw = (sockaddr_in*)gateway.data;
+			inet_pton(AF_INET, adapter->GatewayList.IpAddress.String, &gw->sin_addr);
+			return gateway;
+		}
+	}
+	return NetAddress::any(0);
+}
+
 
 std::string toString(NetAddress const& address)
 {
@@ -196,7 +232,7 @@ NetAddress NetAddress::ipv4(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint
 
 
 Socket::Socket()
-	: handle(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))
+	: handle(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)), backend(nullptr)
 {
 	u_long mode = 1;
 	if (ioctlsocket(handle, FIONBIO, &mode) != NO_ERROR) {
@@ -209,37 +245,110 @@ Socket::Socket()
 }
 
 
+Socket::Socket(ISocketBackend* backend)
+	: handle(INVALID_SOCKET), backend(backend)
+{
+}
+
+
 Socket::~Socket()
 {
-	if (valid()) {
+	if (backend != nullptr) {
+		backend->close();
+	}
+	if (handle != INVALID_SOCKET) {
 		closesocket(handle);
 	}
 }
 
 bool Socket::valid() const
 {
-	return handle != INVALID_SOCKET;
+	return backend != nullptr || handle != INVALID_SOCKET;
 }
 
 bool Socket::bind(NetAddress const& address) const
 {
+	if (backend != nullptr) {
+		return backend->bind(address);
+	}
 	return ::bind(handle, (sockaddr*)&address, sizeof(address)) != SOCKET_ERROR;
 }
 
 int Socket::recv(void* buf, int len, int flags) const
 {
+	if (backend != nullptr) {
+		NetAddress from;
+		return backend->recvfrom(buf, len, from);
+	}
 	return ::recv(handle, (char*)buf, len, flags);
 }
 
 int Socket::recvfrom(void* buf, int len, int flags, NetAddress& from) const
 {
+	if (backend != nullptr) {
+		return backend->recvfrom(buf, len, from);
+	}
 	int fromlen = (int)sizeof(from.data);
-	return ::recvfrom(handle, (char*)buf, len, flags, (sockaddr*)from.data, &fromlen);
+	int count = ::recvfrom(handle, (char*)buf, len, flags, (sockaddr*)from.data, &fromlen);
+	if (count > 0 && Capture::enabled()) {
+		Capture::onReceive(handle, from, buf, count);
+	}
+	return count;
+}
+
+bool Socket::wait(size_t timeout) const
+{
+	if (backend != nullptr) {
+		return backend->pending();
+	}
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	FD_SET(handle, &readSet);
+
+	timeval tv = { (long)(timeout / 1000), (long)(timeout % 1000 * 1000) };
+	return ::select(0, &readSet, nullptr, nullptr, &tv) > 0;
+}
+
+bool Socket::wait(size_t timeout, Socket const& wakeup) const
+{
+	if (backend != nullptr || wakeup.backend != nullptr) {
+		return wait(timeout);
+	}
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	FD_SET(handle, &readSet);
+	FD_SET(wakeup.handle, &readSet);
+
+	timeval tv = { (long)(timeout / 1000), (long)(timeout % 1000 * 1000) };
+	return ::select(0, &readSet, nullptr, nullptr, &tv) > 0 && FD_ISSET(handle, &readSet);
+}
+
+int Socket::recvfrom(Packet& packet, NetAddress& from) const
+{
+	if (!packet) {
+		packet = Packet::alloc();
+	}
+
+	int count = recvfrom(packet.data(), (int)packet.tailroom(), 0, from);
+	packet.resize(count > 0 ? count : 0);
+	return count;
+}
+
+int Socket::sendto(NetAddress const& to, Packet const& packet) const
+{
+	return sendto(to, packet.data(), (int)packet.size(), 0);
 }
 
 int Socket::sendto(NetAddress const& to, void const* buf, int len, int flags) const
 {
-	return ::sendto(handle, (char const*)buf, len, flags, (sockaddr*)to.data, sizeof(to.data));
+	if (backend != nullptr) {
+		return backend->sendto(to, buf, len);
+	}
+	int count = ::sendto(handle, (char const*)buf, len, flags, (sockaddr*)to.data, sizeof(to.data));
+	if (count > 0 && Capture::enabled()) {
+		Capture::onSend(handle, to, buf, count);
+	}
+	return count;
 }
 
 int Socket::sendto(NetAddress const& to, void const* buf, int len, int flags, NetAddress* src) const
@@ -247,6 +356,10 @@ int Socket::sendto(NetAddress const& to, void const* buf, int len, int flags, Ne
 	if (src == NULL) {
 		return sendto(to, buf, len, flags);
 	}
+	if (backend != nullptr) {
+		*src = backend->sockname();
+		return backend->sendto(to, buf, len);
+	}
 	thread_local char controldata[1024];
 
 	WSABUF iov;
@@ -266,6 +379,9 @@ int Socket::sendto(NetAddress const& to, void const* buf, int len, int flags, Ne
 		int err = WinSock::getLastError();
 		return SOCKET_ERROR;
 	}
+	if (Capture::enabled()) {
+		Capture::onSend(handle, to, buf, (int)length);
+	}
 
 	int addrsize = sizeof(sockaddr_in);
 	::getsockname(handle, (sockaddr*)src->data, &addrsize);
@@ -287,6 +403,9 @@ int Socket::sendto(NetAddress const& to, void const* buf, int len, int flags, Ne
 
 NetAddress Socket::sockname() const
 {
+	if (backend != nullptr) {
+		return backend->sockname();
+	}
 	NetAddress address;
 	memset(&address, 0, sizeof(address));
 
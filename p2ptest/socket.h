@@ -1,6 +1,7 @@
 #pragma once
 
 #include "tools.h"
+#include "packet.h"
 
 
 struct WinSock {
@@ -47,11 +48,31 @@ public:
 std::string toString(NetAddress const& addr);
 
 
+// Datagram transport used by a Socket instead of the system one, see VirtualNetwork.
+struct ISocketBackend {
+	virtual ~ISocketBackend() {}
+
+	virtual bool bind(NetAddress const& address) = 0;
+	virtual int sendto(NetAddress const& to, void const* buf, int len) = 0;
+	virtual int recvfrom(void* buf, int len, NetAddress& from) = 0;
+	// Never blocks, backends run on their own clock.
+	virtual bool pending() const = 0;
+	virtual NetAddress sockname() const = 0;
+	// Releases the bound address, called when the Socket is destroyed.
+	virtual void close() = 0;
+	// New unbound socket on the same host, owned by the same transport.
+	virtual ISocketBackend* open() = 0;
+};
+
+
 struct Socket {
 	uintptr_t handle;
+	ISocketBackend* backend;   // nullptr for system sockets
 
 public:
 	Socket();
+	// All calls go to 'backend', no system socket is created. The backend has to outlive the socket.
+	explicit Socket(ISocketBackend* backend);
 	~Socket();
 
 	bool bind(NetAddress const& address) const;
@@ -62,6 +83,13 @@ public:
 
 	int recv(void* buf, int len, int flags) const;
 	int recvfrom(void* buf, int len, int flags, NetAddress& from) const;
+	// Receives into the packet tailroom, allocates a packet if 'packet' is empty. Payload is resized to the datagram.
+	int recvfrom(Packet& packet, NetAddress& from) const;
+	int sendto(NetAddress const& to, Packet const& packet) const;
+	// Returns true if data can be received without blocking before 'timeout' ms pass.
+	bool wait(size_t timeout) const;
+	// Also returns early once 'wakeup' has data to receive.
+	bool wait(size_t timeout, Socket const& wakeup) const;
 
 	NetAddress sockname() const;
 };
@@ -70,4 +98,5 @@ public:
 int resolve_url(bool ipv4, char const* url, int port, NetAddress& address);
 int resolve_url(bool ipv4, char const* url, NetAddress& address);
 
-NetAddress resolve_local_address(Socket const& sock);
\ No newline at end of file
+NetAddress resolve_local_address(Socket const& sock);
+NetAddress resolve_gateway_address(NetAddress const& localAddress);
\ No newline at end of file
@@ -2,11 +2,12 @@
 #include "log.h"
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#include <algorithm>
+#include <thread>
 
 
-namespace StunClient {
-	static char stunClientRespBuffer[512];
-
+namespace {
 	const static uint8_t CHANGE_IP_FLAG = 0x04;
 	const static uint8_t CHANGE_PORT_FLAG = 0x02;
 
@@ -22,6 +23,7 @@ namespace StunClient {
 		ATTR_TYPE_CHANGE_REQUEST = 0x0003,
 		ATTR_TYPE_SOURCE_ADDRESS = 0x0004,
 		ATTR_TYPE_CHANGED_ADDRESS = 0x0005,
+		ATTR_TYPE_RESPONSE_PORT = 0x0027,
 		ATTR_TYPE_RESPONSE_ORIGIN = 0x802b,
 		ATTR_TYPE_OTHER_ADDRESS = 0x802c,
 	};
@@ -39,7 +41,7 @@ namespace StunClient {
 			uint16_t type;
 			uint16_t length;
 			uint32_t cookie;
-			char id[12];
+			char id[StunClient::TRANSACTION_ID_SIZE];
 
 			Header(uint16_t type, uint16_t len) : type(type), length(len), cookie(MAGIC_COOKIE) {}
 
@@ -59,7 +61,18 @@ namespace StunClient {
 			uint16_t length;
 			uint8_t data[4];
 
-			BindRequest(bool changeIp, bool changePort);
+			BindRequest(char const* id, bool changeIp, bool changePort);
+			void toNetEndian();
+		};
+		// Binding request answered to another port of the sender's ip (RESPONSE-PORT, RFC 5780)
+		struct PortRequest {
+			Header header;
+			uint16_t type;
+			uint16_t length;
+			uint16_t port;
+			uint16_t padding;
+
+			PortRequest(char const* id, uint16_t port);
 			void toNetEndian();
 		};
 		struct Address {
@@ -71,12 +84,6 @@ namespace StunClient {
 	};
 #pragma pack(pop)
 
-	struct Responce {
-		NetAddress mappedAddr;
-		NetAddress otherAddr;
-		NetAddress respOrigin;
-	};
-
 	static void genRandomString(char* buf, int len)
 	{
 		static const char alphanum[] =
@@ -109,10 +116,10 @@ namespace StunClient {
 		length = ntohs(length);
 	}
 
-	Message::BindRequest::BindRequest(bool changeIp, bool changePort)
+	Message::BindRequest::BindRequest(char const* id, bool changeIp, bool changePort)
 		: header(MESSAGE_TYPE_BIND_REQUEST, 8), type(ATTR_TYPE_CHANGE_REQUEST), length(4)
 	{
-		genRandomString(header.id, sizeof(header.id));
+		memcpy(header.id, id, sizeof(header.id));
 
 		memset(data, 0, 4);
 		data[3] = changeIp ? CHANGE_IP_FLAG : 0;
@@ -128,6 +135,28 @@ namespace StunClient {
 		header.toNetEndian();
 	}
 
+	Message::PortRequest::PortRequest(char const* id, uint16_t port)
+		: header(MESSAGE_TYPE_BIND_REQUEST, 8), type(ATTR_TYPE_RESPONSE_PORT), length(4), port(port), padding(0)
+	{
+		memcpy(header.id, id, sizeof(header.id));
+	}
+
+	void Message::PortRequest::toNetEndian()
+	{
+		type = htons(type);
+		length = htons(length);
+		port = htons(port);
+		header.toNetEndian();
+	}
+
+	// Any STUN message of the transaction, errors included
+	static bool isTransaction(CBytes bytes, char const* transactionId)
+	{
+		Message::Header const* header = (Message::Header const*)bytes.begin;
+		return bytes.size() >= sizeof(Message::Header) && ntohl(header->cookie) == Message::Header::MAGIC_COOKIE
+			&& memcmp(header->id, transactionId, sizeof(header->id)) == 0;
+	}
+
 
 	static bool parseAddress(char const* data, int len, NetAddress& outAddr)
 	{
@@ -141,141 +170,663 @@ namespace StunClient {
 		return addr->family == FAMILTY_TYPE_IPV4;
 	}
 
-	static bool sendBindRequest(Socket const& socket, NetAddress const& serverAddr, size_t timeout, bool changeIp, bool changePort, Responce& outResponse)
+	// "host[ port]" with a dotted ip as the host needs no DNS
+	static bool isNumericUrl(std::string const& url)
 	{
-		Message::BindRequest msgBindRequest(changeIp, changePort);
-		msgBindRequest.toNetEndian();
+		IN_ADDR addr;
+		return inet_pton(AF_INET, url.substr(0, url.find(' ')).c_str(), &addr) == 1;
+	}
 
-		int bytesReceived = 0;
-		for (int retries = 0; retries < MAX_RETRIES; retries++) {
-			const int bytesToSend = sizeof(msgBindRequest);
-			if (socket.sendto(serverAddr, (char const*)&msgBindRequest, bytesToSend, 0) != bytesToSend) {
-				return false;
-			}
+} // namespace
+
+
+bool StunClient::parseResponse(CBytes bytes, char const* transactionId, Responce& outResponse)
+{
+	if (bytes.size() < sizeof(Message::Header)) {
+		return false;
+	}
 
-			auto grayAddress = socket.sockname();
+	Message::Header recvHeader = *(Message::Header*)bytes.begin;
+	recvHeader.toHostEndian();
 
-			Timer timer(timeout);
-			do {
-				sleep(10);
-				bytesReceived = socket.recv(stunClientRespBuffer, 512, 0);
-				if (bytesReceived >= 0) break;
-			} while (!timer.expired());
+	if (!recvHeader.valid()) {
+		LOG(2, "Failed to parse STUN message.");
+		return false;
+	}
 
-			if (bytesReceived >= 0) {
-				grayAddress = socket.sockname();
-				break;
+	if (recvHeader.type != MESSAGE_TYPE_BIND_RESPONSE) {
+		LOG(2, "Got unexpected message type from STUN server. Expecting binding response(%#x), got %#x", MESSAGE_TYPE_BIND_RESPONSE, recvHeader.type);
+		return false;
+	}
+
+	if (memcmp(transactionId, recvHeader.id, sizeof(recvHeader.id))) {
+		LOG(2, "Got wrong transaction ID in STUN response.");
+		return false;
+	}
+
+	char const* curBuffer = (char const*)bytes.begin + sizeof(Message::Header);
+	char const* endBuffer = (char const*)bytes.end;
+	while (curBuffer + sizeof(Message::AttrHeader) <= endBuffer) {
+		Message::AttrHeader attrHeader = *(Message::AttrHeader*)curBuffer;
+		curBuffer += sizeof(Message::AttrHeader);
+
+		attrHeader.toHostEndian();
+		if (curBuffer + attrHeader.length > endBuffer) {
+			break;
+		}
+		if (attrHeader.type == ATTR_TYPE_MAPPED_ADDRESS) {
+			parseAddress(curBuffer, attrHeader.length, outResponse.mappedAddr);
+		}
+		if (attrHeader.type == ATTR_TYPE_OTHER_ADDRESS) {
+			parseAddress(curBuffer, attrHeader.length, outResponse.otherAddr);
+		}
+		if (attrHeader.type == ATTR_TYPE_RESPONSE_ORIGIN) {
+			parseAddress(curBuffer, attrHeader.length, outResponse.respOrigin);
+		}
+
+		// skip unknown attributes
+		curBuffer += attrHeader.length;
+	}
+	return true;
+}
+
+
+StunClient::StunClient()
+	: m_socket(nullptr), m_stage(Stage::Idle), m_startTime(0), m_bindRtt(0), m_version(0)
+{
+	m_serverAddr = NetAddress::any(0);
+	m_result.type = NatType::Unknown;
+	m_result.grayAddress = NetAddress::any(0);
+	m_result.whiteAddress = NetAddress::any(0);
+	m_result.portDelta = 0;
+	m_published = m_result;
+
+	for (auto& probe : m_probes) {
+		probe.state = Transaction::Inactive;
+	}
+}
+
+bool StunClient::isStunMessage(CBytes bytes)
+{
+	if (bytes.size() < sizeof(Message::Header)) {
+		return false;
+	}
+
+	// STUN message types never collide with NetHost message ids (they all fit in one byte)
+	uint16_t type = (uint16_t)(bytes[0] << 8 | bytes[1]);
+	uint32_t cookie = (uint32_t)bytes[4] << 24 | (uint32_t)bytes[5] << 16 | (uint32_t)bytes[6] << 8 | (uint32_t)bytes[7];
+	return (type == MESSAGE_TYPE_BIND_RESPONSE || type == MESSAGE_TYPE_BIND_ERROR) && cookie == Message::Header::MAGIC_COOKIE;
+}
+
+void StunClient::start(Socket const& socket, std::vector<std::string> const& servers, char const* cachePath)
+{
+	m_socket = &socket;
+	m_startTime = getTimeMs();
+	m_cachePath = (cachePath != nullptr) ? cachePath : "";
+
+	m_result.type = NatType::Unknown;
+	m_result.grayAddress = resolve_local_address(socket);
+	m_result.whiteAddress = NetAddress::any(0);
+	m_result.portDelta = 0;
+	m_gatewayAddress = resolve_gateway_address(m_result.grayAddress);
+
+	if (loadCache()) {
+		LOG(1, "StunClient: NAT info restored from cache in %llu ms (warm start), revalidating.", (unsigned long long)(getTimeMs() - m_startTime));
+		publish();
+	}
+
+	// Server names are resolved concurrently, a bind request goes out to each one as soon as
+	// its address is known. Bind probe stays pending until the first server answers.
+	m_stage = Stage::Racing;
+	m_probes[PROBE_BIND].state = Transaction::Pending;
+	m_servers.clear();
+	for (auto& url : servers) {
+		m_servers.emplace_back();
+		Server& server = m_servers.back();
+		server.url = url;
+		server.bind.state = Transaction::Inactive;
+		auto resolve = [url]() {
+			NetAddress address = NetAddress::any(0);
+			if (resolve_url(true, url.c_str(), address) != 0) {
+				return NetAddress::any(0);
+			}
+			if (address.getport() == 0) {
+				address.setport(DEFAULT_PORT);
 			}
+			return address;
+		};
+		server.resolving = std::make_shared<Resolving>();
+		if (isNumericUrl(url)) {
+			// resolved in place, so the request goes out in this very update (simulations depend on it)
+			server.resolving->address = resolve();
+			server.resolving->done.store(true, std::memory_order_release);
+		} else {
+			// losers of the race and resolvers of a restarted client finish on their own
+			std::shared_ptr<Resolving> resolving = server.resolving;
+			std::thread([resolving, resolve]() {
+				resolving->address = resolve();
+				resolving->done.store(true, std::memory_order_release);
+			}).detach();
 		}
-		if (bytesReceived < (int)sizeof(Message::Header)) {
-			return false;
+	}
+	updateRace();
+}
+
+void StunClient::update()
+{
+	if (m_stage == Stage::Racing) {
+		updateRace();
+		return;
+	}
+	if (m_stage != Stage::Probing) {
+		return;
+	}
+
+	for (int probe = 0; probe < PROBE_COUNT && m_stage == Stage::Probing; ++probe) {
+		Transaction& transaction = m_probes[probe];
+		if (transaction.state == Transaction::Pending && expired(transaction)) {
+			onProbeCompleted(Probe(probe));
 		}
+	}
+}
+
+void StunClient::updateRace()
+{
+	bool racing = false;
+	for (auto& server : m_servers) {
+		if (server.resolving != nullptr) {
+			if (!server.resolving->done.load(std::memory_order_acquire)) {
+				racing = true;
+				continue;
+			}
 
-		Message::Header recvHeader = *(Message::Header*)stunClientRespBuffer;
-		recvHeader.toHostEndian();
+			NetAddress address = server.resolving->address;
+			server.resolving.reset();
+			if (address.getport() == 0) {
+				LOG(2, "StunClient: Failed to resolve STUN server address '%s'.", server.url.c_str());
+				continue;
+			}
+			send(server.bind, address, LONG_RETRY_TIMEOUT_MS, false, false);
+		}
 
-		if (!recvHeader.valid()) {
-			log(2, "Failed to parse STUN message.");
-			return false;
+		// 'expired' resends requests, so every pending server has to go through it
+		if (server.bind.state == Transaction::Pending) {
+			bool alive = !expired(server.bind);
+			racing = racing || alive;
 		}
+	}
+
+	if (!racing) {
+		m_probes[PROBE_BIND].state = Transaction::Failed;
+		onProbeCompleted(PROBE_BIND);
+	}
+}
+
+void StunClient::onRaceWon(Server& server)
+{
+	LOG(2, "StunClient: STUN server '%s' answered first in %llu ms.", server.url.c_str(), (unsigned long long)(getTimeMs() - m_startTime));
 
-		if (recvHeader.type != MESSAGE_TYPE_BIND_RESPONSE) {
-			log(2, "Got unexpected message type from STUN server. Expecting binding response(%#x), got %#x", MESSAGE_TYPE_BIND_RESPONSE, recvHeader.type);
+	for (auto& other : m_servers) {
+		if (other.bind.state == Transaction::Pending) {
+			other.bind.state = Transaction::Inactive;
+		}
+	}
+
+	m_stage = Stage::Probing;
+	m_serverAddr = server.bind.server;
+	m_probes[PROBE_BIND] = server.bind;
+	sendProbe(PROBE_CHANGE_ADDRESS, m_serverAddr, SHORT_RETRY_TIMEOUT_MS, true, true);
+	sendProbe(PROBE_CHANGE_PORT, m_serverAddr, SHORT_RETRY_TIMEOUT_MS, false, true);
+	onProbeCompleted(PROBE_BIND);
+}
+
+bool StunClient::onResponse(NetAddress const& src, CBytes bytes)
+{
+	if (!active() || bytes.size() < sizeof(Message::Header)) {
+		return false;
+	}
+
+	char const* id = ((Message::Header const*)bytes.begin)->id;
+	auto accept = [&](Transaction& transaction) {
+		if (transaction.state != Transaction::Pending || memcmp(transaction.id, id, sizeof(transaction.id))) {
 			return false;
 		}
 
-		if (memcmp(msgBindRequest.header.id, recvHeader.id, 12)) {
-			log(2, "Got wrong transaction ID in STUN response.");
+		transaction.response.mappedAddr = NetAddress::any(0);
+		transaction.response.otherAddr = NetAddress::any(0);
+		transaction.response.respOrigin = NetAddress::any(0);
+		if (!parseResponse(bytes, transaction.id, transaction.response)) {
 			return false;
 		}
 
-		char const* curBuffer = stunClientRespBuffer + sizeof(Message::Header);
-		char const* endBuffer = stunClientRespBuffer + bytesReceived;
-		while (curBuffer < endBuffer) {
-			Message::AttrHeader attrHeader = *(Message::AttrHeader*)curBuffer;
-			curBuffer += sizeof(Message::AttrHeader);
+		transaction.state = Transaction::Succeeded;
+		return true;
+	};
 
-			attrHeader.toHostEndian();
-			if (attrHeader.type == ATTR_TYPE_MAPPED_ADDRESS) {
-				parseAddress(curBuffer, attrHeader.length, outResponse.mappedAddr);
-			}
-			if (attrHeader.type == ATTR_TYPE_OTHER_ADDRESS) {
-				parseAddress(curBuffer, attrHeader.length, outResponse.otherAddr);
+	if (m_stage == Stage::Racing) {
+		for (auto& server : m_servers) {
+			if (accept(server.bind)) {
+				onRaceWon(server);
+				return true;
 			}
-			if (attrHeader.type == ATTR_TYPE_RESPONSE_ORIGIN) {
-				parseAddress(curBuffer, attrHeader.length, outResponse.respOrigin);
-			}
-
-			// skip unknown attributes
-			curBuffer += attrHeader.length;
 		}
-		return true;
+		return false;
 	}
 
+	for (int probe = 0; probe < PROBE_COUNT; ++probe) {
+		if (accept(m_probes[probe])) {
+			onProbeCompleted(Probe(probe));
+			return true;
+		}
+	}
+	return false;
+}
+
+void StunClient::sendProbe(Probe probe, NetAddress const& serverAddr, size_t timeout, bool changeIp, bool changePort)
+{
+	send(m_probes[probe], serverAddr, timeout, changeIp, changePort);
+}
+
+void StunClient::send(Transaction& transaction, NetAddress const& serverAddr, size_t timeout, bool changeIp, bool changePort)
+{
+	genRandomString(transaction.id, sizeof(transaction.id));
+	transaction.state = Transaction::Pending;
+	transaction.server = serverAddr;
+	transaction.changeIp = changeIp;
+	transaction.changePort = changePort;
+	transaction.retries = 0;
+	transaction.timer = Timer(timeout);
+	resend(transaction);
+}
+
+void StunClient::resend(Transaction& transaction)
+{
+	Message::BindRequest msgBindRequest(transaction.id, transaction.changeIp, transaction.changePort);
+	msgBindRequest.toNetEndian();
+
+	const int bytesToSend = sizeof(msgBindRequest);
+	if (m_socket->sendto(transaction.server, (char const*)&msgBindRequest, bytesToSend, 0) != bytesToSend) {
+		LOG(2, "StunClient: Failed to send binding request to '%s'.", toString(transaction.server).c_str());
+	}
+	transaction.timer.reset();
+}
+
+// Retransmits the request on timeout. Returns true once all retries are spent.
+bool StunClient::expired(Transaction& transaction)
+{
+	if (!transaction.timer.expired()) {
+		return false;
+	}
 
-	Result resolve(Socket const& socket)
-	{
-		NetAddress serverAddr;
-		int err = resolve_url(true, "stun.hydrapi.net", 3478, serverAddr);
-		return (err == 0) ? resolve(socket, serverAddr) : Result();
+	transaction.retries += 1;
+	if (transaction.retries < MAX_RETRIES) {
+		resend(transaction);
+		return false;
 	}
 
-	Result resolve(Socket const& socket, NetAddress const& serverAddr)
-	{
-		Result result;
-		result.type = NatType::Unknown;
-		result.grayAddress = resolve_local_address(socket);
-
-		Responce response;
-		if (!sendBindRequest(socket, serverAddr, LONG_RETRY_TIMEOUT_MS, false, false, response)) {
-			log(2, "StunClient: Got no response from STUN server. Invalid address or no internet access.");
-			result.type = NatType::Blocked;
-			return result;
+	transaction.state = Transaction::Failed;
+	return true;
+}
+
+void StunClient::onProbeCompleted(Probe probe)
+{
+	Transaction const& transaction = m_probes[probe];
+	if (probe == PROBE_BIND && transaction.state == Transaction::Succeeded) {
+		Responce const& response = transaction.response;
+		m_result.whiteAddress = response.mappedAddr;
+		LOG(2, "StunClient: Got stun response. Local addr '%s', mapped addr '%s'. Alt server addr '%s'.", toString(m_result.grayAddress).c_str(),
+			toString(response.mappedAddr).c_str(), toString(response.otherAddr).c_str());
+		m_bindRtt = (size_t)(getTimeMs() - transaction.timer.start);
+		if (ready()) {
+			// warm start, the cached type stays until the probes tell otherwise
+			publish();
 		}
-		result.whiteAddress = response.mappedAddr;
+	}
 
-		NetAddress altServerAddr = response.otherAddr;
-		altServerAddr.setport(response.respOrigin.getport());
-		log(2, "StunClient: Got stun response. Local addr '%s', mapped addr '%s'. Alt server addr '%s'.", toString(result.grayAddress).c_str(),
-			toString(response.mappedAddr).c_str(), toString(response.otherAddr).c_str());
+	// A request to the alternative server opens address restricted filters for its answers, so it
+	// waits until the change address answer can't come anymore, otherwise such NAT looks full cone.
+	Transaction const& bind = m_probes[PROBE_BIND];
+	if (probe == PROBE_CHANGE_ADDRESS && transaction.state == Transaction::Failed && bind.state == Transaction::Succeeded
+		&& bind.response.otherAddr.getport() != 0 && m_result.grayAddress != m_result.whiteAddress) {
+		NetAddress altServerAddr = bind.response.otherAddr;
+		altServerAddr.setport(bind.response.respOrigin.getport());
+
+		// alternative server is usually the same machine, so its answer is expected in about the same time
+		size_t timeout = std::max<size_t>(SHORT_RETRY_TIMEOUT_MS, 2 * m_bindRtt);
+		sendProbe(PROBE_ALT_BIND, altServerAddr, timeout, false, false);
+		sendProbe(PROBE_ALT_PORT_BIND, bind.response.otherAddr, timeout, false, false);
+	}
 
-		if (result.grayAddress == result.whiteAddress) {
-			result.type = NatType::Open;
-			return result;
+	if (classify()) {
+		for (auto& pending : m_probes) {
+			if (pending.state == Transaction::Pending) {
+				pending.state = Transaction::Inactive;
+			}
 		}
+	}
+}
+
+// Walks the NAT type decision tree over the probes answered so far.
+// Returns true as soon as the answer can't be changed by the pending ones.
+bool StunClient::classify()
+{
+	auto const& bind = m_probes[PROBE_BIND];
+	auto const& changeAddress = m_probes[PROBE_CHANGE_ADDRESS];
+	auto const& changePort = m_probes[PROBE_CHANGE_PORT];
+	auto const& altBind = m_probes[PROBE_ALT_BIND];
+	auto const& altPortBind = m_probes[PROBE_ALT_PORT_BIND];
+
+	if (bind.state == Transaction::Pending) return false;
+	if (bind.state == Transaction::Failed) {
+		LOG(2, "StunClient: Got no response from STUN server. Invalid address or no internet access.");
+		finish(NatType::Blocked);
+		return true;
+	}
+
+	if (m_result.grayAddress == m_result.whiteAddress) {
+		finish(NatType::Open);
+		return true;
+	}
+
+	if (bind.response.otherAddr.getport() == 0) {
+		LOG(2, "StunClient: No alternative STUN server, can't detect NAT type.");
+		finish(NatType::Unknown);
+		return true;
+	}
+
+	if (changeAddress.state == Transaction::Pending) return false;
+	if (changeAddress.state == Transaction::Succeeded) {
+		LOG(2, "StunClient: Received response from changed server. Full cone NAT type.");
+		finish(NatType::FullCone);
+		return true;
+	}
+
+	if (altBind.state == Transaction::Pending) return false;
+	if (altBind.state == Transaction::Failed) {
+		LOG(2, "StunClient: Failed to get response from alternative server. Can't detect NAT type.");
+		finish(NatType::Unknown);
+		return true;
+	}
+
+	if (altBind.response.mappedAddr != m_result.whiteAddress) {
+		if (altPortBind.state == Transaction::Pending) return false;
+		LOG(2, "StunClient: Received response from alternative server with different mapping(%s != %s). Symmetric NAT type.",
+			toString(m_result.whiteAddress).c_str(), toString(altBind.response.mappedAddr).c_str());
+		// consecutive mappings show how the NAT allocates ports, peers use it for port prediction.
+		// The host's own traffic takes ports while the change address probe times out, so the first
+		// mapping is only a fallback.
+		NetAddress const& previous = (altPortBind.state == Transaction::Succeeded) ? altBind.response.mappedAddr : m_result.whiteAddress;
+		NetAddress const& next = (altPortBind.state == Transaction::Succeeded) ? altPortBind.response.mappedAddr : altBind.response.mappedAddr;
+		m_result.portDelta = next.getport() - previous.getport();
+		finish(NatType::Symmetric);
+		return true;
+	}
+
+	if (changePort.state == Transaction::Pending) return false;
+	if (changePort.state == Transaction::Succeeded) {
+		LOG(2, "StunClient: Received response from changed server on different port. Seems like address restricted NAT type.");
+		finish(NatType::AddressRestricted);
+	} else {
+		LOG(2, "StunClient: No response from changed server on different port. Seems like port restricted NAT type.");
+		finish(NatType::PortRestricted);
+	}
+	return true;
+}
+
+void StunClient::finish(NatType type)
+{
+	m_result.type = type;
+	m_stage = Stage::Done;
+	LOG(1, "StunClient: NAT type resolved in %llu ms (%s start).", (unsigned long long)(getTimeMs() - m_startTime), ready() ? "warm" : "cold");
+
+	bool changed = m_published.type != m_result.type || m_published.whiteAddress != m_result.whiteAddress || m_published.portDelta != m_result.portDelta;
+	if (!ready() || changed) {
+		publish();
+	}
+	if (m_result.type != NatType::Blocked) {
+		saveCache();
+	}
+}
+
+void StunClient::publish()
+{
+	m_published = m_result;
+	m_version += 1;
+}
+
+// Cache file holds one line per network: '<local address> <gateway address> <nat type> <white address> <port delta>'.
+bool StunClient::loadCache()
+{
+	if (m_cachePath.empty()) {
+		return false;
+	}
 
-		if (response.otherAddr.getport() == 0) {
-			log(2, "StunClient: No alternative STUN server, can't detect NAT type.");
-			result.type = NatType::Unknown;
-			return result;
+	FILE* file = NULL;
+	if (fopen_s(&file, m_cachePath.c_str(), "r") != 0) {
+		return false;
+	}
+
+	std::string local = toString(m_result.grayAddress);
+	std::string gateway = toString(m_gatewayAddress);
+
+	bool found = false;
+	char line[256];
+	while (!found && fgets(line, sizeof(line), file) != NULL) {
+		char localStr[32], gatewayStr[32];
+		unsigned b1, b2, b3, b4, port;
+		int type, portDelta = 0;
+		if (sscanf_s(line, "%31s %31s %d %u.%u.%u.%u:%u %d", localStr, (unsigned)sizeof(localStr), gatewayStr, (unsigned)sizeof(gatewayStr),
+				&type, &b1, &b2, &b3, &b4, &port, &portDelta) < 8) {
+			continue;
+		}
+		if (local != localStr || gateway != gatewayStr) {
+			continue;
 		}
 
-		if (sendBindRequest(socket, serverAddr, SHORT_RETRY_TIMEOUT_MS, true, true, response)) {
-			log(2, "StunClient: Received response from changed server. Full cone NAT type.");
-			result.type = NatType::FullCone;
-			return result;
+		m_result.type = (NatType)type;
+		m_result.whiteAddress = NetAddress::ipv4((uint8_t)b1, (uint8_t)b2, (uint8_t)b3, (uint8_t)b4, (uint16_t)port);
+		m_result.portDelta = portDelta;
+		found = true;
+	}
+	fclose(file);
+	return found;
+}
+
+void StunClient::saveCache()
+{
+	if (m_cachePath.empty()) {
+		return;
+	}
+
+	std::string local = toString(m_result.grayAddress);
+	std::string gateway = toString(m_gatewayAddress);
+
+	// keep entries of other networks
+	std::vector<std::string> lines;
+	FILE* file = NULL;
+	if (fopen_s(&file, m_cachePath.c_str(), "r") == 0) {
+		char line[256];
+		while (fgets(line, sizeof(line), file) != NULL) {
+			char localStr[32], gatewayStr[32];
+			if (sscanf_s(line, "%31s %31s", localStr, (unsigned)sizeof(localStr), gatewayStr, (unsigned)sizeof(gatewayStr)) == 2 && (local != localStr || gateway != gatewayStr)) {
+				lines.emplace_back(line);
+			}
 		}
+		fclose(file);
+	}
 
-		if (sendBindRequest(socket, serverAddr, SHORT_RETRY_TIMEOUT_MS, false, true, response)) {
-			log(2, "StunClient: Received response from changed server on different port. Seems like address restricted NAT type.");
-			result.type = NatType::AddressRestricted;
-		} else {
-			log(2, "StunClient: No response from changed server on different port. Seems like port restricted NAT type.");
-			result.type = NatType::PortRestricted;
+	if (fopen_s(&file, m_cachePath.c_str(), "w") != 0) {
+		LOG(2, "StunClient: Failed to write NAT info cache '%s'.", m_cachePath.c_str());
+		return;
+	}
+	for (auto& line : lines) {
+		fputs(line.c_str(), file);
+	}
+	fprintf(file, "%s %s %d %s %d\n", local.c_str(), gateway.c_str(), (int)m_result.type, toString(m_result.whiteAddress).c_str(), m_result.portDelta);
+	fclose(file);
+}
+
+
+NatLifetimeProbe::NatLifetimeProbe()
+	: m_stage(Stage::Mapping), m_retries(0), m_interval(0), m_alive(0), m_expired(0), m_done(false)
+{
+}
+
+void NatLifetimeProbe::start(Socket const& socket, NetAddress const& serverAddr)
+{
+	for (std::unique_ptr<Socket>* probeSocket : { &m_socket, &m_tester }) {
+		probeSocket->reset(socket.backend != nullptr ? new Socket(socket.backend->open()) : new Socket());
+		if (!(*probeSocket)->valid() || !(*probeSocket)->bind(NetAddress::any(0))) {
+			LOG(2, "NatLifetimeProbe: Failed to create secondary socket.");
+			finish();
+			return;
 		}
+	}
 
-		if (!sendBindRequest(socket, altServerAddr, LONG_RETRY_TIMEOUT_MS, false, false, response)) {
-			log(2, "StunClient: Failed to get response from alternative server. Can't detect NAT type.");
-			result.type = NatType::Unknown;
-			return result;
+	LOG(2, "NatLifetimeProbe: Start measuring NAT mapping lifetime with '%s'.", toString(serverAddr).c_str());
+	m_serverAddr = serverAddr;
+	m_interval = 0;
+	m_alive = 0;
+	m_expired = 0;
+	m_done = false;
+	sendMapping();
+}
+
+void NatLifetimeProbe::update()
+{
+	if (!active()) {
+		return;
+	}
+
+	NetAddress src;
+	int count = 0;
+	while ((count = m_socket->recvfrom(m_recvBuffer, sizeof(m_recvBuffer), 0, src)) > 0) {
+		StunClient::Responce response;
+		response.mappedAddr = NetAddress::any(0);
+		if (m_stage != Stage::Idle && StunClient::parseResponse(CBytes(m_recvBuffer, m_recvBuffer + count), m_transactionId, response)) {
+			if (m_stage == Stage::Mapping) {
+				onMapped(response.mappedAddr);
+			} else {
+				onTested(true);
+			}
+			return;
 		}
+	}
+	while ((count = m_tester->recvfrom(m_recvBuffer, sizeof(m_recvBuffer), 0, src)) > 0) {
+		if (m_stage == Stage::Testing && isTransaction(CBytes(m_recvBuffer, m_recvBuffer + count), m_transactionId)) {
+			LOG(2, "NatLifetimeProbe: STUN server '%s' doesn't support RESPONSE-PORT.", toString(m_serverAddr).c_str());
+			m_alive = 0;
+			m_expired = 0;
+			finish();
+			return;
+		}
+	}
 
-		if (response.mappedAddr != result.whiteAddress) {
-			log(2, "StunClient: Received response from alternative server with different mapping(%s != %s). Symmetric NAT type.",
-				toString(result.whiteAddress).c_str(), toString(response.mappedAddr).c_str());
-			result.type = NatType::Symmetric;
+	if (!m_timer.expired()) {
+		return;
+	}
+
+	if (m_stage == Stage::Idle) {
+		sendTest();
+		return;
+	}
+
+	m_retries += 1;
+	if (m_retries < StunClient::MAX_RETRIES) {
+		send();
+		m_timer.reset();
+	} else if (m_stage == Stage::Testing) {
+		onTested(false);
+	} else {
+		LOG(2, "NatLifetimeProbe: STUN server stopped responding.");
+		finish();
+	}
+}
+
+void NatLifetimeProbe::send()
+{
+	if (m_stage == Stage::Mapping) {
+		Message::BindRequest msgBindRequest(m_transactionId, false, false);
+		msgBindRequest.toNetEndian();
+		m_socket->sendto(m_serverAddr, &msgBindRequest, sizeof(msgBindRequest), 0);
+	} else {
+		Message::PortRequest msgPortRequest(m_transactionId, m_mappedAddr.getport());
+		msgPortRequest.toNetEndian();
+		m_tester->sendto(m_serverAddr, &msgPortRequest, sizeof(msgPortRequest), 0);
+	}
+}
+
+void NatLifetimeProbe::sendMapping()
+{
+	genRandomString(m_transactionId, sizeof(m_transactionId));
+	m_stage = Stage::Mapping;
+	m_retries = 0;
+	m_timer = Timer(StunClient::LONG_RETRY_TIMEOUT_MS);
+	send();
+}
+
+void NatLifetimeProbe::sendTest()
+{
+	// the answer goes to the mapping under test from the server it was opened to, so it passes
+	// any filtering while the mapping exists, and traffic of the tester doesn't refresh it
+	genRandomString(m_transactionId, sizeof(m_transactionId));
+	m_stage = Stage::Testing;
+	m_retries = 0;
+	m_timer = Timer(StunClient::LONG_RETRY_TIMEOUT_MS);
+	send();
+}
+
+void NatLifetimeProbe::onMapped(NetAddress const& mappedAddr)
+{
+	m_mappedAddr = mappedAddr;
+
+	size_t next = 0;
+	if (m_expired == 0) {
+		next = (m_interval == 0) ? MIN_INTERVAL_MS : m_interval * 2;
+		if (next > MAX_INTERVAL_MS) {
+			finish();
+			return;
+		}
+	} else if (m_alive == 0) {
+		// didn't survive even the first interval, keep halving it
+		next = m_expired / 2;
+		if (next < SHORTEST_INTERVAL_MS) {
+			finish();
+			return;
 		}
-		return result;
+	} else {
+		if (m_expired - m_alive <= RESOLUTION_MS) {
+			finish();
+			return;
+		}
+		next = (m_alive + m_expired) / 2;
+	}
+
+	m_interval = next;
+	m_stage = Stage::Idle;
+	m_timer = Timer(next);
+}
+
+void NatLifetimeProbe::onTested(bool alive)
+{
+	if (alive) {
+		m_alive = m_interval;
+	} else {
+		LOG(2, "NatLifetimeProbe: Mapping '%s' expired after %u ms idle.", toString(m_mappedAddr).c_str(), (unsigned)m_interval);
+		m_expired = m_interval;
+	}
+
+	// every interval starts with a fresh request, it refreshes the mapping or opens a new one
+	sendMapping();
+}
+
+void NatLifetimeProbe::finish()
+{
+	if (m_alive != 0 || m_expired != 0) {
+		LOG(1, "NatLifetimeProbe: NAT mapping survives %u ms idle%s.", (unsigned)m_alive, m_expired == 0 ? " or longer" : "");
 	}
+	m_done = true;
+	m_socket.reset();
+	m_tester.reset();
+}
 
-} // namespace StunClient
\ No newline at end of file
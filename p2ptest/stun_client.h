@@ -2,6 +2,11 @@
 
 #include "socket.h"
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
 enum class NatType {
 	Unknown,
 	Open,
@@ -12,18 +17,188 @@ enum class NatType {
 	Blocked,
 };
 
-namespace StunClient {
+class StunClient {
+public:
 	const static int MAX_RETRIES = 3;
 	const static int LONG_RETRY_TIMEOUT_MS = 1000;
 	const static int SHORT_RETRY_TIMEOUT_MS = 100;
+	const static int TRANSACTION_ID_SIZE = 12;
+	const static int DEFAULT_PORT = 3478;
 
 	struct Result {
 		NatType type;
 		NetAddress grayAddress;
 		NetAddress whiteAddress;
+		int portDelta; // port allocation step of symmetric NAT, 0 if unknown
+	};
+
+public:
+	StunClient();
+
+	// Starts NAT type resolution, the socket is only used for sending.
+	// Responses have to be routed back through 'onResponse' by the socket owner.
+	// Bind requests are raced against all 'servers' ("host[ port]"), the first one answered is used
+	// for classification. If 'cachePath' holds a result for the current network it's published at once
+	// and only revalidated in background.
+	void start(Socket const& socket, std::vector<std::string> const& servers, char const* cachePath);
+	void update();
+
+	// Returns false if the message doesn't belong to any active transaction.
+	bool onResponse(NetAddress const& src, CBytes bytes);
+	static bool isStunMessage(CBytes bytes);
+
+	bool active() const { return m_stage != Stage::Idle && m_stage != Stage::Done; }
+	bool ready() const { return m_version != 0; }
+	// True once a bind request of this run is answered. A cached white address is replaced with the
+	// mapped one at that point, it may belong to a mapping which is gone.
+	bool mapped() const { return m_probes[PROBE_BIND].state == Transaction::Succeeded; }
+
+	// Incremented every time a new result is published.
+	uint32_t version() const { return m_version; }
+	Result const& result() const { return m_published; }
+	NetAddress const& serverAddress() const { return m_serverAddr; }
+
+private:
+	enum class Stage { Idle, Racing, Probing, Done };
+	// PROBE_ALT_PORT_BIND follows PROBE_ALT_BIND at once, their mappings are consecutive for sure
+	enum Probe { PROBE_BIND, PROBE_CHANGE_ADDRESS, PROBE_CHANGE_PORT, PROBE_ALT_BIND, PROBE_ALT_PORT_BIND, PROBE_COUNT };
+
+	struct Responce {
+		NetAddress mappedAddr;
+		NetAddress otherAddr;
+		NetAddress respOrigin;
+	};
+
+	struct Transaction {
+		enum State { Inactive, Pending, Succeeded, Failed } state;
+		char id[TRANSACTION_ID_SIZE];
+		NetAddress server;
+		bool changeIp;
+		bool changePort;
+		int retries;
+		Timer timer;
+		Responce response;
+	};
+
+	// Shared with the detached resolver thread, a slow lookup blocks neither 'start' nor the destructor.
+	struct Resolving {
+		std::atomic<bool> done{ false };
+		NetAddress address;
+	};
+
+	struct Server {
+		std::string url;
+		std::shared_ptr<Resolving> resolving;   // null once the address is taken
+		Transaction bind;
 	};
 
-	Result resolve(Socket const& socket);
-	Result resolve(Socket const& socket, NetAddress const& serverAddr);
+private:
+	Socket const* m_socket;
+	Stage m_stage;
+	Result m_result;
+	Transaction m_probes[PROBE_COUNT];
+	NetAddress m_serverAddr;
+	uint64_t m_startTime;
+	size_t m_bindRtt;
+
+	std::vector<Server> m_servers;
+	std::string m_cachePath;
+	NetAddress m_gatewayAddress;
+	Result m_published;
+	uint32_t m_version;
+
+private:
+	static bool parseResponse(CBytes bytes, char const* transactionId, Responce& outResponse);
+
+	void sendProbe(Probe probe, NetAddress const& serverAddr, size_t timeout, bool changeIp, bool changePort);
+	void send(Transaction& transaction, NetAddress const& serverAddr, size_t timeout, bool changeIp, bool changePort);
+	void resend(Transaction& transaction);
+	bool expired(Transaction& transaction);
+
+	void updateRace();
+	void onRaceWon(Server& server);
+
+	void onProbeCompleted(Probe probe);
+	bool classify();
+	void finish(NatType type);
+	void publish();
 
-} // namespace StunClient
\ No newline at end of file
+	bool loadCache();
+	void saveCache();
+
+	friend class NatLifetimeProbe;
+};
+
+
+// Compact NAT description exchanged by peers, lets the other side predict our mappings.
+struct NatHint {
+	uint8_t type;
+	uint8_t reserved;
+	net_uint16_t portDelta;
+
+public:
+	NatHint() : type((uint8_t)NatType::Unknown), reserved(0) {}
+	NatHint(StunClient::Result const& result) : type((uint8_t)result.type), reserved(0), portDelta((uint16_t)result.portDelta) {}
+
+	NatType natType() const { return (NatType)type; }
+	int delta() const { return (int16_t)portDelta.get(); }
+};
+
+
+// Measures how long NAT keeps an idle UDP mapping (RFC 5780 binding lifetime discovery). A secondary
+// socket gets a mapping from the STUN server and stays silent for a while, then a tester socket asks
+// the server to answer to that mapping (RESPONSE-PORT): a lost answer means the mapping has expired.
+// Idle intervals grow exponentially, then get bisected between the last survived and the first expired one.
+class NatLifetimeProbe {
+public:
+	const static int MIN_INTERVAL_MS = 5000;
+	const static int MAX_INTERVAL_MS = 320000;
+	const static int RESOLUTION_MS = 5000;
+	const static int SHORTEST_INTERVAL_MS = 1000;   // mappings expiring before that aren't resolved any further
+
+public:
+	NatLifetimeProbe();
+
+	// The secondary sockets are of the same kind as 'socket'.
+	void start(Socket const& socket, NetAddress const& serverAddr);
+	void update();
+	// Time the probe next has something to send, ms. Responses are picked up by any earlier 'update'.
+	uint64_t deadline() const { return m_timer.start + m_timer.duration; }
+
+	bool active() const { return m_socket != nullptr; }
+	bool ready() const { return m_done; }
+
+	// Longest idle interval the mapping has survived, ms.
+	size_t lifetime() const { return m_alive; }
+	// Shortest idle interval the mapping hasn't survived, ms, 0 if it survived all of them.
+	// Both are 0 if the server can't answer to another port.
+	size_t expiredAfter() const { return m_expired; }
+
+private:
+	enum class Stage { Mapping, Idle, Testing };
+
+	std::unique_ptr<Socket> m_socket;
+	std::unique_ptr<Socket> m_tester;
+	NetAddress m_serverAddr;
+	NetAddress m_mappedAddr;
+	char m_transactionId[StunClient::TRANSACTION_ID_SIZE];
+
+	Stage m_stage;
+	Timer m_timer;
+	int m_retries;
+
+	size_t m_interval;
+	size_t m_alive;
+	size_t m_expired;
+	bool m_done;
+
+	uint8_t m_recvBuffer[512];
+
+private:
+	void send();
+	void sendMapping();
+	void sendTest();
+	void onMapped(NetAddress const& mappedAddr);
+	void onTested(bool alive);
+	void finish();
+};
@@ -3,6 +3,13 @@
 #include <thread>
 #include <algorithm>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
 
 uint32_t memhash(void const* mem, int length)
 {
@@ -23,6 +30,37 @@ uint32_t memhash(void const* mem, int length)
 }
 
 
+// ------------------------------------------------------------------------
+// PoolBitmap implementation
+// ------------------------------------------------------------------------
+void PoolBitmap::set(uint32_t index)
+{
+	if (index / 64 >= m_words.size()) {
+		m_words.resize(index / 64 + 1, 0);
+	}
+	m_words[index / 64] |= 1ull << (index % 64);
+}
+
+// ------------------------------------------------------------------------
+uint32_t PoolBitmap::next(uint32_t index) const
+{
+	size_t word = index / 64;
+	if (word >= m_words.size()) {
+		return NONE;
+	}
+
+	// bits below 'index' are masked out in the first word, dead words are skipped whole
+	uint64_t bits = m_words[word] & (~0ull << (index % 64));
+	while (bits == 0) {
+		if (++word == m_words.size()) {
+			return NONE;
+		}
+		bits = m_words[word];
+	}
+	return (uint32_t)(word * 64 + countTrailingZeros(bits));
+}
+
+
 int bytecopy(Bytes dest, CBytes src)
 {
 	int copied = (int)std::min(dest.size(), src.size());
@@ -31,10 +69,132 @@ int bytecopy(Bytes dest, CBytes src)
 }
 
 
+// ------------------------------------------------------------------------
+// Clock implementation
+// ------------------------------------------------------------------------
+namespace {
+	thread_local uint64_t t_tickUs = 0;
+
+	struct TscSource {
+		bool enabled;
+		uint64_t baseTsc;
+		uint64_t baseUs;
+		double usPerTick;
+		double nsPerTick;
+	} s_tsc = { false, 0, 0, 0.0, 0.0 };
+
+	struct SimulatedSource {
+		bool enabled;
+		std::atomic<uint64_t> nowUs;
+	} s_simulated = { false, { 0 } };
+
+	uint64_t steadyUs()
+	{
+		auto t = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+	}
+
+	uint64_t steadyNs()
+	{
+		auto t = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+	}
+
+	// TSC ticking at a constant rate regardless of power states, CPUID.80000007H:EDX[8]
+	bool hasInvariantTsc()
+	{
+#ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 0x80000000);
+		if ((unsigned)regs[0] < 0x80000007) return false;
+		__cpuid(regs, 0x80000007);
+		return (regs[3] & (1 << 8)) != 0;
+#else
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+		return (edx & (1 << 8)) != 0;
+#endif
+	}
+}
+
+// ------------------------------------------------------------------------
+void Clock::tick()
+{
+	t_tickUs = preciseUs();
+}
+
+// ------------------------------------------------------------------------
+uint64_t Clock::nowUs()
+{
+	return t_tickUs != 0 ? t_tickUs : preciseUs();
+}
+
+// ------------------------------------------------------------------------
+uint64_t Clock::preciseUs()
+{
+	if (s_simulated.enabled) {
+		return s_simulated.nowUs.load(std::memory_order_relaxed);
+	}
+	if (s_tsc.enabled) {
+		return s_tsc.baseUs + (uint64_t)((__rdtsc() - s_tsc.baseTsc) * s_tsc.usPerTick);
+	}
+	return steadyUs();
+}
+
+// ------------------------------------------------------------------------
+uint64_t Clock::preciseNs()
+{
+	if (s_simulated.enabled) {
+		return s_simulated.nowUs.load(std::memory_order_relaxed) * 1000;
+	}
+	if (s_tsc.enabled) {
+		return s_tsc.baseUs * 1000 + (uint64_t)((__rdtsc() - s_tsc.baseTsc) * s_tsc.nsPerTick);
+	}
+	return steadyNs();
+}
+
+// ------------------------------------------------------------------------
+bool Clock::calibrateTsc(size_t sampleMs)
+{
+	if (!hasInvariantTsc()) {
+		return false;
+	}
+
+	uint64_t startUs = steadyUs();
+	uint64_t startTsc = __rdtsc();
+	sleep(sampleMs);
+	uint64_t endUs = steadyUs();
+	uint64_t endTsc = __rdtsc();
+	if (endTsc <= startTsc || endUs <= startUs) {
+		return false;
+	}
+
+	// continue from the steady clock reading, so the time doesn't jump when the source changes
+	s_tsc.usPerTick = (double)(endUs - startUs) / (double)(endTsc - startTsc);
+	s_tsc.nsPerTick = s_tsc.usPerTick * 1000.0;
+	s_tsc.baseTsc = endTsc;
+	s_tsc.baseUs = endUs;
+	s_tsc.enabled = true;
+	return true;
+}
+
+// ------------------------------------------------------------------------
+void Clock::useSimulated(uint64_t startUs)
+{
+	s_simulated.nowUs.store(startUs, std::memory_order_relaxed);
+	s_simulated.enabled = true;
+}
+
+void Clock::setSimulated(uint64_t us)
+{
+	ASSERT(s_simulated.enabled);
+	s_simulated.nowUs.store(us, std::memory_order_relaxed);
+}
+
+// ------------------------------------------------------------------------
 uint64_t getTimeMs()
 {
-	auto t = std::chrono::high_resolution_clock::now();
-	return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+	return Clock::nowMs();
 }
 
 void usleep(size_t time)
@@ -45,4 +205,140 @@ void usleep(size_t time)
 void sleep(size_t time)
 {
 	std::this_thread::sleep_for(std::chrono::milliseconds(time));
-}
\ No newline at end of file
+}
+
+// ------------------------------------------------------------------------
+// TimerWheel implementation
+// ------------------------------------------------------------------------
+static uint64_t rotateRight(uint64_t value, int shift)
+{
+	return (value >> shift) | (value << ((TimerWheel::SLOTS - shift) & (TimerWheel::SLOTS - 1)));
+}
+
+// ------------------------------------------------------------------------
+TimerWheel::TimerWheel(uint64_t now) : m_now(now)
+{
+	memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+// ------------------------------------------------------------------------
+TimerWheel::Handle TimerWheel::schedule(size_t delay, Callback callback)
+{
+	// zero delay would land into the slot being fired and could spin forever
+	Handle handle = m_nodes.alloc();
+	Node& node = m_nodes.at(handle);
+	node.deadline = m_now + std::max<size_t>(delay, 1);
+	node.callback = std::move(callback);
+	link(handle, node);
+	return handle;
+}
+
+// ------------------------------------------------------------------------
+bool TimerWheel::cancel(Handle& handle)
+{
+	Node* node = m_nodes[handle];
+	if (node == nullptr) {
+		handle = Handle();
+		return false;
+	}
+
+	unlink(*node);
+	m_nodes.dealloc(handle);
+	handle = Handle();
+	return true;
+}
+
+// ------------------------------------------------------------------------
+void TimerWheel::advance(uint64_t now)
+{
+	while (m_now < now) {
+		// jump straight to the next non-empty slot, nothing happens in between
+		uint64_t tick = std::min(nextDeadline(), now);
+		m_now = tick;
+
+		for (int level = LEVELS - 1; level > 0; --level) {
+			int shift = SLOT_BITS * level;
+			if ((tick & ((1ull << shift) - 1)) == 0) {
+				cascade(level, (int)(tick >> shift) & (SLOTS - 1));
+			}
+		}
+
+		Handle& head = m_slots[0][tick & (SLOTS - 1)];
+		while (head.isValid()) {
+			Handle handle = head;
+			Node& node = m_nodes.at(handle);
+			unlink(node);
+
+			Callback callback = std::move(node.callback);
+			m_nodes.dealloc(handle);
+			callback();
+		}
+	}
+}
+
+// ------------------------------------------------------------------------
+uint64_t TimerWheel::nextDeadline() const
+{
+	uint64_t deadline = UINT64_MAX;
+	for (int level = 0; level < LEVELS; ++level) {
+		if (m_occupied[level] == 0) continue;
+
+		// slots are scanned starting from the one after current, the last one wraps to the next round
+		int shift = SLOT_BITS * level;
+		uint64_t granule = (m_now >> shift) + 1;
+		uint64_t occupied = rotateRight(m_occupied[level], (int)(granule & (SLOTS - 1)));
+		deadline = std::min(deadline, (granule + countTrailingZeros(occupied)) << shift);
+	}
+	return deadline;
+}
+
+// ------------------------------------------------------------------------
+void TimerWheel::link(Handle handle, Node& node)
+{
+	const uint64_t maxDelta = (1ull << (SLOT_BITS * LEVELS)) - 1;
+
+	// already expired timers are only linked while cascading, they go to the slot being fired
+	uint64_t delta = std::min(node.deadline > m_now ? node.deadline - m_now : 0, maxDelta);
+	int level = 0;
+	while (level < LEVELS - 1 && (delta >> (SLOT_BITS * (level + 1))) != 0) {
+		level += 1;
+	}
+
+	node.level = (uint8_t)level;
+	node.slot = (uint8_t)(((m_now + delta) >> (SLOT_BITS * level)) & (SLOTS - 1));
+	node.prev = Handle();
+	node.next = m_slots[level][node.slot];
+	if (node.next.isValid()) {
+		m_nodes.at(node.next).prev = handle;
+	}
+	m_slots[level][node.slot] = handle;
+	m_occupied[level] |= 1ull << node.slot;
+}
+
+// ------------------------------------------------------------------------
+void TimerWheel::unlink(Node& node)
+{
+	if (node.prev.isValid()) {
+		m_nodes.at(node.prev).next = node.next;
+	} else {
+		m_slots[node.level][node.slot] = node.next;
+	}
+	if (node.next.isValid()) {
+		m_nodes.at(node.next).prev = node.prev;
+	}
+	if (!m_slots[node.level][node.slot].isValid()) {
+		m_occupied[node.level] &= ~(1ull << node.slot);
+	}
+}
+
+// ------------------------------------------------------------------------
+void TimerWheel::cascade(int level, int slot)
+{
+	// timers of the slot are less than one slot span away now, all of them move to lower levels
+	while (m_slots[level][slot].isValid()) {
+		Handle handle = m_slots[level][slot];
+		Node& node = m_nodes.at(handle);
+		unlink(node);
+		link(handle, node);
+	}
+}
@@ -2,8 +2,18 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <assert.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define ASSERT assert
 #define ASSERT_MSG(COND, ...) assert(COND)
 
@@ -43,6 +53,134 @@ CBytes toBytes(Array<T const> const& array) { return Bytes((uint8_t const*)array
 int bytecopy(Bytes dest, CBytes src);
 
 
+// Inline storage for up to N trivially copyable values, never allocates.
+template <class T, size_t N>
+class FixedArray {
+public:
+	FixedArray() : m_count(0) {}
+
+	// Values which don't fit are dropped.
+	FixedArray(Array<T const> values) : m_count(0) {
+		for (size_t i = 0; i < values.count() && m_count < N; ++i) {
+			m_items[m_count++] = values[i];
+		}
+	}
+
+	bool push_back(T const& value) {
+		if (m_count == N) return false;
+		m_items[m_count++] = value;
+		return true;
+	}
+	bool push_back(T&& value) {
+		if (m_count == N) return false;
+		m_items[m_count++] = std::move(value);
+		return true;
+	}
+	void clear() { m_count = 0; }
+
+	T& operator[](size_t idx) { ASSERT(idx < m_count); return m_items[idx]; }
+	T const& operator[](size_t idx) const { ASSERT(idx < m_count); return m_items[idx]; }
+
+	T* begin() { return m_items; }
+	T* end() { return m_items + m_count; }
+	T const* begin() const { return m_items; }
+	T const* end() const { return m_items + m_count; }
+
+	size_t count() const { return m_count; }
+	bool empty() const { return m_count == 0; }
+	static size_t capacity() { return N; }
+
+	operator Array<T const>() const { return Array<T const>(m_items, m_items + m_count); }
+
+private:
+	T m_items[N];
+	size_t m_count;
+};
+
+
+// Move-only replacement of std::function keeping the callable inline. Callables bigger than
+// Capacity are rejected at compile time instead of going to the heap.
+template <class Signature, size_t Capacity = 4 * sizeof(void*)>
+class Callback;
+
+template <class R, class... Args, size_t Capacity>
+class Callback<R(Args...), Capacity> {
+public:
+	Callback() noexcept : m_ops(nullptr) {}
+	Callback(std::nullptr_t) noexcept : m_ops(nullptr) {}
+
+	template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Callback>::value>::type>
+	Callback(F&& func) {
+		using Fn = typename std::decay<F>::type;
+		static_assert(sizeof(Fn) <= Capacity, "Callable doesn't fit into Callback storage");
+		static_assert(alignof(Fn) <= alignof(Storage), "Callable is overaligned for Callback storage");
+
+		new(&m_storage) Fn(std::forward<F>(func));
+		m_ops = &Ops<Fn>::table();
+	}
+
+	Callback(Callback&& other) noexcept : m_ops(other.m_ops) {
+		if (m_ops) {
+			m_ops->move(&m_storage, &other.m_storage);
+			other.m_ops = nullptr;
+		}
+	}
+	Callback& operator=(Callback&& other) noexcept {
+		if (this != &other) {
+			reset();
+			if (other.m_ops) {
+				other.m_ops->move(&m_storage, &other.m_storage);
+				m_ops = other.m_ops;
+				other.m_ops = nullptr;
+			}
+		}
+		return *this;
+	}
+	Callback& operator=(std::nullptr_t) noexcept { reset(); return *this; }
+
+	Callback(Callback const&) = delete;
+	Callback& operator=(Callback const&) = delete;
+
+	~Callback() { reset(); }
+
+	explicit operator bool() const noexcept { return m_ops != nullptr; }
+
+	R operator()(Args... args) const {
+		ASSERT(m_ops != nullptr);
+		return m_ops->invoke(&m_storage, std::forward<Args>(args)...);
+	}
+
+	void reset() noexcept {
+		if (m_ops) {
+			m_ops->destroy(&m_storage);
+			m_ops = nullptr;
+		}
+	}
+
+private:
+	using Storage = typename std::aligned_storage<Capacity, alignof(void*)>::type;
+
+	struct VTable {
+		R(*invoke)(void* storage, Args&&... args);
+		void(*move)(void* dst, void* src);   // destroys source
+		void(*destroy)(void* storage);
+	};
+
+	template <class Fn>
+	struct Ops {
+		static R invoke(void* storage, Args&&... args) { return (*static_cast<Fn*>(storage))(std::forward<Args>(args)...); }
+		static void move(void* dst, void* src) { new(dst) Fn(std::move(*static_cast<Fn*>(src))); static_cast<Fn*>(src)->~Fn(); }
+		static void destroy(void* storage) { static_cast<Fn*>(storage)->~Fn(); }
+
+		static VTable const& table() { static const VTable ops = { &invoke, &move, &destroy }; return ops; }
+	};
+
+private:
+	mutable Storage m_storage;
+	VTable const* m_ops;
+};
+
+
 struct String : CBytes {
 
 };
@@ -50,9 +188,63 @@ struct String : CBytes {
 inline std::string toString(CBytes bytes) { return std::string(bytes.begin, bytes.end); }
 
 
-struct Buffer : Bytes {
-	Buffer(size_t size) noexcept : Bytes((uint8_t*)malloc(size), nullptr) { end = begin + size; }
-	~Buffer() { free(begin); }
+// Index of the lowest set bit, value must not be zero.
+inline int countTrailingZeros(uint64_t value)
+{
+	ASSERT(value != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (uint32_t)value)) {
+		return (int)index;
+	}
+	_BitScanForward(&index, (uint32_t)(value >> 32));
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+// Index of the highest set bit, value must not be zero.
+inline int highestBit(uint64_t value)
+{
+	ASSERT(value != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanReverse(&index, (uint32_t)(value >> 32))) {
+		return (int)index + 32;
+	}
+	_BitScanReverse(&index, (uint32_t)value);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+
+// One bit per pool slot, set for the live ones. Lets iteration skip 64 dead slots at once.
+class PoolBitmap {
+public:
+	static const uint32_t NONE = UINT32_MAX;
+
+public:
+	void set(uint32_t index);
+	void reset(uint32_t index) { m_words[index / 64] &= ~(1ull << (index % 64)); }
+	bool test(uint32_t index) const { return index / 64 < m_words.size() && (m_words[index / 64] & (1ull << (index % 64))) != 0; }
+	void clear() { m_words.clear(); }
+
+	// First live slot at or after 'index', NONE if there are no more.
+	uint32_t next(uint32_t index) const;
+
+private:
+	std::vector<uint64_t> m_words;
 };
 
 
@@ -79,7 +271,7 @@ public:
 template <class T>
 struct PoolCell {
 	uint32_t nonce = 0;
-	char data[sizeof(T)];
+	alignas(T) char data[sizeof(T)];
 
 public:
 	PoolCell() = default;
@@ -109,32 +301,86 @@ public:
 	T& operator*() const { ASSERT(handle.nonce != 0); return *value; }
 };
 
-template <class T, class CellTy>
+// Visits live elements only. Elements may be destroyed while iterating, the storage is looked up on
+// every access, so it may grow as well.
+template <class T, class CellTy, class StorageTy>
 class PoolIterator {
 public:
-	PoolIterator(CellTy* begin, uint32_t index) : m_cell(begin), m_index(index) {}
+	PoolIterator(StorageTy const* storage, PoolBitmap const* bitmap, uint32_t index)
+		: m_storage(storage), m_bitmap(bitmap), m_index(bitmap->next(index)) {}
+	PoolIterator(StorageTy const* storage, PoolBitmap const* bitmap)
+		: m_storage(storage), m_bitmap(bitmap), m_index(PoolBitmap::NONE) {}
 
-	PoolIterator& operator++() { ++m_cell; ++m_index; return *this; }
+	PoolIterator& operator++() { m_index = m_bitmap->next(m_index + 1); return *this; }
 
-	PoolValue<const T> operator*() const { return PoolValue<const T>{ handle(), m_cell->get() }; }
-	PoolValue<T>       operator*() { return PoolValue<T>{ handle(), m_cell->get() }; }
+	PoolValue<const T> operator*() const { return PoolValue<const T>{ handle(), cell().get() }; }
+	PoolValue<T>       operator*() { return PoolValue<T>{ handle(), cell().get() }; }
 
-	bool operator==(PoolIterator const& other) const { return m_cell != other.m_cell; }
-	bool operator!=(PoolIterator const& other) const { return m_cell != other.m_cell; }
+	bool operator==(PoolIterator const& other) const { return m_index == other.m_index; }
+	bool operator!=(PoolIterator const& other) const { return m_index != other.m_index; }
 
-	T&         value()  const { ASSERT(m_cell->isValid()); return *m_cell->get(); }
-	PoolHandle handle() const { return PoolHandle{ m_index, m_cell->nonce }; }
+	T&         value()  const { ASSERT(cell().isValid()); return *cell().get(); }
+	PoolHandle handle() const { return PoolHandle{ m_index, cell().nonce }; }
 
 private:
-	CellTy* m_cell;
+	StorageTy const* m_storage;
+	PoolBitmap const* m_bitmap;
 	uint32_t m_index;
+
+private:
+	CellTy const& cell() const { return (*m_storage)[m_index]; }
 };
 
-template <class T>
+// Cells in fixed-size blocks which are never moved or copied, element addresses stay stable
+// for the whole element lifetime. Growth allocates one block at most.
+template <class CellTy>
+class PoolChunks {
+public:
+	static const uint32_t CHUNK_BITS = 6;
+	static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+
+public:
+	PoolChunks() = default;
+	PoolChunks(PoolChunks&& other) noexcept : m_chunks(std::move(other.m_chunks)), m_size(other.m_size) { other.m_size = 0; }
+	PoolChunks& operator=(PoolChunks&& other) noexcept { std::swap(m_chunks, other.m_chunks); std::swap(m_size, other.m_size); return *this; }
+
+	CellTy& operator[](size_t index) const { return m_chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)]; }
+	size_t size() const { return m_size; }
+
+	// Appends a cell, returns its index.
+	uint32_t grow();
+	void reserve(size_t n);
+	void clear() { m_chunks.clear(); m_size = 0; }
+
+private:
+	std::vector<std::unique_ptr<CellTy[]>> m_chunks;
+	size_t m_size = 0;
+};
+
+// Cells in one vector: lookups and full scans touch less memory than with chunks, but growth
+// reallocates and moves every live element, so addresses are only stable until the next 'alloc'.
+template <class CellTy>
+class PoolVector {
+public:
+	CellTy& operator[](size_t index) const { return m_cells[index]; }
+	size_t size() const { return m_cells.size(); }
+
+	// Appends a cell, returns its index.
+	uint32_t grow() { m_cells.emplace_back(); return (uint32_t)(m_cells.size() - 1); }
+	void reserve(size_t n) { m_cells.reserve(n); }
+	void clear() { m_cells.clear(); }
+
+private:
+	mutable std::vector<CellTy> m_cells;
+};
+
+// Storage is PoolChunks unless given: element addresses stay valid while other elements come and go.
+template <class T, template <class> class StorageTy = PoolChunks>
 class Pool {
 	struct Cell : public PoolCell<T> {
 		uint32_t next;
 	public:
+		Cell() : next(UINT_MAX) {}
 		Cell(uint32_t next) : next(next) {}
 
 		template <class... ArgsTy>
@@ -143,7 +389,7 @@ class Pool {
 	};
 
 public:
-	using Iterator = PoolIterator<T, Cell>;
+	using Iterator = PoolIterator<T, Cell, StorageTy<Cell>>;
 
 public:
 	Pool() = default;
@@ -157,12 +403,12 @@ public:
 	T& at(PoolHandle idx) const;
 
 	void reserve(size_t n) { m_storage.reserve(n); }
-	void clear() { m_head = UINT_MAX; m_storage.clear(); }
+	void clear() { m_head = UINT_MAX; m_count = 0; m_storage.clear(); m_occupied.clear(); }
 
 	size_t count() const { return m_count; }
 
-	Iterator begin() const { return Iterator(m_storage.data(), 0); }
-	Iterator end() const { return Iterator(m_storage.data() + m_storage.size(), -1); }
+	Iterator begin() const { return Iterator(&m_storage, &m_occupied, 0); }
+	Iterator end() const { return Iterator(&m_storage, &m_occupied); }
 
 	template <class... ArgsTy>
 	PoolHandle alloc(ArgsTy&&... args);
@@ -171,7 +417,8 @@ public:
 	bool check();
 
 private:
-	mutable std::vector<Cell> m_storage;
+	StorageTy<Cell> m_storage;
+	PoolBitmap m_occupied;
 	uint32_t m_head = UINT_MAX;
 	uint32_t m_autoinc = 1;
 	size_t m_count = 0;
@@ -181,10 +428,42 @@ private:
 };
 
 
+// Sparse set keyed by handles of another pool. Sparse index pages are allocated on demand and
+// kept until 'clear', so a mirror which empties and fills again doesn't allocate. Values are packed
+// densely, iteration follows the mirrored count rather than the source pool size. Destroying swaps
+// the last value into the hole: element addresses are only stable until the next make/destroy.
+// Iteration goes from the back, so destroying the current element while iterating is safe.
 template <class T>
 class PoolMirror {
+	struct Entry {
+		PoolHandle handle;
+		T value;
+
+	public:
+		template <class... ArgsTy>
+		Entry(PoolHandle handle, ArgsTy&&... args) : handle(handle), value(std::forward<ArgsTy>(args)...) {}
+	};
+
+public:
+	class Iterator {
+	public:
+		Iterator(std::vector<Entry>* dense, size_t position) : m_dense(dense), m_position(position) {}
+
+		Iterator& operator++() { --m_position; return *this; }
+
+		PoolValue<T> operator*() const { Entry& entry = (*m_dense)[m_position - 1]; return PoolValue<T>{ entry.handle, &entry.value }; }
+
+		bool operator==(Iterator const& other) const { return m_position == other.m_position; }
+		bool operator!=(Iterator const& other) const { return m_position != other.m_position; }
+
+	private:
+		std::vector<Entry>* m_dense;
+		size_t m_position;   // one past the current element
+	};
+
 public:
-	using Iterator = PoolIterator<T, PoolCell<T>>;
+	static const uint32_t PAGE_BITS = 8;
+	static const uint32_t PAGE_SIZE = 1u << PAGE_BITS;
 
 public:
 	PoolMirror(void) = default;
@@ -197,23 +476,180 @@ public:
 	T* operator[](PoolHandle idx) const;
 	T& at(PoolHandle idx) const;
 
-	void reserve(size_t n) { m_storage.reserve(n); }
-	void clear() { m_storage.clear(); }
+	void reserve(size_t n) { m_dense.reserve(n); }
+	void clear() { m_dense.clear(); m_pages.clear(); }
 
-	Iterator begin() const { return Iterator(m_storage.data(), 0); }
-	Iterator end() const { return Iterator(m_storage.data() + m_storage.size(), -1); }
-	size_t count() const { return m_storage.size(); }
+	Iterator begin() const { return Iterator(&m_dense, m_dense.size()); }
+	Iterator end() const { return Iterator(&m_dense, 0); }
+	size_t count() const { return m_dense.size(); }
 
 	template <class... ArgsTy>
 	T& make(PoolHandle idx, ArgsTy&&... args);
 	void destroy(PoolHandle idx);
 
 private:
-	mutable std::vector<PoolCell<T>> m_storage;
+	static const uint32_t NONE = UINT32_MAX;
+
+	mutable std::vector<Entry> m_dense;
+	std::vector<std::unique_ptr<uint32_t[]>> m_pages;   // handle index -> dense position
+
+private:
+	uint32_t find(PoolHandle idx) const;
+	uint32_t& slot(uint32_t index);
+};
+
+
+// Pool keeping every field in its own dense array, so a scan over one field doesn't drag the
+// others through the cache. Handles follow Pool rules. Fields are value-initialised on alloc and
+// reset on dealloc, references to them are invalidated by alloc.
+template <class... Fields>
+class PoolSoA {
+public:
+	template <size_t I>
+	using Field = typename std::tuple_element<I, std::tuple<Fields...>>::type;
+
+	// Visits handles of live elements.
+	class Iterator {
+	public:
+		Iterator(PoolSoA const* pool, uint32_t index) : m_pool(pool), m_index(index) {}
+
+		Iterator& operator++() { m_index = m_pool->m_occupied.next(m_index + 1); return *this; }
+		PoolHandle operator*() const { return PoolHandle{ m_index, m_pool->m_nonces[m_index] }; }
+
+		bool operator==(Iterator const& other) const { return m_index == other.m_index; }
+		bool operator!=(Iterator const& other) const { return m_index != other.m_index; }
+
+	private:
+		PoolSoA const* m_pool;
+		uint32_t m_index;
+	};
+
+public:
+	PoolSoA() = default;
+
+	PoolSoA(PoolSoA&&) = default;
+	PoolSoA(PoolSoA const&) = delete;
+	PoolSoA& operator=(PoolSoA&&) = default;
+	PoolSoA& operator=(PoolSoA const&) = delete;
+
+	PoolHandle alloc();
+	void dealloc(PoolHandle handle);
+	bool contains(PoolHandle handle) const { return handle.index < m_nonces.size() && handle.nonce != 0 && m_nonces[handle.index] == handle.nonce; }
+
+	// Field of the element, nullptr for stale handles.
+	template <size_t I>
+	Field<I>* get(PoolHandle handle) const { return contains(handle) ? &std::get<I>(m_columns)[handle.index] : nullptr; }
+	template <size_t I>
+	Field<I>& at(PoolHandle handle) const;
+
+	// Whole column indexed by handle index, dead slots included. For scans together with iteration.
+	template <size_t I>
+	Array<Field<I>> column() const { auto& column = std::get<I>(m_columns); return Array<Field<I>>(column.data(), column.data() + column.size()); }
+
+	size_t count() const { return m_count; }
+	void reserve(size_t n);
+	void clear();
+
+	Iterator begin() const { return Iterator(this, m_occupied.next(0)); }
+	Iterator end() const { return Iterator(this, PoolBitmap::NONE); }
+
+private:
+	mutable std::tuple<std::vector<Fields>...> m_columns;
+	std::vector<uint32_t> m_nonces;   // 0 for free slots
+	std::vector<uint32_t> m_free;
+	PoolBitmap m_occupied;
+	uint32_t m_autoinc = 1;
+	size_t m_count = 0;
+
+private:
+	template <size_t... Is>
+	void growColumns(std::index_sequence<Is...>);
+	template <size_t... Is>
+	void resetColumns(uint32_t index, std::index_sequence<Is...>);
+	template <size_t... Is>
+	void reserveColumns(size_t n, std::index_sequence<Is...>);
+};
+
+// Fixed-capacity pool shared between threads. Every slot counts its own generation: it's odd while
+// the slot is live and handle nonce is the generation, so stale handles never match a reused slot.
+// Free slots form a lock-free stack, its head is tagged with a counter against ABA.
+// Lookup is wait-free. Values are copied in and out under a per-slot sequence lock, so they have to be
+// trivially copyable; every element has to be updated by one thread at a time.
+template <class T>
+class ConcurrentPool {
+	static_assert(std::is_trivially_copyable<T>::value, "ConcurrentPool values are copied racily, they have to be trivially copyable");
+
+public:
+	ConcurrentPool(size_t capacity);
+
+	ConcurrentPool(ConcurrentPool const&) = delete;
+	ConcurrentPool& operator=(ConcurrentPool const&) = delete;
+
+	// Invalid handle if the pool is full.
+	PoolHandle alloc(T const& value);
+	// Returns false if the handle is stale, only one of concurrent frees of the same handle succeeds.
+	bool dealloc(PoolHandle handle);
+
+	bool contains(PoolHandle handle) const;
+	// Handle of the element living in slot 'index' at the moment, invalid if the slot is free.
+	// Scans over the whole capacity go through it.
+	PoolHandle handle(size_t index) const;
+	// Copies the value out, false if the handle is stale.
+	bool load(PoolHandle handle, T& value) const;
+	bool store(PoolHandle handle, T const& value);
+
+	size_t capacity() const { return m_capacity; }
+	size_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+private:
+	static const uint32_t NONE = UINT32_MAX;
+
+	struct Slot {
+		std::atomic<uint32_t> generation;
+		std::atomic<uint32_t> sequence;   // odd while the value is being written
+		std::atomic<uint32_t> next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+	};
+
+private:
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_capacity;
+	std::atomic<uint64_t> m_head;         // tag << 32 | index
+	std::atomic<size_t> m_count;
+
+private:
+	uint32_t pop();
+	void push(uint32_t index);
+	void write(Slot& slot, T const& value);
 };
 
 uint32_t memhash(void const* mem, int length);
 
+// Monotonic time with microsecond resolution. The event loop samples the clock once per iteration
+// with 'tick', everything running in that iteration reads the cached sample of its thread.
+// Threads which never tick read the clock source directly.
+struct Clock {
+	static void tick();
+
+	static uint64_t nowUs();
+	static uint64_t nowMs() { return nowUs() / 1000; }
+
+	// Bypasses the cache.
+	static uint64_t preciseUs();
+	// Same source in nanoseconds, for measuring short intervals.
+	static uint64_t preciseNs();
+
+	// Switches the clock source from steady_clock to the TSC if the CPU has an invariant one,
+	// measuring its rate for 'sampleMs'. Has to be called before other threads start using the clock.
+	static bool calibrateTsc(size_t sampleMs = 20);
+
+	// Replaces the clock source with simulated time which moves only with 'setSimulated'.
+	// Same constraints as 'calibrateTsc'; ticked threads see a new time with their next tick.
+	static void useSimulated(uint64_t startUs);
+	static void setSimulated(uint64_t us);
+};
+
+// Cached monotonic time, see Clock.
 uint64_t getTimeMs();
 void usleep(size_t time);
 void sleep(size_t time);
@@ -225,13 +661,69 @@ struct Timer {
 
 public:
 	Timer() : start(0), duration(0) {}
-	Timer(size_t duration) : start(getTimeMs()), duration(duration) {}
+	Timer(size_t duration) : start(Clock::nowMs()), duration(duration) {}
 
-	bool expired() const { return getTimeMs() - start >= duration; }
+	bool expired() const { return Clock::nowMs() - start >= duration; }
 	bool shedule() { if (expired()) { reset(); return true; } return false; }
 
-	void reset() { start = getTimeMs(); }
-	void activate() { start = getTimeMs() - duration; }
+	void reset() { start = Clock::nowMs(); }
+	void activate() { start = Clock::nowMs() - duration; }
+};
+
+
+// Hierarchical timing wheel with 1 ms resolution. Every level has 64 slots, a slot of level N spans
+// 64^N ms, so 4 levels cover ~4.6 hours; longer delays are re-cascaded. Insert and cancel are O(1),
+// timers are cancelled through handles which become stale (not reused) once the timer fires.
+class TimerWheel {
+public:
+	using Handle = PoolHandle;
+	using Callback = ::Callback<void()>;
+
+	static const int LEVELS = 4;
+	static const int SLOT_BITS = 6;
+	static const int SLOTS = 1 << SLOT_BITS;
+
+public:
+	TimerWheel(uint64_t now = getTimeMs());
+
+	TimerWheel(TimerWheel const&) = delete;
+	TimerWheel& operator=(TimerWheel const&) = delete;
+
+	Handle schedule(size_t delay, Callback callback);
+	// Returns false if the timer has already fired or been cancelled. Resets the handle.
+	bool cancel(Handle& handle);
+	bool active(Handle const& handle) const { return m_nodes[handle] != nullptr; }
+
+	// Fires all timers expired by 'now', callbacks may schedule and cancel timers.
+	void advance(uint64_t now = getTimeMs());
+
+	// Earliest time 'advance' has something to do, UINT64_MAX if there are no timers.
+	// It may precede the actual deadline when long timers are cascaded to lower levels.
+	uint64_t nextDeadline() const;
+
+	uint64_t now() const { return m_now; }
+	size_t count() const { return m_nodes.count(); }
+
+private:
+	struct Node {
+		uint64_t deadline;
+		Handle prev;
+		Handle next;
+		uint8_t level;
+		uint8_t slot;
+		Callback callback;
+	};
+
+private:
+	Pool<Node> m_nodes;
+	Handle m_slots[LEVELS][SLOTS];
+	uint64_t m_occupied[LEVELS];
+	uint64_t m_now;   // last processed tick
+
+private:
+	void link(Handle handle, Node& node);
+	void unlink(Node& node);
+	void cascade(int level, int slot);
 };
 
 
@@ -97,7 +97,9 @@ int print_nat_type(NatType type)
 }
 
 ConsoleUi::ConsoleUi()
+	: m_cmdtype(Command::Idle), m_events(EVENT_QUEUE_SIZE)
 {
+	m_critical[0] = '\0';
 	m_flags = 0;
 	m_flags |= Flags::UpdateHeader;
 	m_flags |= Flags::UpdateBoard;
@@ -106,8 +108,11 @@ ConsoleUi::ConsoleUi()
 	m_natInfo.type = NatType::Unknown;
 	m_natInfo.grayAddress = config.endpoint;
 	m_natInfo.whiteAddress = NetAddress::any(0);
+	m_natInfo.portDelta = 0;
 
     m_connStatus = PeerStatus::Offline;
+    m_peers.store(nullptr);
+    m_peersVersion = 0;
 }
 
 bool ConsoleUi::update()
@@ -121,17 +126,16 @@ bool ConsoleUi::update()
 		return true;
 	}
 
-	switch (cmd) {
-    case Command::UpdateUsers:
-        m_flags |= Flags::UpdateBoard;
-        break;
-	case Command::Message:
-		break;
-	case Command::NatInfo:
-		m_flags |= Flags::UpdateHeader;
-		m_natInfo = m_cmd.natInfo;
-		break;
-	case Command::UpdateConfig:
+	drain_events();
+
+	NetHost::PeerTable const* peers = m_peers.load(std::memory_order_acquire);
+	uint32_t peersVersion = peers != nullptr ? peers->version.load(std::memory_order_acquire) : 0;
+	if (peersVersion != m_peersVersion) {
+		m_peersVersion = peersVersion;
+		m_flags |= Flags::UpdateBoard;
+	}
+
+	if (cmd == Command::UpdateConfig) {
 		auto& ask = m_boardstate.ask;
 
 		ask.active = 0;
@@ -150,7 +154,6 @@ bool ConsoleUi::update()
 			m_cmdtype.store(Command::ConfigUpdated);
             return true;
 		}
-		break;
 	}
 
 	if (cmd == Command::UpdatingConfig && m_input.hasInput()) {
@@ -167,9 +170,6 @@ bool ConsoleUi::update()
 		update_logs();
 	}
 
-    if (cmd != Command::Idle && cmd != Command::UpdatingConfig) {
-        m_cmdtype.store(Command::Idle);
-    }
 	if (cmd != Command::UpdatingConfig || !m_boardstate.ask.editor) {
 		SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), COORD{ 0, 21 });
 	}
@@ -349,10 +349,20 @@ void ConsoleUi::update_ask_board()
 
 void ConsoleUi::update_chat_board()
 {
+    // entries change while they are copied one by one, the next frame redraws if they did
+    NetHost::PeerTable const* peers = m_peers.load(std::memory_order_acquire);
+    size_t slot = 0;
     for (int i = 0; i < 12; ++i) {
-        if (m_clients.size() > i) {
-            auto& client = m_clients[i];
-            clrprintf(peer_status_clr(client.status), "   %16s ", client.nickname);
+        NetHost::PeerTable::Entry entry;
+        bool found = false;
+        for (; peers != nullptr && !found && slot < peers->entries.capacity(); ++slot) {
+            // peers are unnamed until they join
+            found = peers->entries.load(peers->entries.handle(slot), entry) && entry.nickname[0] != '\0';
+        }
+
+        if (found) {
+            entry.nickname[sizeof(entry.nickname) - 1] = '\0';
+            clrprintf(peer_status_clr((PeerStatus)entry.status), "   %16s ", entry.nickname);
         } else {
             printf("                    ");
         }
@@ -364,54 +374,60 @@ void ConsoleUi::update_logs()
 {
 	SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), COORD{ 0, 20 });
 	printf("--------------------------------------------------------------------------------------------------------\n");
+	if (m_critical[0] != '\0') {
+		clrprintf(FOREGROUND_RED | FOREGROUND_INTENSITY, "%s\n", m_critical);
+	}
 	m_flags &= ~Flags::UpdateLogs;
 }
 
-void ConsoleUi::wait_command(int cmdwait)
+bool ConsoleUi::post_event(Event&& event)
 {
-    if (config.withoutUi) return;
-	while (m_cmdtype.load() != cmdwait) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
-	}
+    if (config.withoutUi) return true;
+    return m_events.push(std::move(event));
 }
 
-
-void ConsoleUi::setNatInfo(StunClient::Result const& result)
+void ConsoleUi::drain_events()
 {
-	wait_command();
-	m_cmd.natInfo = result;
-	m_cmdtype.store(Command::NatInfo);
+    // a burst of updates only changes the state, the frame is redrawn once
+    Event event;
+    while (m_events.pop(event)) {
+        switch (event.type) {
+        case Event::NatInfo:
+            m_natInfo = event.natInfo;
+            m_flags |= Flags::UpdateHeader;
+            break;
+        case Event::ServerStatus:
+            m_connStatus = event.status;
+            m_flags |= Flags::UpdateHeader;
+            break;
+        case Event::Critical:
+            strcpy_s(m_critical, sizeof(m_critical), event.message);
+            m_flags |= Flags::UpdateLogs;
+            break;
+        }
+    }
 }
 
-void ConsoleUi::setServerStatus(PeerStatus status)
+
+bool ConsoleUi::setNatInfo(StunClient::Result const& result)
 {
-    wait_command();
-    m_connStatus = status;
-    m_cmdtype.store(Command::NatInfo);
+    Event event;
+    event.type = Event::NatInfo;
+    event.natInfo = result;
+    return post_event(std::move(event));
 }
 
-void ConsoleUi::setClient(PoolHandle id, char const* nickname, PeerStatus status)
+bool ConsoleUi::setServerStatus(PeerStatus status)
 {
-    wait_command();
-
-    Client* pClient = nullptr;
-    for (auto& client : m_clients) {
-        if (client.id == id) {
-            pClient = &client;
-            break;
-        }
-    }
-
-    if (pClient == nullptr) {
-        m_clients.emplace_back();
-        pClient = &m_clients.back();
-    }
-
-    pClient->id = id;
-    pClient->status = status;
-    strcpy_s(pClient->nickname, sizeof(pClient->nickname), nickname);
+    Event event;
+    event.type = Event::ServerStatus;
+    event.status = status;
+    return post_event(std::move(event));
+}
 
-    m_cmdtype.store(Command::UpdateUsers);
+void ConsoleUi::watchPeers(NetHost::PeerTable const* peers)
+{
+    m_peers.store(peers, std::memory_order_release);
 }
 
 void ConsoleUi::askUserConfig(Config& cfg)
@@ -420,7 +436,6 @@ void ConsoleUi::askUserConfig(Config& cfg)
         return;
     }
 
-	wait_command();
 	m_cmdtype.store(Command::UpdateConfig);
 
 	while (m_cmdtype.load() != Command::ConfigUpdated) {
@@ -428,23 +443,24 @@ void ConsoleUi::askUserConfig(Config& cfg)
 	}
 
 	cfg = config;
-	m_cmdtype.store(Command::UpdateUsers);
+	m_cmdtype.store(Command::Idle);
 }
 
 void ConsoleUi::onFatalError(char const* fmt, ...)
 {
-    if (!config.withoutUi) wait_command();
+    Event event;
+    event.type = Event::Critical;
 
     va_list args;
     va_start(args, fmt);
     if (config.withoutUi) {
         clrvprintf(FOREGROUND_RED | FOREGROUND_INTENSITY, fmt, args);
     } else {
-        vsnprintf(m_cmd.message.buffer, sizeof(m_cmd.message.buffer), fmt, args);
+        vsnprintf(event.message, sizeof(event.message), fmt, args);
     }
     
     va_end(args);
-    if (!config.withoutUi) m_cmdtype.store(Command::Critical);
+    post_event(std::move(event));
 }
 
 void ConsoleUi::onFatalErrorWinApi(char const* fmt, uint32_t code)
@@ -455,9 +471,10 @@ void ConsoleUi::onFatalErrorWinApi(char const* fmt, uint32_t code)
     if (config.withoutUi) {
         clrprintf(FOREGROUND_RED | FOREGROUND_INTENSITY, fmt, buffer, code);
     } else {
-        wait_command();
-        snprintf(m_cmd.message.buffer, sizeof(m_cmd.message.buffer), fmt, buffer, code);
-        m_cmdtype.store(Command::Critical);
+        Event event;
+        event.type = Event::Critical;
+        snprintf(event.message, sizeof(event.message), fmt, buffer, code);
+        post_event(std::move(event));
     }
 }
 
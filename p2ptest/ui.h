@@ -1,7 +1,9 @@
 #pragma once
 
 #include "config.h"
+#include "host.h"
 #include "stun_client.h"
+#include "ring.h"
 
 #include <atomic>
 
@@ -40,16 +42,21 @@ public:
 		AskNickname = 0x800,
 	};
 
+	const static size_t EVENT_QUEUE_SIZE = 1024;
+
+	// Config handshake with the network thread.
 	struct Command {
 		enum Type {
-			Idle, NatInfo, UpdateConfig, UpdatingConfig, ConfigUpdated, UpdateUsers,
-			OnBoardMain,
-
-			Message, Critical,
-			LogMsg, LogWarning, LogError,
+			Idle, UpdateConfig, UpdatingConfig, ConfigUpdated,
 		};
+	};
+
+	// Posted by other threads without blocking, drained and coalesced by 'update' once per frame.
+	struct Event {
+		enum Type { NatInfo, ServerStatus, Critical } type;
+		PeerStatus status;
 		union {
-			struct { char buffer[128]; } message;
+			char message[128];
 			StunClient::Result natInfo;
 		};
 	};
@@ -66,12 +73,6 @@ public:
 		};
 	};
 
-    struct Client {
-        char nickname[32];
-        PeerStatus status;
-        PoolHandle id;
-    };
-
 	Config config;
 public:
 	ConsoleUi();
@@ -79,28 +80,33 @@ public:
 	void onFatalError(char const* fmt, ...);
 	void onFatalErrorWinApi(char const* fmt, uint32_t code);
 
-	void setNatInfo(StunClient::Result const& result);
-	void setServerStatus(PeerStatus status);
-	void askUserConfig(Config& cfg);
+	// Return false if the event queue is full, the caller should repeat the update later.
+	bool setNatInfo(StunClient::Result const& result);
+	bool setServerStatus(PeerStatus status);
+	// The chat board lists peers straight from the table, the table has to outlive the UI.
+	void watchPeers(NetHost::PeerTable const* peers);
 
-	void setClient(PoolHandle id, char const* nickname, PeerStatus status);
+	void askUserConfig(Config& cfg);
 
 	bool update();
 
 private:
 	std::atomic_int m_cmdtype;
 	ConsoleInput m_input;
-	Command m_cmd;
+	MpscRing<Event> m_events;
+	char m_critical[128];
 
 	uint32_t m_flags;
 	StunClient::Result m_natInfo;
 	Board m_boardstate;
 
     PeerStatus m_connStatus;
-    std::vector<Client> m_clients;
+    std::atomic<NetHost::PeerTable const*> m_peers;
+    uint32_t m_peersVersion;
 
 private:
-	void wait_command(int cmd = Command::Idle);
+	bool post_event(Event&& event);
+	void drain_events();
 	void update_header();
 	void update_board();
 	void update_logs();
@@ -0,0 +1,462 @@
+#include "vnet.h"
+
+#include <winsock2.h>
+
+#include <algorithm>
+#include <map>
+
+
+namespace {
+	const static uint16_t STUN_BIND_REQUEST = 0x0001;
+	const static uint16_t STUN_BIND_RESPONSE = 0x0101;
+	const static uint32_t STUN_MAGIC_COOKIE = 0x2112A442;
+	const static uint16_t STUN_MAPPED_ADDRESS = 0x0001;
+	const static uint16_t STUN_CHANGE_REQUEST = 0x0003;
+	const static uint16_t STUN_RESPONSE_PORT = 0x0027;
+	const static uint16_t STUN_RESPONSE_ORIGIN = 0x802b;
+	const static uint16_t STUN_OTHER_ADDRESS = 0x802c;
+	const static size_t STUN_HEADER_SIZE = 20;
+
+	uint64_t packAddress(uint32_t ip, uint16_t port)
+	{
+		return (uint64_t)ip << 16 | port;
+	}
+
+	uint64_t packAddress(NetAddress const& address)
+	{
+		sockaddr_in const* addr = (sockaddr_in const*)address.data;
+		return packAddress(ntohl(addr->sin_addr.S_un.S_addr), ntohs(addr->sin_port));
+	}
+
+	uint32_t addressIp(uint64_t address) { return (uint32_t)(address >> 16); }
+	uint16_t addressPort(uint64_t address) { return (uint16_t)address; }
+
+	uint32_t readBig(uint8_t const* data, size_t size)
+	{
+		uint32_t value = 0;
+		for (size_t i = 0; i < size; ++i) {
+			value = value << 8 | data[i];
+		}
+		return value;
+	}
+
+	void writeBig(std::vector<uint8_t>& out, uint32_t value, size_t size)
+	{
+		for (size_t i = size; i > 0; --i) {
+			out.push_back((uint8_t)(value >> (8 * (i - 1))));
+		}
+	}
+
+	void writeStunAddress(std::vector<uint8_t>& out, uint16_t type, uint64_t address)
+	{
+		writeBig(out, type, 2);
+		writeBig(out, 8, 2);
+		writeBig(out, 0x0001, 2);   // IPv4 family
+		writeBig(out, addressPort(address), 2);
+		writeBig(out, addressIp(address), 4);
+	}
+}
+
+
+// ------------------------------------------------------------------------
+class VirtualNetwork::Endpoint : public ISocketBackend {
+public:
+	Endpoint(VirtualNetwork& network, uint32_t host)
+		: network(network), host(host), port(0)
+	{
+	}
+
+	virtual bool bind(NetAddress const& address) override
+	{
+		uint32_t ip = network.m_hosts[host].ip;
+		uint64_t packed = packAddress(address);
+		if (port != 0 || (addressIp(packed) != 0 && addressIp(packed) != ip)) {
+			return false;
+		}
+
+		uint16_t wanted = addressPort(packed);
+		if (wanted == 0) {
+			for (uint32_t candidate = FIRST_EPHEMERAL_PORT; candidate <= 0xFFFF && wanted == 0; ++candidate) {
+				if (network.m_bound.count(packAddress(ip, (uint16_t)candidate)) == 0) {
+					wanted = (uint16_t)candidate;
+				}
+			}
+		}
+		if (wanted == 0 || !network.m_bound.emplace(packAddress(ip, wanted), this).second) {
+			return false;
+		}
+		port = wanted;
+		return true;
+	}
+
+	virtual int sendto(NetAddress const& to, void const* buf, int len) override
+	{
+		return network.send(*this, to, buf, len);
+	}
+
+	virtual int recvfrom(void* buf, int len, NetAddress& from) override
+	{
+		if (inbox.empty()) {
+			return -1;
+		}
+		Inbound& datagram = inbox.front();
+		int count = (int)datagram.payload.size();
+		if (count > len) {
+			// like the system socket, a datagram which doesn't fit is an error and is gone
+			inbox.pop_front();
+			return -1;
+		}
+		memcpy(buf, datagram.payload.data(), count);
+		from = NetAddress::ipv4(addressIp(datagram.src), addressPort(datagram.src));
+		inbox.pop_front();
+		return count;
+	}
+
+	virtual bool pending() const override { return !inbox.empty(); }
+	virtual NetAddress sockname() const override { return NetAddress::ipv4(network.m_hosts[host].ip, port); }
+
+	virtual void close() override
+	{
+		if (port != 0) {
+			network.m_bound.erase(packAddress(network.m_hosts[host].ip, port));
+			port = 0;
+		}
+		inbox.clear();
+	}
+
+	virtual ISocketBackend* open() override
+	{
+		network.m_endpoints.emplace_back(new Endpoint(network, host));
+		return network.m_endpoints.back().get();
+	}
+
+public:
+	struct Inbound {
+		uint64_t src;
+		std::vector<uint8_t> payload;
+	};
+
+	VirtualNetwork& network;
+	uint32_t host;
+	uint16_t port;              // 0 until bound
+	std::deque<Inbound> inbox;
+};
+
+struct VirtualNetwork::Nat {
+	VirtualNat config;
+	uint16_t nextPort;
+	std::map<std::pair<uint64_t, uint64_t>, uint16_t> ports;   // (internal, remote) -> external port
+	std::unordered_map<uint16_t, Mapping> mappings;            // by external port
+};
+
+
+// ------------------------------------------------------------------------
+VirtualNetwork::VirtualNetwork(uint64_t seed, uint64_t startUs)
+	: m_rng(seed), m_nowUs(startUs), m_sequence(0), m_stats()
+{
+	Clock::useSimulated(startUs);
+}
+
+VirtualNetwork::~VirtualNetwork()
+{
+}
+
+int VirtualNetwork::addNat(VirtualNat const& config)
+{
+	ASSERT(config.type != NatType::Unknown);
+	std::unique_ptr<Nat> nat(new Nat());
+	nat->config = config;
+	nat->nextPort = FIRST_NAT_PORT;
+	m_nats.push_back(std::move(nat));
+
+	int index = (int)m_nats.size() - 1;
+	if (config.type != NatType::Open) {
+		ASSERT(m_publicIps.count(config.publicIp) == 0);
+		m_publicIps[config.publicIp] = index;
+	}
+	return index;
+}
+
+ISocketBackend* VirtualNetwork::addHost(uint32_t ip, int nat, VirtualLink const& link)
+{
+	ASSERT(nat == NO_NAT || (size_t)nat < m_nats.size());
+	m_hosts.push_back(Host{ ip, nat, link, 0, false });
+	m_endpoints.emplace_back(new Endpoint(*this, (uint32_t)m_hosts.size() - 1));
+	return m_endpoints.back().get();
+}
+
+void VirtualNetwork::addStunServer(uint32_t ip, uint32_t altIp, VirtualLink const& link)
+{
+	ASSERT(ip != altIp && m_stunIps.count(ip) == 0 && m_stunIps.count(altIp) == 0);
+	m_stunServers.push_back(StunServer{ ip, altIp, Host{ ip, NO_NAT, link, 0, false } });
+	m_stunIps[ip] = m_stunServers.size() - 1;
+	m_stunIps[altIp] = m_stunServers.size() - 1;
+}
+
+uint64_t VirtualNetwork::nextEvent() const
+{
+	return m_inflight.empty() ? UINT64_MAX : m_inflight.top().timeUs;
+}
+
+void VirtualNetwork::advance(uint64_t us)
+{
+	ASSERT(us >= m_nowUs);
+	while (!m_inflight.empty() && m_inflight.top().timeUs <= us) {
+		// the queue only gives const access, the datagram is popped right after
+		Datagram datagram = std::move(const_cast<Datagram&>(m_inflight.top()));
+		m_inflight.pop();
+		m_nowUs = datagram.timeUs;
+		Clock::setSimulated(m_nowUs);
+		deliver(datagram);
+	}
+	m_nowUs = us;
+	Clock::setSimulated(us);
+}
+
+void VirtualNetwork::takeReady(std::vector<uint32_t>& hosts)
+{
+	hosts.clear();
+	hosts.swap(m_ready);
+	for (uint32_t id : hosts) {
+		m_hosts[id].ready = false;
+	}
+}
+
+int VirtualNetwork::send(Endpoint& endpoint, NetAddress const& to, void const* buf, int len)
+{
+	if (len < 0 || (size_t)len > MAX_DATAGRAM) {
+		return -1;
+	}
+	if (endpoint.port == 0 && !endpoint.bind(NetAddress::any(0))) {
+		return -1;
+	}
+	m_stats.sent += 1;
+
+	Host& host = m_hosts[endpoint.host];
+	uint64_t src = packAddress(host.ip, endpoint.port);
+	uint64_t dst = packAddress(to);
+	if (!isPublic(host)) {
+		auto local = m_bound.find(dst);
+		bool sameRealm = local != m_bound.end() && m_hosts[local->second->host].nat == host.nat;
+		if (!sameRealm && !translateOut(*m_nats[host.nat], src, dst, src)) {
+			m_stats.filtered += 1;
+			return len;
+		}
+	}
+
+	transmit(host, src, dst, (uint8_t const*)buf, (size_t)len);
+	return len;
+}
+
+void VirtualNetwork::transmit(Host& host, uint64_t src, uint64_t dst, uint8_t const* buf, size_t len)
+{
+	VirtualLink const& link = host.link;
+	if (link.loss > 0.0 && randomUnit() < link.loss) {
+		m_stats.lost += 1;
+		return;
+	}
+
+	uint64_t departure = m_nowUs;
+	if (link.bandwidth != 0) {
+		uint64_t start = std::max(m_nowUs, host.linkFreeUs);
+		uint64_t backlog = (start - m_nowUs) * link.bandwidth / 8000000;
+		if (backlog + len > link.queueLimit) {
+			m_stats.queueDropped += 1;
+			return;
+		}
+		host.linkFreeUs = start + (len * 8000000 + link.bandwidth - 1) / link.bandwidth;
+		departure = host.linkFreeUs;
+	}
+
+	uint64_t arrival = departure + link.delayUs;
+	if (link.jitterUs != 0) {
+		arrival += random() % (link.jitterUs + 1);
+	}
+	if (link.reorder > 0.0 && randomUnit() < link.reorder) {
+		arrival += link.reorderUs;
+	}
+
+	Datagram datagram;
+	datagram.timeUs = arrival;
+	datagram.sequence = m_sequence++;
+	datagram.src = src;
+	datagram.dst = dst;
+	datagram.srcNat = host.nat;
+	datagram.payload.assign(buf, buf + len);
+	m_inflight.push(std::move(datagram));
+}
+
+void VirtualNetwork::deliver(Datagram& datagram)
+{
+	auto stun = m_stunIps.find(addressIp(datagram.dst));
+	if (stun != m_stunIps.end()) {
+		answerStun(m_stunServers[stun->second], datagram);
+		return;
+	}
+
+	Endpoint* target = nullptr;
+	auto bound = m_bound.find(datagram.dst);
+	if (bound != m_bound.end() && (isPublic(m_hosts[bound->second->host]) || m_hosts[bound->second->host].nat == datagram.srcNat)) {
+		target = bound->second;
+	} else {
+		auto nat = m_publicIps.find(addressIp(datagram.dst));
+		if (nat == m_publicIps.end()) {
+			m_stats.unroutable += 1;
+			return;
+		}
+		target = translateIn(*m_nats[nat->second], datagram.src, datagram.dst);
+		if (target == nullptr) {
+			m_stats.filtered += 1;
+			return;
+		}
+	}
+
+	m_stats.delivered += 1;
+	target->inbox.push_back(Endpoint::Inbound{ datagram.src, std::move(datagram.payload) });
+	Host& host = m_hosts[target->host];
+	if (!host.ready) {
+		host.ready = true;
+		m_ready.push_back(target->host);
+	}
+}
+
+// Only what StunClient and NatLifetimeProbe rely on: binding requests with CHANGE-REQUEST or
+// RESPONSE-PORT, answered with MAPPED-ADDRESS, RESPONSE-ORIGIN and OTHER-ADDRESS (RFC 5780).
+void VirtualNetwork::answerStun(StunServer& server, Datagram const& request)
+{
+	uint16_t port = addressPort(request.dst);
+	std::vector<uint8_t> const& payload = request.payload;
+	if ((port != STUN_PORT && port != STUN_ALT_PORT) || payload.size() < STUN_HEADER_SIZE
+		|| readBig(&payload[0], 2) != STUN_BIND_REQUEST || readBig(&payload[4], 4) != STUN_MAGIC_COOKIE) {
+		m_stats.unroutable += 1;
+		return;
+	}
+	m_stats.delivered += 1;
+
+	bool changeIp = false;
+	bool changePort = false;
+	uint64_t destination = request.src;
+	for (size_t offset = STUN_HEADER_SIZE; offset + 4 <= payload.size();) {
+		uint16_t type = (uint16_t)readBig(&payload[offset], 2);
+		size_t length = readBig(&payload[offset + 2], 2);
+		if (type == STUN_CHANGE_REQUEST && length == 4 && offset + 8 <= payload.size()) {
+			changeIp = (payload[offset + 7] & 0x04) != 0;
+			changePort = (payload[offset + 7] & 0x02) != 0;
+		}
+		if (type == STUN_RESPONSE_PORT && length == 4 && offset + 8 <= payload.size()) {
+			destination = packAddress(addressIp(request.src), (uint16_t)readBig(&payload[offset + 4], 2));
+		}
+		offset += 4 + length;
+	}
+
+	uint32_t ip = addressIp(request.dst);
+	uint32_t otherIp = (ip == server.ip) ? server.altIp : server.ip;
+	uint16_t otherPort = (port == STUN_PORT) ? STUN_ALT_PORT : STUN_PORT;
+	uint64_t origin = packAddress(changeIp ? otherIp : ip, changePort ? otherPort : port);
+
+	std::vector<uint8_t> response;
+	writeBig(response, STUN_BIND_RESPONSE, 2);
+	writeBig(response, 3 * 12, 2);
+	response.insert(response.end(), payload.begin() + 4, payload.begin() + STUN_HEADER_SIZE);
+	writeStunAddress(response, STUN_MAPPED_ADDRESS, request.src);
+	writeStunAddress(response, STUN_RESPONSE_ORIGIN, origin);
+	writeStunAddress(response, STUN_OTHER_ADDRESS, packAddress(otherIp, otherPort));
+
+	m_stats.stun += 1;
+	m_stats.sent += 1;
+	transmit(server.host, origin, destination, response.data(), response.size());
+}
+
+bool VirtualNetwork::isPublic(Host const& host) const
+{
+	return host.nat == NO_NAT || m_nats[host.nat]->config.type == NatType::Open;
+}
+
+bool VirtualNetwork::translateOut(Nat& nat, uint64_t internal, uint64_t remote, uint64_t& external)
+{
+	VirtualNat const& config = nat.config;
+	if (config.type == NatType::Blocked) {
+		return false;
+	}
+
+	auto key = std::make_pair(internal, config.type == NatType::Symmetric ? remote : 0);
+	auto found = nat.ports.find(key);
+	Mapping* mapping = (found != nat.ports.end()) ? findMapping(nat, found->second) : nullptr;
+	if (mapping == nullptr) {
+		uint16_t port = allocatePort(nat);
+		mapping = &nat.mappings[port];
+		mapping->internal = internal;
+		mapping->remote = key.second;
+		mapping->port = port;
+		nat.ports[key] = port;
+	}
+
+	mapping->lastUsedMs = m_nowUs / 1000;
+	if (config.type == NatType::AddressRestricted) {
+		mapping->permissions.insert(addressIp(remote));
+	} else if (config.type != NatType::FullCone) {
+		mapping->permissions.insert(remote);
+	}
+	external = packAddress(config.publicIp, mapping->port);
+	return true;
+}
+
+VirtualNetwork::Endpoint* VirtualNetwork::translateIn(Nat& nat, uint64_t src, uint64_t dst)
+{
+	Mapping* mapping = findMapping(nat, addressPort(dst));
+	if (mapping == nullptr) {
+		return nullptr;
+	}
+
+	switch (nat.config.type) {
+	case NatType::FullCone:
+		break;
+	case NatType::AddressRestricted:
+		if (mapping->permissions.count(addressIp(src)) == 0) return nullptr;
+		break;
+	default:
+		if (mapping->permissions.count(src) == 0) return nullptr;
+		break;
+	}
+
+	auto endpoint = m_bound.find(mapping->internal);
+	return endpoint != m_bound.end() ? endpoint->second : nullptr;
+}
+
+VirtualNetwork::Mapping* VirtualNetwork::findMapping(Nat& nat, uint16_t port)
+{
+	auto found = nat.mappings.find(port);
+	if (found == nat.mappings.end()) {
+		return nullptr;
+	}
+
+	Mapping& mapping = found->second;
+	if (m_nowUs / 1000 - mapping.lastUsedMs > nat.config.mappingLifetimeMs) {
+		// expired mappings are removed lazily, the next packet gets a fresh port
+		nat.ports.erase(std::make_pair(mapping.internal, mapping.remote));
+		nat.mappings.erase(found);
+		return nullptr;
+	}
+	return &mapping;
+}
+
+uint16_t VirtualNetwork::allocatePort(Nat& nat)
+{
+	for (;;) {
+		uint16_t port = nat.nextPort;
+		int next = (int)nat.nextPort + nat.config.portDelta;
+		nat.nextPort = (uint16_t)(next >= 1024 && next <= 0xFFFF ? next : FIRST_NAT_PORT);
+		if (nat.mappings.count(port) == 0) {
+			return port;
+		}
+	}
+}
+
+uint64_t VirtualNetwork::random()
+{
+	// splitmix64, the same sequence on every platform
+	uint64_t z = (m_rng += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "socket.h"
+#include "stun_client.h"
+#include "tools.h"
+
+#include <deque>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+// Outbound link of a virtual host. Delay, loss and the rest apply to every datagram the host sends.
+struct VirtualLink {
+	double loss = 0.0;              // probability a datagram is lost
+	uint32_t delayUs = 0;           // one-way delay to any destination
+	uint32_t jitterUs = 0;          // random extra delay up to that much
+	double reorder = 0.0;           // probability a datagram is held back by 'reorderUs'
+	uint32_t reorderUs = 0;
+	uint64_t bandwidth = 0;         // bits per second, 0 - unlimited
+	size_t queueLimit = 64 * 1024;  // bytes waiting for the link, datagrams beyond that are dropped
+};
+
+// NAT box in front of a group of hosts, types are the ones StunClient detects.
+// Open doesn't translate, its hosts are public. FullCone maps per source and lets anybody in,
+// AddressRestricted and PortRestricted admit only addresses (and ports) the mapping has sent to,
+// Symmetric maps per destination and filters like PortRestricted. Blocked drops all traffic.
+struct VirtualNat {
+	NatType type = NatType::PortRestricted;
+	uint32_t publicIp = 0;          // host order
+	int portDelta = 1;              // step between allocated ports, what port prediction has to guess
+	uint32_t mappingLifetimeMs = 120000;   // idle mappings expire, only outbound traffic refreshes them
+};
+
+
+// In-memory datagram fabric. Hosts get ISocketBackend implementations to wrap into Sockets, time
+// comes from the simulated Clock which only the network moves. Everything runs on one thread and
+// depends only on the seed, so runs are repeatable.
+// Addresses are global: every host and NAT needs a unique ip, hosts behind the same NAT reach each
+// other directly by private addresses, all other traffic goes through public addresses.
+class VirtualNetwork {
+public:
+	const static size_t MAX_DATAGRAM = 65507;
+	const static uint16_t FIRST_EPHEMERAL_PORT = 49152;
+	const static uint16_t FIRST_NAT_PORT = 20000;
+	const static uint16_t STUN_PORT = 3478;
+	const static uint16_t STUN_ALT_PORT = 3479;
+	static const int NO_NAT = -1;
+
+	struct Stats {
+		uint64_t sent;
+		uint64_t delivered;
+		uint64_t lost;          // by link loss
+		uint64_t queueDropped;  // by link queue limit
+		uint64_t filtered;      // by NAT filtering or an expired mapping
+		uint64_t unroutable;    // no host or NAT at the destination
+		uint64_t stun;          // binding requests answered by STUN servers
+	};
+
+public:
+	// Switches the Clock to simulated time starting at 'startUs'.
+	explicit VirtualNetwork(uint64_t seed, uint64_t startUs = 1000000);
+	~VirtualNetwork();
+
+	VirtualNetwork(VirtualNetwork const&) = delete;
+	VirtualNetwork& operator=(VirtualNetwork const&) = delete;
+
+	int addNat(VirtualNat const& config);
+	// Host with address 'ip' behind 'nat' (NO_NAT for public hosts). Returns its first socket,
+	// more are opened through it. Sockets are owned by the network.
+	ISocketBackend* addHost(uint32_t ip, int nat = NO_NAT, VirtualLink const& link = VirtualLink());
+	// STUN server on 'ip' and 'altIp', ports STUN_PORT and STUN_ALT_PORT, enough for StunClient to
+	// detect NAT types: hosts pass "<ip>" as the server url.
+	void addStunServer(uint32_t ip, uint32_t altIp, VirtualLink const& link = VirtualLink());
+
+	uint64_t now() const { return m_nowUs; }
+	// Time of the next delivery, UINT64_MAX if nothing is in flight.
+	uint64_t nextEvent() const;
+	// Moves the clock to 'us', datagrams due by then land in socket queues.
+	void advance(uint64_t us);
+	// Hosts (in addHost order) which got datagrams since the last call.
+	void takeReady(std::vector<uint32_t>& hosts);
+
+	Stats stats() const { return m_stats; }
+
+private:
+	class Endpoint;
+	struct Nat;
+
+	struct Host {
+		uint32_t ip;
+		int nat;
+		VirtualLink link;
+		uint64_t linkFreeUs;    // the link is busy sending until then
+		bool ready;
+	};
+
+	struct StunServer {
+		uint32_t ip;
+		uint32_t altIp;
+		Host host;              // sends the answers, nobody can address it
+	};
+
+	struct Mapping {
+		uint64_t internal;      // packed address
+		uint64_t remote;        // destination of symmetric mappings, 0 otherwise
+		uint16_t port;
+		uint64_t lastUsedMs;
+		std::unordered_set<uint64_t> permissions;   // remote ips or addresses the mapping has sent to
+	};
+
+	struct Datagram {
+		uint64_t timeUs;
+		uint64_t sequence;      // keeps datagrams of equal time in send order
+		uint64_t src;
+		uint64_t dst;
+		int srcNat;
+		std::vector<uint8_t> payload;
+
+		bool operator>(Datagram const& other) const { return timeUs != other.timeUs ? timeUs > other.timeUs : sequence > other.sequence; }
+	};
+
+private:
+	int send(Endpoint& endpoint, NetAddress const& to, void const* buf, int len);
+	void transmit(Host& host, uint64_t src, uint64_t dst, uint8_t const* buf, size_t len);
+	void deliver(Datagram& datagram);
+	void answerStun(StunServer& server, Datagram const& request);
+	bool isPublic(Host const& host) const;
+
+	bool translateOut(Nat& nat, uint64_t internal, uint64_t remote, uint64_t& external);
+	Endpoint* translateIn(Nat& nat, uint64_t src, uint64_t dst);
+	Mapping* findMapping(Nat& nat, uint16_t port);
+	uint16_t allocatePort(Nat& nat);
+
+	uint64_t random();
+	double randomUnit() { return (double)(random() >> 11) / (double)(1ull << 53); }
+
+private:
+	uint64_t m_rng;
+	uint64_t m_nowUs;
+	uint64_t m_sequence;
+	Stats m_stats;
+
+	std::vector<Host> m_hosts;
+	std::vector<std::unique_ptr<Endpoint>> m_endpoints;
+	std::vector<std::unique_ptr<Nat>> m_nats;
+	std::vector<StunServer> m_stunServers;
+	std::unordered_map<uint64_t, Endpoint*> m_bound;   // packed address -> socket
+	std::unordered_map<uint32_t, int> m_publicIps;     // NAT public ip -> NAT index
+	std::unordered_map<uint32_t, size_t> m_stunIps;    // STUN server ip -> server index
+	std::priority_queue<Datagram, std::vector<Datagram>, std::greater<Datagram>> m_inflight;
+	std::vector<uint32_t> m_ready;
+};
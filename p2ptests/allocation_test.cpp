@@ -0,0 +1,347 @@
+#include "tests.h"
+#include "hole_puncher.h"
+#include "host.h"
+#include "packet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+
+
+// Steady state paths which must not touch the heap once pools, slabs and the timer wheel have grown:
+// HolePuncher per punched host, and NetHost per data message sent, received and forwarded, where
+// payloads must not be copied either. Global operator new is replaced with a counting one for the
+// whole runner, the count only matters around the measured rounds.
+
+namespace {
+	std::atomic<size_t> g_allocations(0);
+}
+
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* memory = malloc(size ? size : 1);
+	if (memory == nullptr) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+namespace {
+	const uint64_t START_US = 1000000;
+	const size_t TIMEOUT_MS = 10000;
+	const uint32_t HOSTS = 64;          // pending at once
+	const int ROUNDS = 4;               // the first one only grows the pools
+	const uint32_t MESSAGES = 64;       // data messages per round, fewer than a Loopback queue holds
+	const size_t PAYLOAD = 200;
+	const int MSG_ID = 1;
+
+	// Datagram queues between in-process sockets. Fixed storage, so it doesn't count itself.
+	class Loopback : public ISocketBackend {
+	public:
+		Loopback(NetAddress const& address) : m_address(address), m_head(0), m_count(0) {}
+
+		void connect(Loopback& peer) { m_peers.push_back(&peer); }
+
+		bool bind(NetAddress const&) override { return true; }
+		int sendto(NetAddress const& to, void const* buf, int len) override
+		{
+			Loopback* const* peer = std::find_if(m_peers.begin(), m_peers.end(), [&to](Loopback* peer) { return peer->m_address == to; });
+			if (peer == m_peers.end() || len > (int)sizeof(Datagram::data) || (*peer)->m_count == CAPACITY) {
+				return len;   // lost
+			}
+			Loopback& target = **peer;
+			Datagram& datagram = target.m_queue[(target.m_head + target.m_count++) % CAPACITY];
+			datagram.from = m_address;
+			datagram.length = len;
+			memcpy(datagram.data, buf, len);
+			return len;
+		}
+		int recvfrom(void* buf, int len, NetAddress& from) override
+		{
+			if (m_count == 0) {
+				return -1;
+			}
+			Datagram const& datagram = m_queue[m_head];
+			m_head = (m_head + 1) % CAPACITY;
+			m_count -= 1;
+			from = datagram.from;
+			len = std::min(len, datagram.length);
+			memcpy(buf, datagram.data, len);
+			return len;
+		}
+		bool pending() const override { return m_count != 0; }
+		NetAddress sockname() const override { return m_address; }
+		void close() override {}
+		ISocketBackend* open() override { return nullptr; }
+
+	private:
+		static const size_t CAPACITY = 1024;
+
+		struct Datagram {
+			NetAddress from;
+			int length;
+			uint8_t data[256];
+		};
+
+		NetAddress m_address;
+		FixedArray<Loopback*, 4> m_peers;
+		Datagram m_queue[CAPACITY];
+		size_t m_head;
+		size_t m_count;
+	};
+
+	// Both sides of the punching: 'local' probes the hosts, 'remote' answers every ping.
+	struct Pair {
+		Loopback localBackend;
+		Loopback remoteBackend;
+		Socket localSocket;
+		Socket remoteSocket;
+		TimerWheel localTimers;
+		TimerWheel remoteTimers;
+		HolePuncher local;
+		HolePuncher remote;
+
+		Pair(NetAddress const& localAddress, NetAddress const& remoteAddress)
+			: localBackend(localAddress), remoteBackend(remoteAddress)
+			, localSocket(&localBackend), remoteSocket(&remoteBackend)
+			, local(false, localSocket, localTimers), remote(false, remoteSocket, remoteTimers)
+		{
+			localBackend.connect(remoteBackend);
+			remoteBackend.connect(localBackend);
+		}
+
+		void receive(Socket const& socket, HolePuncher& puncher)
+		{
+			uint8_t buffer[64];
+			NetAddress src;
+			int count = 0;
+			while ((count = socket.recvfrom(buffer, sizeof(buffer), 0, src)) > 0) {
+				CBytes bytes(buffer, buffer + count);
+				if (((net_uint16_t const*)buffer)->get() == 0) {
+					puncher.onPingReceived(socket, src, bytes);
+				} else {
+					puncher.onPongReceived(socket, src, bytes);
+				}
+			}
+		}
+
+		// Moves time in 1 ms steps until 'punched' reaches 'expected'.
+		void run(size_t& punched, size_t expected)
+		{
+			uint64_t start = Clock::nowUs();
+			for (uint64_t us = start; punched < expected && us - start < TIMEOUT_MS * 1000; us += 1000) {
+				Clock::setSimulated(us);
+				Clock::tick();
+				localTimers.advance(getTimeMs());
+				remoteTimers.advance(getTimeMs());
+				receive(remoteSocket, remote);
+				receive(localSocket, local);
+				local.update(localSocket);
+			}
+		}
+	};
+}
+
+void testPunchAllocations()
+{
+	Clock::useSimulated(START_US);
+	Clock::tick();
+
+	NetAddress remoteAddress = NetAddress::ipv4(10, 0, 0, 2, 5000);
+	std::unique_ptr<Pair> pair(new Pair(NetAddress::ipv4(10, 0, 0, 1, 5000), remoteAddress));
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		size_t before = g_allocations.load();
+
+		size_t punched = 0;
+		for (uint32_t i = 0; i < HOSTS; ++i) {
+			// same slots every round, new nonces
+			PoolHandle id(i, (uint32_t)round + 1);
+			pair->local.addRemoteHost(id, Array<NetAddress const>(&remoteAddress, &remoteAddress + 1), TIMEOUT_MS,
+				[&punched](NetAddress const&) { punched += 1; });
+		}
+		pair->run(punched, HOSTS);
+		for (uint32_t i = 0; i < HOSTS; ++i) {
+			pair->local.delRemoteHost(PoolHandle(i, (uint32_t)round + 1));
+		}
+
+		size_t allocations = g_allocations.load() - before;
+		EXPECT_MSG(punched == HOSTS, "round %d: %u of %u hosts punched", round, (uint32_t)punched, HOSTS);
+		if (round != 0) {
+			EXPECT_MSG(allocations == 0, "round %d: %u allocations for %u punched hosts", round, (uint32_t)allocations, HOSTS);
+		}
+	}
+}
+
+
+namespace {
+	// Drops, keeps until told or forwards every data message it gets.
+	class Relay : public INetClient {
+	public:
+		enum Mode { Drop, Keep, Forward };
+
+		Mode mode = Drop;
+		NetHost* host = nullptr;
+		PeerId target;                // of forwarded messages
+		size_t connected = 0;
+		size_t received = 0;
+		size_t forwarded = 0;
+
+		void release()
+		{
+			for (size_t i = 0; i < m_keptCount; ++i) {
+				m_kept[i].reset();
+			}
+			m_keptCount = 0;
+		}
+
+		void onPeerConnected(PeerId) override { connected += 1; }
+		void onPeerDisconnected(PeerId) override { connected -= 1; }
+		void onMessageReceived(PeerId, int, CBytes) override {}
+		void onMessageReceived(PeerId, int id, Packet msg) override
+		{
+			received += 1;
+			if (mode == Keep && m_keptCount < MESSAGES) {
+				m_kept[m_keptCount++] = std::move(msg);
+			} else if (mode == Forward) {
+				forwarded += host->send(target, id, std::move(msg)) ? 1 : 0;
+			}
+		}
+
+	private:
+		Packet m_kept[MESSAGES];
+		size_t m_keptCount = 0;
+	};
+
+	struct Node {
+		Loopback backend;
+		Socket socket;
+		Relay relay;
+		NetHost host;
+
+		Node(NetAddress const& address, bool isMaster, char const* name)
+			: backend(address), socket(&backend), host(isMaster, socket, { &relay })
+		{
+			relay.host = &host;
+			snprintf(host.nickname, sizeof(host.nickname), "%s", name);
+		}
+
+		PeerId peer(char const* name)
+		{
+			PeerId found;
+			host.queryPeerInfos([&found, name](PeerId id, NetHost::PeerInfo const& info) {
+				if (!strcmp(info.nickname, name)) {
+					found = id;
+				}
+			});
+			return found;
+		}
+	};
+
+	// Source, master relaying to the sink, and the sink, all connected to each other.
+	struct Mesh {
+		Node source;
+		Node master;
+		Node sink;
+		uint64_t now = START_US;
+
+		Mesh()
+			: source(NetAddress::ipv4(10, 0, 0, 1, 5000), false, "source")
+			, master(NetAddress::ipv4(10, 0, 0, 2, 5000), true, "master")
+			, sink(NetAddress::ipv4(10, 0, 0, 3, 5000), false, "sink")
+		{
+			Node* nodes[] = { &source, &master, &sink };
+			for (Node* node : nodes) {
+				for (Node* other : nodes) {
+					if (node != other) {
+						node->backend.connect(other->backend);
+					}
+				}
+			}
+		}
+
+		// Moves time in 1 ms steps until 'done' holds, false if it doesn't in TIMEOUT_MS.
+		template <typename Done>
+		bool run(Done done)
+		{
+			for (uint64_t end = now + TIMEOUT_MS * 1000; now < end; now += 1000) {
+				Clock::setSimulated(now);
+				Clock::tick();
+				Node* nodes[] = { &source, &master, &sink };
+				for (Node* node : nodes) {
+					do {
+						node->host.update();
+					} while (node->backend.pending());
+				}
+				if (done()) {
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+}
+
+void testForwardAllocations()
+{
+	Clock::useSimulated(START_US);
+	Clock::tick();
+
+	std::unique_ptr<Mesh> mesh(new Mesh());
+	NetAddress master = mesh->master.backend.sockname();
+	for (Node* node : { &mesh->source, &mesh->sink }) {
+		node->host.connect(Array<NetAddress const>(&master, &master + 1), [](int code) {
+			EXPECT_MSG(false, "connection failed, code %d", code);
+		});
+	}
+	bool formed = mesh->run([&mesh]() {
+		return mesh->source.relay.connected == 2 && mesh->master.relay.connected == 2 && mesh->sink.relay.connected == 2;
+	});
+	EXPECT_MSG(formed, "mesh is not formed: %u, %u and %u connections", (uint32_t)mesh->source.relay.connected,
+		(uint32_t)mesh->master.relay.connected, (uint32_t)mesh->sink.relay.connected);
+	if (!formed) {
+		return;
+	}
+
+	PeerId toMaster = mesh->source.peer("master");
+	mesh->master.relay.target = mesh->master.peer("sink");
+	char const* const MODES[] = { "dropped", "kept", "forwarded" };
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (int mode = Relay::Drop; mode <= Relay::Forward; ++mode) {
+			Relay& relay = mesh->master.relay;
+			relay.mode = (Relay::Mode)mode;
+			size_t received = relay.received + MESSAGES;
+			size_t sunk = mesh->sink.relay.received + (mode == Relay::Forward ? MESSAGES : 0);
+
+			size_t allocations = g_allocations.load();
+			size_t copies = Packet::stats().copies;
+
+			uint32_t sent = 0;
+			for (uint32_t i = 0; i < MESSAGES; ++i) {
+				Packet msg = Packet::alloc(PAYLOAD);
+				memset(msg.data(), (int)i, msg.size());
+				sent += mesh->source.host.send(toMaster, MSG_ID, std::move(msg)) ? 1 : 0;
+			}
+			bool delivered = mesh->run([&mesh, received, sunk]() {
+				return mesh->master.relay.received >= received && mesh->sink.relay.received >= sunk;
+			});
+			relay.release();
+
+			allocations = g_allocations.load() - allocations;
+			copies = Packet::stats().copies - copies;
+			EXPECT_MSG(sent == MESSAGES && delivered, "round %d: %u of %u messages %s", round, sent, MESSAGES, MODES[mode]);
+			if (round != 0) {
+				EXPECT_MSG(allocations == 0, "round %d: %u allocations for %u messages %s", round, (uint32_t)allocations, MESSAGES, MODES[mode]);
+			}
+			EXPECT_MSG(copies == 0, "round %d: %u payload copies for %u messages %s", round, (uint32_t)copies, MESSAGES, MODES[mode]);
+		}
+	}
+}
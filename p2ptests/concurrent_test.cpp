@@ -0,0 +1,180 @@
+#include "tests.h"
+#include "tools.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+// ConcurrentPool under writer threads which allocate, update and free their own elements while a
+// reader copies out whatever is published. Every value carries its own handle and a checksum of its
+// words, so a torn copy or a value of another generation shows up, and freed handles must stay dead.
+
+namespace {
+	const size_t CAPACITY = 64;          // small, so slots are reused all the time
+	const uint32_t WRITERS = 4;
+	const uint32_t HELD = 8;             // live elements per writer, WRITERS * HELD fit into the pool
+	const uint32_t OPERATIONS = 200000;  // per writer
+
+	struct Value {
+		uint32_t index;
+		uint32_t nonce;                  // 0 until the owner stores the handle
+		uint32_t writer;
+		uint32_t serial;
+		uint64_t words[6];
+	};
+
+	uint64_t word(Value const& value, size_t i)
+	{
+		return ((uint64_t)value.writer << 48 | (uint64_t)value.serial << 8 | i) * 0x9E3779B97F4A7C15ull;
+	}
+
+	Value makeValue(PoolHandle handle, uint32_t writer, uint32_t serial)
+	{
+		Value value;
+		value.index = handle.index;
+		value.nonce = handle.nonce;
+		value.writer = writer;
+		value.serial = serial;
+		for (size_t i = 0; i < 6; ++i) {
+			value.words[i] = word(value, i);
+		}
+		return value;
+	}
+
+	uint64_t pack(PoolHandle handle) { return (uint64_t)handle.index << 32 | handle.nonce; }
+	PoolHandle unpack(uint64_t packed) { return PoolHandle((uint32_t)(packed >> 32), (uint32_t)packed); }
+
+	struct Shared {
+		ConcurrentPool<Value> pool{ CAPACITY };
+		std::atomic<uint64_t> live[WRITERS][HELD];   // handles the reader copies from, 0 if none
+		std::atomic<uint64_t> freed[WRITERS];        // the latest freed handle of every writer
+		std::atomic<uint32_t> running{ WRITERS };
+
+		std::atomic<size_t> torn{ 0 };
+		std::atomic<size_t> foreign{ 0 };             // values of another slot, generation or writer
+		std::atomic<size_t> revived{ 0 };             // freed handles which still load or free
+		std::atomic<size_t> full{ 0 };
+
+		Shared()
+		{
+			for (uint32_t w = 0; w < WRITERS; ++w) {
+				for (uint32_t i = 0; i < HELD; ++i) {
+					live[w][i].store(0);
+				}
+				freed[w].store(0);
+			}
+		}
+	};
+
+	void runWriter(Shared& shared, uint32_t writer)
+	{
+		PoolHandle held[HELD];
+		uint32_t serial = 0;
+		uint32_t random = writer * 2654435761u + 1;
+		for (uint32_t op = 0; op < OPERATIONS; ++op) {
+			random = random * 1103515245 + 12345;
+			uint32_t i = (random >> 16) % HELD;
+			PoolHandle& handle = held[i];
+			if (!handle.isValid()) {
+				handle = shared.pool.alloc(makeValue(PoolHandle(), writer, ++serial));
+				if (!handle.isValid()) {
+					shared.full.fetch_add(1);
+					continue;
+				}
+				shared.pool.store(handle, makeValue(handle, writer, ++serial));
+				shared.live[writer][i].store(pack(handle));
+			} else if ((random >> 8) % 4 != 0) {
+				shared.pool.store(handle, makeValue(handle, writer, ++serial));
+			} else {
+				shared.live[writer][i].store(0);
+				shared.pool.dealloc(handle);
+				shared.freed[writer].store(pack(handle));
+				handle = PoolHandle();
+			}
+		}
+
+		for (uint32_t i = 0; i < HELD; ++i) {
+			if (held[i].isValid()) {
+				shared.live[writer][i].store(0);
+				shared.pool.dealloc(held[i]);
+			}
+		}
+		shared.running.fetch_sub(1);
+	}
+
+	void check(Shared& shared, PoolHandle handle, uint32_t writer)
+	{
+		Value value;
+		if (!shared.pool.load(handle, value)) {
+			return;   // freed since it was published
+		}
+		for (size_t i = 0; i < 6; ++i) {
+			if (value.words[i] != word(value, i)) {
+				shared.torn.fetch_add(1);
+				return;
+			}
+		}
+		if (value.writer != writer || value.index != handle.index || (value.nonce != 0 && value.nonce != handle.nonce)) {
+			shared.foreign.fetch_add(1);
+		}
+	}
+
+	void runReader(Shared& shared)
+	{
+		while (shared.running.load() != 0) {
+			for (uint32_t w = 0; w < WRITERS; ++w) {
+				for (uint32_t i = 0; i < HELD; ++i) {
+					uint64_t packed = shared.live[w][i].load();
+					if (packed != 0) {
+						check(shared, unpack(packed), w);
+					}
+				}
+
+				// generations only grow, a freed handle never matches its slot again
+				uint64_t packed = shared.freed[w].load();
+				if (packed != 0) {
+					Value value;
+					PoolHandle handle = unpack(packed);
+					if (shared.pool.contains(handle) || shared.pool.load(handle, value) || shared.pool.dealloc(handle)) {
+						shared.revived.fetch_add(1);
+					}
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+}
+
+void testConcurrentPool()
+{
+	std::unique_ptr<Shared> shared(new Shared());
+
+	std::vector<std::thread> threads;
+	for (uint32_t w = 0; w < WRITERS; ++w) {
+		threads.emplace_back(runWriter, std::ref(*shared), w);
+	}
+	threads.emplace_back(runReader, std::ref(*shared));
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	EXPECT_MSG(shared->torn.load() == 0, "%u torn values", (uint32_t)shared->torn.load());
+	EXPECT_MSG(shared->foreign.load() == 0, "%u values of other elements", (uint32_t)shared->foreign.load());
+	EXPECT_MSG(shared->revived.load() == 0, "%u freed handles are still live", (uint32_t)shared->revived.load());
+	EXPECT_MSG(shared->full.load() == 0, "pool got full %u times with %u of %u slots held", (uint32_t)shared->full.load(),
+		WRITERS * HELD, (uint32_t)CAPACITY);
+	EXPECT_MSG(shared->pool.count() == 0, "%u elements left", (uint32_t)shared->pool.count());
+
+	// the free stack must still hold every slot exactly once
+	std::vector<bool> taken(CAPACITY);
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		PoolHandle handle = shared->pool.alloc(Value());
+		EXPECT_MSG(handle.isValid() && !taken[handle.index], "slot %u: %s", (uint32_t)i, handle.isValid() ? "allocated twice" : "pool is full");
+		if (handle.isValid()) {
+			taken[handle.index] = true;
+		}
+	}
+	EXPECT(!shared->pool.alloc(Value()).isValid());
+}
@@ -0,0 +1,180 @@
+#include "tests.h"
+#include "hole_puncher.h"
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+
+// Keepalives of an established peer reachable over two paths: in the steady state only the nominated
+// path gets them, and once it stops answering the other one has to take over within about one
+// keepalive period rather than after several.
+
+namespace {
+	const uint64_t START_US = 1000000;
+	const size_t STEADY_MS = 60000;
+
+	class Hub;
+
+	// In-process socket, everything sent goes through the hub.
+	class Port : public ISocketBackend {
+	public:
+		Port(Hub& hub, NetAddress const& address) : m_hub(hub), m_address(address) {}
+
+		void deliver(NetAddress const& from, void const* buf, int len)
+		{
+			m_queue.push_back(Datagram{ from, std::vector<uint8_t>((uint8_t const*)buf, (uint8_t const*)buf + len) });
+		}
+
+		bool bind(NetAddress const&) override { return true; }
+		int sendto(NetAddress const& to, void const* buf, int len) override;
+		int recvfrom(void* buf, int len, NetAddress& from) override
+		{
+			if (m_queue.empty()) {
+				return -1;
+			}
+			Datagram const& datagram = m_queue.front();
+			from = datagram.from;
+			len = std::min(len, (int)datagram.data.size());
+			memcpy(buf, datagram.data.data(), len);
+			m_queue.pop_front();
+			return len;
+		}
+		bool pending() const override { return !m_queue.empty(); }
+		NetAddress sockname() const override { return m_address; }
+		void close() override {}
+		ISocketBackend* open() override { return nullptr; }
+
+	private:
+		struct Datagram {
+			NetAddress from;
+			std::vector<uint8_t> data;
+		};
+
+		Hub& m_hub;
+		NetAddress m_address;
+		std::deque<Datagram> m_queue;
+	};
+
+	// Counts datagrams by destination, the ones sent to 'cut' are lost.
+	class Hub {
+	public:
+		std::unordered_map<NetAddress, size_t> sent;
+		NetAddress cut = NetAddress::any(0);
+
+		void attach(Port& port) { m_ports.push_back(&port); }
+
+		void send(NetAddress const& from, NetAddress const& to, void const* buf, int len)
+		{
+			sent[to] += 1;
+			for (Port* port : m_ports) {
+				if (port->sockname() == to && !(to == cut)) {
+					port->deliver(from, buf, len);
+				}
+			}
+		}
+
+	private:
+		std::vector<Port*> m_ports;
+	};
+
+	int Port::sendto(NetAddress const& to, void const* buf, int len)
+	{
+		m_hub.send(m_address, to, buf, len);
+		return len;
+	}
+
+	// The local end keeps the remote one alive, the remote end is reachable at two addresses and
+	// answers pings on both.
+	struct Paths {
+		NetAddress first = NetAddress::ipv4(10, 0, 0, 2, 5000);
+		NetAddress second = NetAddress::ipv4(10, 0, 0, 3, 5000);
+		Hub hub;
+		Port localPort;
+		Port firstPort;
+		Port secondPort;
+		Socket localSocket;
+		Socket firstSocket;
+		Socket secondSocket;
+		TimerWheel localTimers;
+		TimerWheel remoteTimers;
+		HolePuncher local;
+		HolePuncher remote;
+		NetAddress nominated = NetAddress::any(0);
+		uint64_t now = START_US;
+
+		Paths()
+			: localPort(hub, NetAddress::ipv4(10, 0, 0, 1, 5000)), firstPort(hub, first), secondPort(hub, second)
+			, localSocket(&localPort), firstSocket(&firstPort), secondSocket(&secondPort)
+			, local(false, localSocket, localTimers), remote(false, firstSocket, remoteTimers)
+		{
+			hub.attach(localPort);
+			hub.attach(firstPort);
+			hub.attach(secondPort);
+			local.setPathCallback([this](PoolHandle, NetAddress const& address) { nominated = address; });
+		}
+
+		void receive(Socket const& socket, HolePuncher& puncher)
+		{
+			uint8_t buffer[64];
+			NetAddress src;
+			int count = 0;
+			while ((count = socket.recvfrom(buffer, sizeof(buffer), 0, src)) > 0) {
+				CBytes bytes(buffer, buffer + count);
+				if (((net_uint16_t const*)buffer)->get() == 0) {
+					puncher.onPingReceived(socket, src, bytes);
+				} else {
+					puncher.onPongReceived(socket, src, bytes);
+				}
+			}
+		}
+
+		// Moves time in 1 ms steps for 'ms' or until 'done' holds, returns the time it took.
+		template <typename Done>
+		size_t run(size_t ms, Done done)
+		{
+			for (size_t elapsed = 0; elapsed < ms; ++elapsed, now += 1000) {
+				Clock::setSimulated(now);
+				Clock::tick();
+				localTimers.advance(getTimeMs());
+				remoteTimers.advance(getTimeMs());
+				receive(firstSocket, remote);
+				receive(secondSocket, remote);
+				receive(localSocket, local);
+				if (done()) {
+					return elapsed;
+				}
+			}
+			return ms;
+		}
+		size_t run(size_t ms) { return run(ms, []() { return false; }); }
+	};
+}
+
+void testKeepAlivePaths()
+{
+	Clock::useSimulated(START_US);
+	Clock::tick();
+
+	std::unique_ptr<Paths> paths(new Paths());
+	PoolHandle id(0, 1);
+	paths->local.addKeepAlive(id, paths->first, Array<NetAddress const>(&paths->second, &paths->second + 1));
+	paths->run(10000);
+	EXPECT_MSG(paths->local.findByPath(paths->first) == id && paths->local.findByPath(paths->second) == id, "both paths have to be checked");
+
+	// backed off checks of the other path are rarer than the keepalives
+	paths->hub.sent.clear();
+	paths->run(STEADY_MS);
+	size_t keepalives = paths->hub.sent[paths->first];
+	size_t checks = paths->hub.sent[paths->second];
+	EXPECT_MSG(keepalives >= STEADY_MS / HolePuncher::KEEPALIVE_DEFAULT_MS, "%u pings on the nominated path in %u ms", (uint32_t)keepalives, (uint32_t)STEADY_MS);
+	EXPECT_MSG(checks * 2 < keepalives, "%u pings on the other path, %u on the nominated one", (uint32_t)checks, (uint32_t)keepalives);
+
+	paths->hub.cut = paths->first;
+	size_t limit = HolePuncher::KEEPALIVE_DEFAULT_MS + HolePuncher::KEEPALIVE_TIMEOUT_MS + 1000;
+	size_t took = paths->run(4 * HolePuncher::KEEPALIVE_DEFAULT_MS, [&paths]() { return paths->nominated == paths->second; });
+	EXPECT_MSG(paths->nominated == paths->second && took <= limit, "path switched after %u ms", (uint32_t)took);
+
+	paths->local.delKeepAlive(id);
+	EXPECT(!paths->local.findByPath(paths->second).isValid());
+}
@@ -0,0 +1,73 @@
+#include "tests.h"
+#include "stun_client.h"
+#include "vnet.h"
+
+#include <algorithm>
+
+
+// NatLifetimeProbe against NAT boxes with known mapping lifetimes.
+
+namespace {
+	const uint32_t CLIENT_IP = HOST_IP + 1;
+	const uint32_t CLIENT_NAT_IP = NAT_IP + 1;
+
+	struct Case {
+		NatType natType;
+		uint32_t lifetimeMs;
+	};
+
+	void runCase(Case const& test)
+	{
+		TestNetwork network(10000);
+		VirtualLink link;
+		link.delayUs = 10000;
+
+		VirtualNat config;
+		config.type = test.natType;
+		config.publicIp = CLIENT_NAT_IP;
+		config.mappingLifetimeMs = test.lifetimeMs;
+		Socket socket(network.addHost(CLIENT_IP, network.addNat(config), link));
+		EXPECT(socket.bind(NetAddress::any(0)));
+
+		Clock::tick();
+		NatLifetimeProbe probe;
+		probe.start(socket, NetAddress::ipv4(STUN_IP, VirtualNetwork::STUN_PORT));
+
+		std::vector<uint32_t> ready;
+		while (probe.active()) {
+			uint64_t next = std::min<uint64_t>(network.nextEvent(), probe.deadline() * 1000);
+			network.advance(std::max<uint64_t>(next, network.now() + 1));
+			network.takeReady(ready);
+			Clock::tick();
+			probe.update();
+		}
+
+		uint32_t lifetime = test.lifetimeMs;
+		EXPECT_MSG(probe.ready(), "lifetime %u ms: probe failed", lifetime);
+		if (lifetime > (uint32_t)NatLifetimeProbe::MAX_INTERVAL_MS) {
+			EXPECT_MSG(probe.lifetime() == NatLifetimeProbe::MAX_INTERVAL_MS && probe.expiredAfter() == 0,
+				"lifetime %u ms: measured %u..%u ms", lifetime, (unsigned)probe.lifetime(), (unsigned)probe.expiredAfter());
+		} else {
+			EXPECT_MSG(probe.lifetime() < lifetime && probe.expiredAfter() >= lifetime,
+				"lifetime %u ms: measured %u..%u ms", lifetime, (unsigned)probe.lifetime(), (unsigned)probe.expiredAfter());
+			EXPECT_MSG(probe.lifetime() == 0 || probe.expiredAfter() - probe.lifetime() <= NatLifetimeProbe::RESOLUTION_MS,
+				"lifetime %u ms: measured %u..%u ms", lifetime, (unsigned)probe.lifetime(), (unsigned)probe.expiredAfter());
+		}
+	}
+}
+
+void testNatLifetime()
+{
+	const Case CASES[] = {
+		{ NatType::PortRestricted, 800 },
+		{ NatType::PortRestricted, 3000 },
+		{ NatType::PortRestricted, 30000 },
+		{ NatType::Symmetric, 30000 },
+		{ NatType::FullCone, 120000 },
+		{ NatType::PortRestricted, 600000 },
+	};
+
+	for (Case const& test : CASES) {
+		runCase(test);
+	}
+}
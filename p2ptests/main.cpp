@@ -0,0 +1,63 @@
+#include "tests.h"
+#include "log.h"
+#include "socket.h"
+
+#include <string.h>
+
+
+// Test runner. Runs the tests named on the command line, all of them if there are none.
+// Exit code is the number of failed tests.
+
+int TestContext::failures = 0;
+
+namespace {
+	struct Test {
+		char const* name;
+		void (*run)();
+	};
+
+	const Test TESTS[] = {
+		{ "stun", testStunClassification },
+		{ "stun_warm", testStunWarmStart },
+		{ "packet", testPacketViews },
+		{ "lifetime", testNatLifetime },
+		{ "metrics", testMetricsServer },
+		{ "scenario", testRoomScenarios },
+		{ "allocations", testPunchAllocations },
+		{ "forwarding", testForwardAllocations },
+		{ "concurrent", testConcurrentPool },
+		{ "keepalive", testKeepAlivePaths },
+	};
+
+	bool selected(int argc, char const* argv[], char const* name)
+	{
+		if (argc < 2) {
+			return true;
+		}
+		for (int i = 1; i < argc; ++i) {
+			if (!strcmp(argv[i], name)) {
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+int main(int argc, char const* argv[])
+{
+	WinSock winSock;
+	log_configure(-1, -1, -1, nullptr);
+
+	int failed = 0;
+	for (Test const& test : TESTS) {
+		if (!selected(argc, argv, test.name)) {
+			continue;
+		}
+		int before = TestContext::failures;
+		test.run();
+		bool ok = TestContext::failures == before;
+		printf("[%s] %s\n", ok ? "  OK  " : " FAIL ", test.name);
+		failed += ok ? 0 : 1;
+	}
+	return failed;
+}
@@ -0,0 +1,141 @@
+#include "tests.h"
+#include "metrics.h"
+#include "socket.h"
+
+#include <winsock2.h>
+
+#include <stdlib.h>
+#include <string>
+
+
+// MetricsServer over loopback TCP: responses bigger than the socket buffers, clients which never send.
+
+namespace {
+	const uint16_t FIRST_PORT = 47300;
+	const size_t PEERS = 8000;              // megabytes of metrics
+	const uint64_t START_US = 1000000;
+
+	uint16_t listen(MetricsServer& server)
+	{
+		for (uint16_t port = FIRST_PORT; port < FIRST_PORT + 100; ++port) {
+			if (server.listen(port)) {
+				return port;
+			}
+		}
+		return 0;
+	}
+
+	// Non-blocking client with a small receive buffer, so the server can't push the response in one go.
+	SOCKET connectClient(uint16_t port)
+	{
+		SOCKET client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		int bufferSize = 4096;
+		setsockopt(client, SOL_SOCKET, SO_RCVBUF, (char const*)&bufferSize, sizeof(bufferSize));
+		NetAddress address = NetAddress::ipv4(127, 0, 0, 1, port);
+		if (connect(client, (sockaddr*)address.data, sizeof(address.data)) == SOCKET_ERROR) {
+			closesocket(client);
+			return INVALID_SOCKET;
+		}
+		u_long mode = 1;
+		ioctlsocket(client, FIONBIO, &mode);
+		return client;
+	}
+
+	// Reads what has arrived, returns true once the server has closed the connection.
+	bool readAll(SOCKET client, std::string& response)
+	{
+		char buffer[4096];
+		for (;;) {
+			int count = recv(client, buffer, sizeof(buffer), 0);
+			if (count > 0) {
+				response.append(buffer, count);
+				continue;
+			}
+			return count == 0 || WSAGetLastError() != WSAEWOULDBLOCK;
+		}
+	}
+
+	// Polls the server until the client has the whole response. Time stands still.
+	bool fetch(MetricsServer& server, NetMetrics const& metrics, SOCKET client, std::string& response)
+	{
+		for (int i = 0; i < 100000; ++i) {
+			server.poll(metrics);
+			if (readAll(client, response)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool complete(std::string const& response)
+	{
+		size_t headerEnd = response.find("\r\n\r\n");
+		size_t length = response.find("Content-Length: ");
+		if (headerEnd == std::string::npos || length == std::string::npos) {
+			return false;
+		}
+		size_t expected = strtoul(response.c_str() + length + 16, nullptr, 10);
+		return expected > 0 && response.size() - headerEnd - 4 == expected;
+	}
+}
+
+void testMetricsServer()
+{
+	Clock::useSimulated(START_US);
+	Clock::tick();
+
+	NetMetrics metrics;
+	for (size_t i = 0; i < PEERS; ++i) {
+		metrics.addPeer(PoolHandle((uint32_t)i, 1), NetAddress::ipv4(10, 0, (uint8_t)(i >> 8), (uint8_t)i, 5000));
+	}
+
+	MetricsServer server;
+	uint16_t port = listen(server);
+	EXPECT(port != 0);
+	if (!port) {
+		return;
+	}
+
+	// the whole body arrives although the socket buffers take only a part of it at a time
+	{
+		SOCKET client = connectClient(port);
+		EXPECT(client != INVALID_SOCKET);
+		send(client, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0);
+		std::string response;
+		EXPECT(fetch(server, metrics, client, response));
+		EXPECT_MSG(complete(response), "response of %u bytes is cut", (uint32_t)response.size());
+		EXPECT(response.size() > 100 * 1024);
+		closesocket(client);
+	}
+
+	// silent clients take all slots until they time out, then the next client is served
+	{
+		SOCKET silent[MetricsServer::MAX_CLIENTS];
+		for (SOCKET& client : silent) {
+			client = connectClient(port);
+		}
+		for (int i = 0; i < 10; ++i) {
+			server.poll(metrics);
+		}
+
+		SOCKET client = connectClient(port);
+		send(client, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0);
+		std::string response;
+		for (int i = 0; i < 10; ++i) {
+			server.poll(metrics);
+		}
+		EXPECT(!readAll(client, response) && response.empty());
+
+		Clock::setSimulated(START_US + (MetricsServer::IDLE_TIMEOUT_MS + 1) * 1000);
+		Clock::tick();
+		EXPECT(fetch(server, metrics, client, response));
+		EXPECT_MSG(complete(response), "response of %u bytes is cut", (uint32_t)response.size());
+
+		for (SOCKET silentClient : silent) {
+			std::string nothing;
+			EXPECT(readAll(silentClient, nothing) && nothing.empty());
+			closesocket(silentClient);
+		}
+		closesocket(client);
+	}
+}
@@ -0,0 +1,61 @@
+#include "tests.h"
+#include "packet.h"
+
+#include <string.h>
+
+
+// Packet references share the buffer but not the view of it.
+
+namespace {
+	void testSharedViews()
+	{
+		Packet first = Packet::alloc(8);
+		memcpy(first.data(), "headbody", 8);
+		Packet second = first.share();
+
+		EXPECT(first.consume(4));
+		EXPECT(first.size() == 4 && !memcmp(first.data(), "body", 4));
+		EXPECT(second.size() == 8 && !memcmp(second.data(), "headbody", 8));
+		EXPECT(!first.consume(5));
+		EXPECT(first.size() == 4);
+	}
+
+	void testPrependShared()
+	{
+		Packet msg = Packet::alloc(4);
+		memcpy(msg.data(), "data", 4);
+
+		// the same message sent to two peers gets one header each
+		Packet copies[2] = { msg.share(), msg.share() };
+		for (Packet& copy : copies) {
+			uint8_t* header = copy.prepend(2);
+			EXPECT(header != nullptr);
+			memcpy(header, "h:", 2);
+		}
+		for (Packet const& copy : copies) {
+			EXPECT(copy.size() == 6 && !memcmp(copy.data(), "h:data", 6));
+		}
+		EXPECT(msg.size() == 4 && !memcmp(msg.data(), "data", 4));
+		EXPECT(msg.unique());
+	}
+
+	void testPrependUnique()
+	{
+		Packet msg = Packet::alloc(4);
+		uint8_t* payload = msg.data();
+		EXPECT(msg.prepend(Packet::HEADROOM) == payload - Packet::HEADROOM);
+		EXPECT(msg.headroom() == 0);
+
+		// out of headroom, the payload moves to a fresh buffer
+		uint8_t* header = msg.prepend(1);
+		EXPECT(header != nullptr && msg.size() == Packet::HEADROOM + 5);
+		EXPECT(msg.prepend(Packet::HEADROOM + 1) == nullptr);
+	}
+}
+
+void testPacketViews()
+{
+	testSharedViews();
+	testPrependShared();
+	testPrependUnique();
+}
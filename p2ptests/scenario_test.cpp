@@ -0,0 +1,189 @@
+#include "tests.h"
+#include "host.h"
+#include "vnet.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <queue>
+#include <vector>
+
+
+// Rooms of NetHosts on the VirtualNetwork: a public master and members behind NAT boxes join it
+// and have to end up connected to everybody in the room. Two hosts behind symmetric NATs can't
+// predict each other's mappings, every ping of one opens a new mapping the other has to guess,
+// so such pairs aren't required to connect.
+
+namespace {
+	const uint32_t MASTER_IP = 0x0B000000;
+	const uint16_t MASTER_PORT = 7000;
+	const uint64_t JOIN_PERIOD_US = 500000;     // members join one after another
+	const uint64_t RUN_US = 30 * 1000000;
+
+	const NatType NAT_TYPES[] = { NatType::Open, NatType::FullCone, NatType::AddressRestricted, NatType::PortRestricted, NatType::Symmetric };
+
+	struct Member : INetClient {
+		std::unique_ptr<Socket> socket;
+		std::unique_ptr<NetHost> host;
+		size_t room;
+		NatType natType;            // Unknown - public master
+		NetAddress master;
+		uint64_t joinAt = 0;
+		bool joined = false;
+		bool failed = false;
+		size_t connected = 0;
+		uint64_t scheduled = UINT64_MAX;
+
+		void onPeerConnected(PeerId) override { connected += 1; }
+		void onPeerDisconnected(PeerId) override { connected -= 1; }
+		void onMessageReceived(PeerId, int, CBytes) override {}
+	};
+
+	// Rooms of one NAT type each and a mixed one.
+	std::vector<std::vector<NatType>> rooms()
+	{
+		std::vector<std::vector<NatType>> result;
+		for (NatType type : NAT_TYPES) {
+			result.push_back(std::vector<NatType>(3, type));
+		}
+		result.push_back(std::vector<NatType>(std::begin(NAT_TYPES), std::end(NAT_TYPES)));
+		return result;
+	}
+
+	// Wakes every host when it gets datagrams or its next deadline comes, until 'endUs'.
+	void run(VirtualNetwork& network, std::vector<std::unique_ptr<Member>>& members, uint64_t endUs)
+	{
+		typedef std::pair<uint64_t, uint32_t> Due;
+		std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+		for (uint32_t i = 0; i < members.size(); ++i) {
+			members[i]->scheduled = members[i]->joinAt;
+			due.push(Due(members[i]->scheduled, i));
+		}
+
+		std::vector<uint32_t> ready;
+		std::vector<uint32_t> work;
+		std::vector<bool> queued(members.size());
+		while (network.now() < endUs) {
+			uint64_t next = std::min(network.nextEvent(), due.empty() ? UINT64_MAX : due.top().first);
+			uint64_t now = std::min(std::max(next, network.now()), endUs);
+			network.advance(now);
+			Clock::tick();
+
+			network.takeReady(ready);
+			work.clear();
+			for (uint32_t id : ready) {
+				if (!queued[id]) {
+					queued[id] = true;
+					work.push_back(id);
+				}
+			}
+			while (!due.empty() && due.top().first <= now) {
+				Due entry = due.top();
+				due.pop();
+				if (members[entry.second]->scheduled == entry.first && !queued[entry.second]) {
+					queued[entry.second] = true;
+					work.push_back(entry.second);
+				}
+			}
+
+			for (uint32_t id : work) {
+				queued[id] = false;
+				Member& member = *members[id];
+				if (member.natType != NatType::Unknown && !member.joined && now >= member.joinAt) {
+					member.joined = true;
+					member.host->connect(Array<NetAddress const>(&member.master, &member.master + 1), [&member](int) { member.failed = true; });
+				}
+				do {
+					member.host->update();
+				} while (member.socket->wait(0));
+
+				// deadlines are in ms, waking up earlier than the next one would only spin
+				uint64_t wake = member.joined || member.natType == NatType::Unknown ? member.host->nextDeadline() * 1000 : member.joinAt;
+				wake = std::max(wake, (now / 1000 + 1) * 1000);
+				if (wake != member.scheduled) {
+					member.scheduled = wake;
+					due.push(Due(wake, id));
+				}
+			}
+		}
+	}
+}
+
+void testRoomScenarios()
+{
+	// punching timers and ports take rand(), seeded for repeatable runs
+	srand(1);
+	TestNetwork network(10000);
+	VirtualLink link;
+	link.delayUs = 20000;
+	link.jitterUs = 5000;
+	link.loss = 0.01;
+	link.reorder = 0.01;
+	link.reorderUs = 3000;
+
+	std::vector<std::vector<NatType>> layout = rooms();
+	std::vector<std::unique_ptr<Member>> members;
+	for (size_t room = 0; room < layout.size(); ++room) {
+		NetAddress master = NetAddress::ipv4(MASTER_IP + (uint32_t)room, MASTER_PORT);
+		for (size_t slot = 0; slot <= layout[room].size(); ++slot) {
+			std::unique_ptr<Member> member(new Member());
+			member->room = room;
+			member->master = master;
+			ISocketBackend* backend;
+			if (slot == 0) {
+				member->natType = NatType::Unknown;
+				member->joinAt = network.now();
+				backend = network.addHost(MASTER_IP + (uint32_t)room, VirtualNetwork::NO_NAT, link);
+			} else {
+				uint32_t index = (uint32_t)members.size();
+				VirtualNat nat;
+				nat.type = layout[room][slot - 1];
+				nat.publicIp = NAT_IP + index;
+				nat.portDelta = 1 + (int)(index % 3);
+				member->natType = nat.type;
+				member->joinAt = network.now() + slot * JOIN_PERIOD_US;
+				backend = network.addHost(HOST_IP + index, network.addNat(nat), link);
+			}
+
+			member->socket.reset(new Socket(backend));
+			EXPECT(member->socket->bind(NetAddress::any(slot == 0 ? MASTER_PORT : 0)));
+			member->host.reset(new NetHost(slot == 0, *member->socket, { member.get() }));
+			member->host->resolveNat(TestNetwork::stunServers(), nullptr);
+			snprintf(member->host->nickname, sizeof(member->host->nickname), "room%u.%u", (uint32_t)room, (uint32_t)slot);
+			members.push_back(std::move(member));
+		}
+	}
+
+	run(network, members, network.now() + RUN_US);
+
+	for (std::unique_ptr<Member> const& member : members) {
+		std::vector<NatType> const& room = layout[member->room];
+		size_t expected = room.size();
+		if (member->natType == NatType::Symmetric) {
+			expected -= std::count(room.begin(), room.end(), NatType::Symmetric) - 1;
+		}
+		char const* natName = member->natType == NatType::Unknown ? "master" : name(member->natType);
+		EXPECT_MSG(!member->failed, "room %u: %s host failed to join", (uint32_t)member->room, natName);
+		EXPECT_MSG(member->connected >= expected, "room %u: %s host connected to %u of %u peers",
+			(uint32_t)member->room, natName, (uint32_t)member->connected, (uint32_t)expected);
+		// the table other threads read has to agree with the notifications
+		NetHost::PeerTable const& table = member->host->peerTable();
+		size_t published = 0;
+		for (size_t slot = 0; slot < table.entries.capacity(); ++slot) {
+			NetHost::PeerTable::Entry entry;
+			if (table.entries.load(table.entries.handle(slot), entry) && entry.status == NetHost::PeerInfo::Connected) {
+				published += 1;
+			}
+		}
+		EXPECT_MSG(published == member->connected, "room %u: %s host publishes %u of %u connected peers",
+			(uint32_t)member->room, natName, (uint32_t)published, (uint32_t)member->connected);
+		// unnamed placeholders too, 'queryPeerInfos' skips them
+		size_t entries = member->host->metrics().snapshot().peerMetrics.size();
+		EXPECT_MSG(entries <= room.size(), "room %u: %s host keeps %u entries for %u peers",
+			(uint32_t)member->room, natName, (uint32_t)entries, (uint32_t)room.size());
+		if (member->natType != NatType::Unknown) {
+			NatType detected = member->host->natInfo().type;
+			EXPECT_MSG(detected == member->natType, "room %u: %s host detected as %s", (uint32_t)member->room, natName, name(detected));
+		}
+	}
+}
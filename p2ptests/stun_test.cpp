@@ -0,0 +1,157 @@
+#include "tests.h"
+#include "stun_client.h"
+#include "vnet.h"
+
+#include <stdio.h>
+#include <vector>
+
+
+// StunClient against the VirtualNetwork STUN server, one NAT box of every type in front of the client.
+
+namespace {
+	const uint32_t CLIENT_IP = HOST_IP + 1;
+	const uint32_t CLIENT_NAT_IP = NAT_IP + 1;
+	const uint64_t CLASSIFY_LIMIT_MS = 1000;        // a few RTTs plus the short retry timeouts
+	const uint64_t BLOCKED_LIMIT_MS = 5000;         // all bind retries spent
+
+	struct Case {
+		NatType natType;    // Unknown - no NAT at all
+		int portDelta;
+		NatType expected;
+	};
+
+	// Runs the started client until 'done' holds or for 10 s, returns how long it took, ms.
+	template <typename Done>
+	uint64_t run(VirtualNetwork& network, Socket const& socket, StunClient& stun, Done done)
+	{
+		uint64_t start = network.now();
+		uint8_t buffer[1500];
+		std::vector<uint32_t> ready;
+
+		while (!done() && network.now() - start < 10 * 1000000) {
+			// the client polls its retry timers, so time moves in 1 ms steps at most
+			network.advance(std::min(network.nextEvent(), network.now() + 1000));
+			network.takeReady(ready);
+			Clock::tick();
+
+			NetAddress src;
+			int count = 0;
+			while ((count = socket.recvfrom(buffer, sizeof(buffer), 0, src)) > 0) {
+				CBytes bytes(buffer, buffer + count);
+				if (StunClient::isStunMessage(bytes)) {
+					stun.onResponse(src, bytes);
+				}
+			}
+			stun.update();
+		}
+		return (network.now() - start) / 1000;
+	}
+
+	// Runs the client until it's done, returns how long it took, ms.
+	uint64_t classify(VirtualNetwork& network, Socket const& socket, StunClient& stun, char const* cachePath = nullptr)
+	{
+		Clock::tick();
+		stun.start(socket, TestNetwork::stunServers(), cachePath);
+		return run(network, socket, stun, [&stun]() { return !stun.active(); });
+	}
+
+	void runCase(Case const& test, VirtualLink const& link)
+	{
+		TestNetwork network(link.delayUs);
+
+		int nat = VirtualNetwork::NO_NAT;
+		if (test.natType != NatType::Unknown) {
+			VirtualNat config;
+			config.type = test.natType;
+			config.publicIp = CLIENT_NAT_IP;
+			config.portDelta = test.portDelta;
+			nat = network.addNat(config);
+		}
+
+		Socket socket(network.addHost(CLIENT_IP, nat, link));
+		EXPECT(socket.bind(NetAddress::any(0)));
+
+		StunClient stun;
+		uint64_t elapsed = classify(network, socket, stun);
+		StunClient::Result const& result = stun.result();
+
+		char const* natName = test.natType == NatType::Unknown ? "none" : name(test.natType);
+		EXPECT_MSG(!stun.active(), "NAT %s: not classified in %llu ms", natName, (unsigned long long)elapsed);
+		EXPECT_MSG(result.type == test.expected, "NAT %s: classified as %s", natName, name(result.type));
+
+		uint64_t limit = (test.expected == NatType::Blocked) ? BLOCKED_LIMIT_MS : CLASSIFY_LIMIT_MS;
+		EXPECT_MSG(elapsed <= limit, "NAT %s: classified in %llu ms", natName, (unsigned long long)elapsed);
+
+		if (test.expected == NatType::Symmetric) {
+			EXPECT_MSG(result.portDelta == test.portDelta, "NAT %s: port delta %d instead of %d", natName, result.portDelta, test.portDelta);
+		}
+		if (test.expected != NatType::Blocked) {
+			uint32_t whiteIp = (nat == VirtualNetwork::NO_NAT || test.natType == NatType::Open) ? CLIENT_IP : CLIENT_NAT_IP;
+			NetAddress white = NetAddress::ipv4(whiteIp, result.whiteAddress.getport());
+			EXPECT_MSG(result.whiteAddress == white, "NAT %s: white address %s", natName, toString(result.whiteAddress).c_str());
+		}
+	}
+}
+
+void testStunClassification()
+{
+	const Case CASES[] = {
+		{ NatType::Unknown, 1, NatType::Open },
+		{ NatType::Open, 1, NatType::Open },
+		{ NatType::FullCone, 1, NatType::FullCone },
+		{ NatType::AddressRestricted, 1, NatType::AddressRestricted },
+		{ NatType::PortRestricted, 1, NatType::PortRestricted },
+		{ NatType::Symmetric, 1, NatType::Symmetric },
+		{ NatType::Symmetric, 4, NatType::Symmetric },
+		{ NatType::Blocked, 1, NatType::Blocked },
+	};
+
+	VirtualLink link;
+	link.delayUs = 20000;
+	for (Case const& test : CASES) {
+		runCase(test, link);
+	}
+}
+
+
+// Warm start after the mapping of the cached white address expired: the cached result is published
+// at once, but its address has to be replaced with the new mapping as soon as the bind of this run
+// is answered, well before the classification is over.
+void testStunWarmStart()
+{
+	const char* const CACHE_PATH = "stun_warm_start.txt";
+	const uint32_t LIFETIME_MS = 5000;
+	remove(CACHE_PATH);
+
+	TestNetwork network(20000);
+	VirtualLink link;
+	link.delayUs = 20000;
+	VirtualNat config;
+	config.type = NatType::PortRestricted;
+	config.publicIp = CLIENT_NAT_IP;
+	config.mappingLifetimeMs = LIFETIME_MS;
+	Socket socket(network.addHost(CLIENT_IP, network.addNat(config), link));
+	EXPECT(socket.bind(NetAddress::any(0)));
+
+	StunClient cold;
+	classify(network, socket, cold, CACHE_PATH);
+	NetAddress stale = cold.result().whiteAddress;
+	EXPECT_MSG(cold.result().type == NatType::PortRestricted, "cold start: classified as %s", name(cold.result().type));
+
+	network.advance(network.now() + 2 * LIFETIME_MS * 1000);
+	StunClient warm;
+	Clock::tick();
+	warm.start(socket, TestNetwork::stunServers(), CACHE_PATH);
+	EXPECT_MSG(warm.ready() && !warm.mapped() && warm.result().whiteAddress == stale, "cache entry is not published: %s",
+		toString(warm.result().whiteAddress).c_str());
+
+	uint64_t elapsed = run(network, socket, warm, [&warm]() { return warm.mapped(); });
+	NetAddress white = warm.result().whiteAddress;
+	EXPECT_MSG(warm.mapped() && warm.active(), "bind answered in %llu ms, %s", (unsigned long long)elapsed, warm.active() ? "still probing" : "after classification");
+	EXPECT_MSG(white != stale && white.getport() != 0, "white address %s, the expired one is %s", toString(white).c_str(), toString(stale).c_str());
+
+	run(network, socket, warm, [&warm]() { return !warm.active(); });
+	EXPECT_MSG(warm.result().type == NatType::PortRestricted && warm.result().whiteAddress == white, "warm start: %s at %s",
+		name(warm.result().type), toString(warm.result().whiteAddress).c_str());
+	remove(CACHE_PATH);
+}
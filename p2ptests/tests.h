@@ -0,0 +1,67 @@
+#pragma once
+
+#include "vnet.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+// Minimal checks for the test runner: a failed EXPECT is reported and fails the test, the test goes on.
+struct TestContext {
+	static int failures;
+};
+
+#define EXPECT(COND) do { \
+		if (!(COND)) { \
+			fprintf(stderr, "%s:%d: EXPECT(%s) failed\n", __FILE__, __LINE__, #COND); \
+			TestContext::failures += 1; \
+		} \
+	} while (0)
+
+#define EXPECT_MSG(COND, ...) do { \
+		if (!(COND)) { \
+			fprintf(stderr, "%s:%d: EXPECT(%s) failed: ", __FILE__, __LINE__, #COND); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+			TestContext::failures += 1; \
+		} \
+	} while (0)
+
+
+// Addresses of the VirtualNetwork tests. Hosts and NAT boxes take the base address plus an index.
+const uint32_t STUN_IP = 0x0D000001;
+const uint32_t STUN_ALT_IP = 0x0D000002;
+const uint32_t HOST_IP = 0x0A000000;
+const uint32_t NAT_IP = 0x0C000000;
+
+inline char const* name(NatType type)
+{
+	static char const* const NAMES[] = { "Unknown", "Open", "FullCone", "AddressRestricted", "PortRestricted", "Symmetric", "Blocked" };
+	return NAMES[(int)type];
+}
+
+// VirtualNetwork with the STUN server at STUN_IP and STUN_ALT_IP, 'serverDelayUs' away from every host.
+struct TestNetwork : VirtualNetwork {
+	explicit TestNetwork(uint32_t serverDelayUs) : VirtualNetwork(1)
+	{
+		VirtualLink serverLink;
+		serverLink.delayUs = serverDelayUs;
+		addStunServer(STUN_IP, STUN_ALT_IP, serverLink);
+	}
+
+	// The server list for StunClient and NetHost::resolveNat.
+	static std::vector<std::string> stunServers() { return std::vector<std::string>{ "13.0.0.1" }; }
+};
+
+
+void testStunClassification();
+void testStunWarmStart();
+void testPacketViews();
+void testNatLifetime();
+void testMetricsServer();
+void testRoomScenarios();
+void testPunchAllocations();
+void testForwardAllocations();
+void testConcurrentPool();
+void testKeepAlivePaths();